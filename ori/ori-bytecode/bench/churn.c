@@ -0,0 +1,258 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "memory.h"
+#include "vm.h"
+
+// Garbage collector churn: a generated script that keeps replacing strings (concatenations, ropes and slices),
+// maps and frozen maps held in a few globals, so nearly everything it allocates dies young and a little lives on
+// Statements are interpreted one at a time like ori - runs its input, so the heap has to stay small on its own
+// Prints the time taken, the peak heap and peak RSS
+// Build with the collector's counters to get its pause histograms as well (printed to stderr when the VM is freed):
+//     CFLAGS=-DDEBUG_GC_STATS bench/run.sh churn
+// Usage: churn [statements] [seed]
+
+#define DEFAULT_STATEMENTS 800000
+#define STRINGS 8
+#define MAPS 6
+// Strings longer than this are replaced by a short one rather than grown
+#define MAX_STRING_LENGTH 3000
+// Range of the keys of the map that keeps some strings alive until the end
+#define KEPT 300
+
+// Xorshift, so a given seed always generates the same script
+static uint64_t randomState = 88172645463325252ull;
+
+static uint64_t nextRandom()
+{
+    randomState ^= randomState << 13;
+    randomState ^= randomState >> 7;
+    randomState ^= randomState << 17;
+    return randomState;
+}
+
+static int randomBelow(int limit)
+{
+    return (int)(nextRandom() % (uint64_t)limit);
+}
+
+// Random number in [0, 1)
+static double randomFraction()
+{
+    return (double)(nextRandom() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static double now()
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+// The statement being generated
+static char statement[1024];
+static int statementLength;
+
+static void emit(const char* format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    statementLength += vsnprintf(statement + statementLength, sizeof(statement) - statementLength, format, args);
+    va_end(args);
+}
+
+// Pieces strings are grown with (with their lengths in code points, which is what slices index by)
+static const char* pieces[] = {"abc", "012345678901234567890123456789", "üÿï",
+                               "xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx", "🌍z"};
+static const int pieceLengths[] = {3, 30, 3, 40, 2};
+
+// Length in code points of what each string global holds
+static int lengths[STRINGS];
+static bool isKept[KEPT];
+
+// A map key of any kind: strings, numbers, maps, frozen maps, slices or booleans
+static void emitKey()
+{
+    double r = randomFraction();
+    if (r < 0.3)
+        emit("\"k%d\"", randomBelow(50));
+    else if (r < 0.55)
+        emit("%d", randomBelow(40));
+    else if (r < 0.7)
+        emit("m%d", randomBelow(MAPS));
+    else if (r < 0.8)
+        emit("f%d", randomBelow(MAPS));
+    else if (r < 0.9)
+        emit("s%d[0:1]", randomBelow(STRINGS));
+    else
+        emit("true");
+}
+
+// A new map (or frozen map) with a few entries
+static void emitMapLiteral(bool isFrozen, int i, int string)
+{
+    emit(isFrozen ? "f%d = #{" : "m%d = {", randomBelow(MAPS));
+    emitKey();
+    emit(": %d, ", i);
+    emitKey();
+    emit(": s%d, \"n\": %d};", string, i);
+}
+
+static void generateStatement(int i)
+{
+    statementLength = 0;
+    int a = randomBelow(STRINGS);
+    int b = randomBelow(STRINGS);
+    double r = randomFraction();
+    if (r < 0.2)
+    {
+        int piece = randomBelow(sizeof(pieces) / sizeof(pieces[0]));
+        int digits = snprintf(NULL, 0, "%d", i);
+        if (lengths[b] + pieceLengths[piece] > MAX_STRING_LENGTH)
+        {
+            emit("s%d = \"r%d\";", a, i);
+            lengths[a] = 1 + digits;
+        }
+        else
+        {
+            emit("s%d = s%d + \"%s\" + \"%d\";", a, b, pieces[piece], i);
+            lengths[a] = lengths[b] + pieceLengths[piece] + digits;
+        }
+    }
+    else if (r < 0.3)
+    {
+        int start = randomBelow(lengths[b]);
+        int end = start + randomBelow(lengths[b] - start + 1);
+        if (end == start)
+        {
+            emit("s%d = \"e%d\";", a, i);
+            lengths[a] = 1 + snprintf(NULL, 0, "%d", i);
+        }
+        else
+        {
+            emit("s%d = s%d[%d:%d];", a, b, start, end);
+            lengths[a] = end - start;
+        }
+    }
+    else if (r < 0.35)
+    {
+        emit("sink = s%d[%d];", b, randomBelow(lengths[b]));
+    }
+    else if (r < 0.45)
+    {
+        emit("m%d[", randomBelow(MAPS));
+        emitKey();
+        emit("] = s%d;", b);
+    }
+    else if (r < 0.52)
+    {
+        emit("m%d[", randomBelow(MAPS));
+        emitKey();
+        emit("] = m%d;", randomBelow(MAPS));
+    }
+    else if (r < 0.57)
+    {
+        emitMapLiteral(false, i, b);
+    }
+    else if (r < 0.65)
+    {
+        emit("f%d = f%d + m%d;", randomBelow(MAPS), randomBelow(MAPS), randomBelow(MAPS));
+    }
+    else if (r < 0.68)
+    {
+        emitMapLiteral(true, i, b);
+    }
+    else if (r < 0.8)
+    {
+        emit("sink = %c%d[", randomBelow(2) ? 'm' : 'f', randomBelow(MAPS));
+        emitKey();
+        emit("] == null;");
+    }
+    else if (r < 0.9)
+    {
+        int prefix = lengths[b] < 5 ? lengths[b] : 5;
+        emit("sink = \"${%c%d[\"n\"]} ${s%d[0:%d]}\";", randomBelow(2) ? 'm' : 'f', randomBelow(MAPS), b, prefix);
+    }
+    else if (r < 0.93)
+    {
+        emit("keep[%d] = s%d + \"!\";", i % KEPT, b);
+        isKept[i % KEPT] = true;
+    }
+    else if (r < 0.96)
+    {
+        int k = randomBelow(KEPT);
+        emit(isKept[k] ? "sink = keep[%d];" : "sink = keep[%d] == null;", k);
+    }
+    else
+    {
+        // The same key in a map and in another map or frozen map
+        emit("sink = m%d[", randomBelow(MAPS));
+        int keyStart = statementLength;
+        emitKey();
+        int keyLength = statementLength - keyStart;
+        emit("] == %c%d[%.*s];", randomBelow(2) ? 'm' : 'f', randomBelow(MAPS), keyLength, statement + keyStart);
+    }
+}
+
+int main(int argc, const char* argv[])
+{
+    int statements = argc > 1 ? atoi(argv[1]) : DEFAULT_STATEMENTS;
+    if (argc > 2)
+        randomState = strtoull(argv[2], NULL, 10) | 1;
+
+    VMOptions options = {false, SIZE_MAX, false, NULL};
+    initVM(options);
+
+    // What the script prints isn't of interest, only the report at the end is
+    fflush(stdout);
+    int output = dup(STDOUT_FILENO);
+    int devNull = open("/dev/null", O_WRONLY);
+    dup2(devNull, STDOUT_FILENO);
+    close(devNull);
+
+    int line = 1;
+    static const char* setup[] = {"let sink;", "let keep = {};"};
+    for (size_t i = 0; i < sizeof(setup) / sizeof(setup[0]); i++)
+        interpret(setup[i], line++);
+    for (int i = 0; i < STRINGS; i++)
+    {
+        snprintf(statement, sizeof(statement), "let s%d = \"start%dé\";", i, i);
+        interpret(statement, line++);
+        lengths[i] = 7;
+    }
+    for (int i = 0; i < MAPS; i++)
+    {
+        snprintf(statement, sizeof(statement), "let m%d = {}; let f%d = #{};", i, i);
+        interpret(statement, line++);
+    }
+
+    double start = now();
+    for (int i = 0; i < statements; i++)
+    {
+        generateStatement(i);
+        if (interpret(statement, line++) != INTERPRET_OK)
+        {
+            fprintf(stderr, "Failed on: %s\n", statement);
+            return 1;
+        }
+    }
+    double elapsed = now() - start;
+    fflush(stdout);
+    dup2(output, STDOUT_FILENO);
+    close(output);
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    printf("%d statements in %.3f s, peak heap %.1f MB, peak RSS %.1f MB\n", statements, elapsed,
+           vm.memoryStats.peakHeapBytes / 1e6, usage.ru_maxrss / 1e3);
+    fflush(stdout);
+
+    freeVM();
+    return 0;
+}
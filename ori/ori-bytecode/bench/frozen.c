@@ -0,0 +1,126 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "hamt.h"
+#include "object.h"
+#include "table.h"
+#include "vm.h"
+
+// Frozen maps (HAMTs) against copying a table, by number of entries:
+// taking a snapshot and changing one entry (every snapshot is kept, so the bytes are what each one costs),
+// removing one entry with hamtRemove (the same way),
+// loading all entries with a builder or with one hamtSet each, and looking keys up
+// Times in nanoseconds, bytes as counted by the VM (vm.bytesAllocated)
+
+#define SNAPSHOT_ENTRIES (256 * 1024)
+#define LOOKUPS (8 * 1024 * 1024)
+
+static double now()
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+int main()
+{
+    VMOptions options = {false, SIZE_MAX, false, NULL};
+    initVM(options);
+
+    printf("%6s | %-22s | %-22s | %-22s | %-15s | %-16s\n", "", "copy table + update", "hamtSet (snapshot)",
+           "hamtRemove (snapshot)", "load per entry", "get");
+    printf("%6s | %10s %11s | %10s %11s | %10s %11s | %7s %7s | %7s %8s\n", "n", "table ns", "bytes", "hamt ns",
+           "bytes", "hamt ns", "bytes", "builder", "set", "table", "hamt");
+    int sizes[] = {16, 256, 4096, 65536};
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+    {
+        int count = sizes[s];
+        // Enough snapshots to time, without copying more than SNAPSHOT_ENTRIES entries in total
+        int snapshots = SNAPSHOT_ENTRIES / count > 16 ? SNAPSHOT_ENTRIES / count : 16;
+
+        ObjString** keys = (ObjString**)malloc(sizeof(ObjString*) * count);
+        char chars[32];
+        for (int i = 0; i < count; i++)
+            keys[i] = copyLiteral(chars, snprintf(chars, sizeof(chars), "option_%d", i));
+
+        Table config;
+        initTable(&config);
+        for (int i = 0; i < count; i++)
+            tableSet(&config, keys[i], NUMBER_VAL(i));
+
+        double start = now();
+        HamtBuilder builder;
+        initHamtBuilder(&builder, NULL);
+        for (int i = 0; i < count; i++)
+            hamtBuilderSet(&builder, OBJ_VAL((Obj*)keys[i]), NUMBER_VAL(i));
+        ObjFrozenMap* frozen = finishHamtBuilder(&builder);
+        double builderLoad = (now() - start) / count * 1e9;
+
+        start = now();
+        initHamtBuilder(&builder, NULL);
+        ObjFrozenMap* loaded = finishHamtBuilder(&builder);
+        for (int i = 0; i < count; i++)
+            loaded = hamtSet(loaded, OBJ_VAL((Obj*)keys[i]), NUMBER_VAL(i));
+        double setLoad = (now() - start) / count * 1e9;
+
+        Table* copies = (Table*)malloc(sizeof(Table) * snapshots);
+        size_t bytes = vm.bytesAllocated;
+        start = now();
+        for (int i = 0; i < snapshots; i++)
+        {
+            initTable(&copies[i]);
+            tableAddAll(&config, &copies[i]);
+            tableSet(&copies[i], keys[i % count], NUMBER_VAL(-1));
+        }
+        double copyTime = (now() - start) / snapshots * 1e9;
+        double copyBytes = (double)(vm.bytesAllocated - bytes) / snapshots;
+
+        ObjFrozenMap** versions = (ObjFrozenMap**)malloc(sizeof(ObjFrozenMap*) * snapshots);
+        bytes = vm.bytesAllocated;
+        start = now();
+        for (int i = 0; i < snapshots; i++)
+            versions[i] = hamtSet(frozen, OBJ_VAL((Obj*)keys[i % count]), NUMBER_VAL(-1));
+        double hamtTime = (now() - start) / snapshots * 1e9;
+        double hamtBytes = (double)(vm.bytesAllocated - bytes) / snapshots;
+
+        bytes = vm.bytesAllocated;
+        start = now();
+        for (int i = 0; i < snapshots; i++)
+            versions[i] = hamtRemove(frozen, OBJ_VAL((Obj*)keys[i % count]));
+        double removeTime = (now() - start) / snapshots * 1e9;
+        double removeBytes = (double)(vm.bytesAllocated - bytes) / snapshots;
+
+        volatile double sum = 0;
+        Value value;
+        start = now();
+        for (int i = 0; i < LOOKUPS; i++)
+        {
+            tableGet(&config, keys[i % count], &value);
+            sum += AS_NUMBER(value);
+        }
+        double tableGetTime = (now() - start) / LOOKUPS * 1e9;
+        start = now();
+        for (int i = 0; i < LOOKUPS; i++)
+        {
+            hamtGet(frozen, OBJ_VAL((Obj*)keys[i % count]), &value);
+            sum += AS_NUMBER(value);
+        }
+        double hamtGetTime = (now() - start) / LOOKUPS * 1e9;
+
+        printf("%6d | %10.0f %11.0f | %10.0f %11.0f | %10.0f %11.0f | %7.0f %7.0f | %7.1f %8.1f\n", count, copyTime,
+               copyBytes, hamtTime, hamtBytes, removeTime, removeBytes, builderLoad, setLoad, tableGetTime,
+               hamtGetTime);
+
+        for (int i = 0; i < snapshots; i++)
+            freeTable(&copies[i]);
+        freeTable(&config);
+        free(versions);
+        free(copies);
+        free(keys);
+    }
+
+    freeVM();
+    return 0;
+}
@@ -0,0 +1,118 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "object.h"
+#include "vm.h"
+
+// String hashing: throughput by key length of the VM's hash (stringHash) and of its keyed fallback (SipHash),
+// next to the byte at a time FNV-1a it replaced, then how evenly each spreads keys over a table
+// (probe lengths of linear probing at 3/4 load, indices taken by masking)
+
+#define BYTES_PER_LENGTH (256 * 1024 * 1024)
+#define PROBED_KEYS (1024 * 1024)
+
+static double now()
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+static uint32_t hashFnv(const char* key, int length)
+{
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < length; i++)
+    {
+        hash ^= (uint8_t)key[i];
+        hash *= 16777619;
+    }
+    return hash;
+}
+
+// The VM's hash, through the string it caches it in
+static ObjString* hashed;
+
+static uint32_t hashVm(const char* key, int length)
+{
+    (void)key;
+    (void)length;
+    hashed->isHashed = false;
+    return stringHash(hashed);
+}
+
+typedef uint32_t (*HashFunction)(const char* key, int length);
+
+static double megabytesPerSecond(HashFunction hash, const char* key, int length)
+{
+    long iterations = BYTES_PER_LENGTH / length;
+    volatile uint32_t sink = 0;
+    double start = now();
+    for (long i = 0; i < iterations; i++)
+        sink += hash(key, length);
+    return (double)iterations * length / (now() - start) / 1e6;
+}
+
+static void printProbes(const char* name, HashFunction hash, ObjString** keys, int count)
+{
+    int capacity = 1;
+    while (capacity * 3 < count * 4)
+        capacity *= 2;
+    bool* used = (bool*)calloc(capacity, sizeof(bool));
+
+    long total = 0;
+    int longest = 0;
+    for (int i = 0; i < count; i++)
+    {
+        hashed = keys[i];
+        uint32_t index = hash(keys[i]->chars, keys[i]->length) & (capacity - 1);
+        int probes = 1;
+        while (used[index])
+        {
+            index = (index + 1) & (capacity - 1);
+            probes++;
+        }
+        used[index] = true;
+        total += probes;
+        if (probes > longest)
+            longest = probes;
+    }
+    printf("  %-8s average probe %.2f, longest %d\n", name, (double)total / count, longest);
+    free(used);
+}
+
+int main()
+{
+    VMOptions options = {false, SIZE_MAX, false, NULL};
+    initVM(options);
+
+    printf("%6s %10s %10s %10s (MB/s)\n", "length", "fnv-1a", "ori", "siphash");
+    int lengths[] = {4, 8, 16, 32, 64, 256, 4096};
+    char* key = (char*)malloc(4096);
+    for (int i = 0; i < 4096; i++)
+        key[i] = (char)('a' + rand() % 26);
+    for (size_t i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++)
+    {
+        hashed = copyString(key, lengths[i]);
+        printf("%6d %10.0f %10.0f %10.0f\n", lengths[i], megabytesPerSecond(hashFnv, key, lengths[i]),
+               megabytesPerSecond(hashVm, key, lengths[i]), megabytesPerSecond(hashStringKeyed, key, lengths[i]));
+    }
+    free(key);
+
+    const char* formats[] = {"var%d", "%d", "k_%08x"};
+    ObjString** keys = (ObjString**)malloc(sizeof(ObjString*) * PROBED_KEYS);
+    char chars[32];
+    for (size_t i = 0; i < sizeof(formats) / sizeof(formats[0]); i++)
+    {
+        for (int k = 0; k < PROBED_KEYS; k++)
+            keys[k] = copyString(chars, snprintf(chars, sizeof(chars), formats[i], k));
+        printf("%d keys like \"%s\":\n", PROBED_KEYS, formats[i]);
+        printProbes("fnv-1a", hashFnv, keys, PROBED_KEYS);
+        printProbes("ori", hashVm, keys, PROBED_KEYS);
+    }
+    free(keys);
+
+    freeVM();
+    return 0;
+}
@@ -0,0 +1,82 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+
+#include "chunk.h"
+#include "memory.h"
+#include "object.h"
+#include "vm.h"
+
+// What object headers cost on a heap of millions of small strings (1 to 8 bytes) held in a map:
+// the bytes each string takes in the old generation (its cell and whatever it owns, as counted by the VM),
+// then the time the next full collection takes to sweep them all once the map is dropped
+// Prints peak RSS at the end
+// Usage: header [strings]
+
+#define DEFAULT_STRINGS (3 * 1000 * 1000)
+
+static double now()
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+static void collectFully()
+{
+    vm.collectionRequest = GC_MAJOR;
+    collectGarbage();
+}
+
+int main(int argc, const char* argv[])
+{
+    int count = argc > 1 ? atoi(argv[1]) : DEFAULT_STRINGS;
+
+    VMOptions options = {false, SIZE_MAX, false, NULL};
+    initVM(options);
+    // Tracing the roots goes through the running chunk's constants
+    Chunk chunk;
+    initChunk(&chunk);
+    vm.chunk = &chunk;
+
+    // The map is only reachable from the stack, and is looked up again after every collection since it can move
+    push(OBJ_VAL((Obj*)newMap()));
+    char chars[8];
+    for (int i = 0; i < count; i++)
+    {
+        int length = 1 + i % 8;
+        for (int j = 0; j < length; j++)
+            chars[j] = 'a' + (i >> (j * 3)) % 26;
+        ObjString* string = copyString(chars, length);
+        ObjMap* map = AS_MAP(vm.stack[0]);
+        valueTableSet(&map->table, NUMBER_VAL(i), OBJ_VAL((Obj*)string));
+        writeBarrier((Obj*)map, OBJ_VAL((Obj*)string));
+        // Allocating doesn't collect by itself, it only asks for a collection at the next safepoint
+        if (vm.collectionRequest != GC_NONE)
+            collectGarbage();
+    }
+    // Twice, so that every string has been promoted out of the nursery and swept into place
+    collectFully();
+    collectFully();
+    size_t bytes = vm.memoryStats.oldObjectBytes[OBJ_STRING];
+    printf("%d strings: %zu bytes in the old generation, %.1f per string (sizeof(ObjString) %zu)\n", count, bytes,
+           (double)bytes / count, sizeof(ObjString));
+
+    // Marking finds nothing once the map is gone, the collection after that has to sweep every string first
+    pop();
+    collectFully();
+    double start = now();
+    collectFully();
+    printf("sweeping them once dead: %.2f ms\n", (now() - start) * 1e3);
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    printf("peak RSS %.1f MB\n", usage.ru_maxrss / 1e3);
+
+    vm.chunk = NULL;
+    freeChunk(&chunk);
+    freeVM();
+    return 0;
+}
@@ -0,0 +1,119 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "object.h"
+#include "table.h"
+#include "vm.h"
+
+// Lookups in a table using the keys' own hash next to the same table once it has switched to the keyed hash
+// (SipHash, see slotHash), by key length, in nanoseconds per lookup
+// Keyed tables should only be slower by the first hashing of each key, not by SipHash on every lookup
+// Then map keys (a ValueTable) that all share their first group, found by brute force against this process' seed
+// the way a script that leaked it could, next to the same number of ordinary keys, in nanoseconds per operation
+// The colliding map should switch to the keyed hash and stay within a small factor of the ordinary one
+
+#define KEYS (64 * 1024)
+#define LOOKUPS (16 * 1024 * 1024)
+#define MAP_KEYS (4 * 1024)
+// Colliding keys share this many low bits of their hash, enough to start in the same group up to 64K slots
+#define MAP_COLLIDING_BITS 12
+
+static double now()
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+static double timeLookups(Table* table, ObjString** keys)
+{
+    volatile int found = 0;
+    Value value;
+    double start = now();
+    for (int i = 0; i < LOOKUPS; i++)
+        found += tableGet(table, keys[i % KEYS], &value);
+    return (now() - start) / LOOKUPS * 1e9;
+}
+
+// Insert the keys into a new map table, then look them all up LOOKUPS times
+static void timeMap(const char* name, Value* keys)
+{
+    ValueTable table;
+    initValueTable(&table);
+    double start = now();
+    for (int i = 0; i < MAP_KEYS; i++)
+        valueTableSet(&table, keys[i], NUMBER_VAL(i));
+    double insert = (now() - start) / MAP_KEYS * 1e9;
+
+    volatile int found = 0;
+    Value value;
+    start = now();
+    for (int i = 0; i < LOOKUPS; i++)
+        found += valueTableGet(&table, keys[i % MAP_KEYS], &value);
+    double lookup = (now() - start) / LOOKUPS * 1e9;
+
+    printf("%-10s %8.1f %8.1f %s\n", name, insert, lookup, table.isKeyed ? "keyed" : "");
+    freeValueTable(&table);
+}
+
+int main()
+{
+    VMOptions options = {false, SIZE_MAX, false, NULL};
+    initVM(options);
+
+    printf("%6s %8s %8s (ns/lookup)\n", "length", "hash", "keyed");
+    int lengths[] = {8, 32, 128, 512};
+    char* chars = (char*)malloc(512 + 1);
+    ObjString** keys = (ObjString**)malloc(sizeof(ObjString*) * KEYS);
+    for (size_t l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++)
+    {
+        int length = lengths[l];
+        for (int i = 0; i < KEYS; i++)
+        {
+            // Keys differ in their first characters, the rest is the same filler
+            memset(chars, 'x', length);
+            int prefix = snprintf(chars, 512, "%d_", i);
+            chars[prefix] = 'x';
+            keys[i] = copyString(chars, length);
+            stringHash(keys[i]);
+            keys[i]->isInterned = true;
+        }
+
+        Table plain;
+        initTable(&plain);
+        Table keyed;
+        initTable(&keyed);
+        // A table is only ever switched over when its probing gets too long, this does it from the start
+        keyed.isKeyed = true;
+        for (int i = 0; i < KEYS; i++)
+        {
+            tableSet(&plain, keys[i], NUMBER_VAL(i));
+            tableSet(&keyed, keys[i], NUMBER_VAL(i));
+        }
+
+        printf("%6d %8.1f %8.1f\n", length, timeLookups(&plain, keys), timeLookups(&keyed, keys));
+        freeTable(&plain);
+        freeTable(&keyed);
+    }
+
+    free(keys);
+    free(chars);
+
+    printf("\n%-10s %8s %8s (ns/op, %d map keys)\n", "keys", "insert", "lookup", MAP_KEYS);
+    Value* mapKeys = (Value*)malloc(sizeof(Value) * MAP_KEYS);
+    for (int i = 0; i < MAP_KEYS; i++)
+        mapKeys[i] = NUMBER_VAL(i);
+    timeMap("ordinary", mapKeys);
+    double number = 0;
+    for (int i = 0; i < MAP_KEYS; number++)
+    {
+        if ((hashValue(NUMBER_VAL(number)) & ((1 << MAP_COLLIDING_BITS) - 1)) == 0)
+            mapKeys[i++] = NUMBER_VAL(number);
+    }
+    timeMap("colliding", mapKeys);
+    free(mapKeys);
+    freeVM();
+    return 0;
+}
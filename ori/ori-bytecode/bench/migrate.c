@@ -0,0 +1,67 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "object.h"
+#include "table.h"
+#include "vm.h"
+
+// Latency of single inserts into a table that keeps growing (from empty to each size),
+// which is what incremental growing is for: percentiles and the longest insert, in nanoseconds
+
+static long long nanoseconds()
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec * 1000000000ll + time.tv_nsec;
+}
+
+static int compareLatencies(const void* a, const void* b)
+{
+    long long x = *(const long long*)a;
+    long long y = *(const long long*)b;
+    return x < y ? -1 : x > y;
+}
+
+int main()
+{
+    VMOptions options = {false, SIZE_MAX, false, NULL};
+    initVM(options);
+
+    int sizes[] = {100 * 1000, 1000 * 1000, 4 * 1000 * 1000};
+    int largest = sizes[sizeof(sizes) / sizeof(sizes[0]) - 1];
+    ObjString** keys = (ObjString**)malloc(sizeof(ObjString*) * largest);
+    char chars[32];
+    for (int i = 0; i < largest; i++)
+    {
+        keys[i] = copyString(chars, snprintf(chars, sizeof(chars), "sym_%d", i));
+        stringHash(keys[i]);
+        keys[i]->isInterned = true;
+    }
+    long long* latencies = (long long*)malloc(sizeof(long long) * largest);
+
+    printf("%8s %8s %8s %8s %8s %10s %9s (ns)\n", "inserts", "p50", "p99", "p99.9", "p99.99", "max", "capacity");
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+    {
+        int count = sizes[s];
+        Table table;
+        initTable(&table);
+        for (int i = 0; i < count; i++)
+        {
+            long long start = nanoseconds();
+            tableSet(&table, keys[i], NUMBER_VAL(i));
+            latencies[i] = nanoseconds() - start;
+        }
+        qsort(latencies, count, sizeof(long long), compareLatencies);
+        printf("%8d %8lld %8lld %8lld %8lld %10lld %9d\n", count, latencies[count / 2],
+               latencies[(long)count * 99 / 100], latencies[(long)count * 999 / 1000],
+               latencies[(long)count * 9999 / 10000], latencies[count - 1], table.capacity);
+        freeTable(&table);
+    }
+
+    free(latencies);
+    free(keys);
+    freeVM();
+    return 0;
+}
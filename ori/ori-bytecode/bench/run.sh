@@ -0,0 +1,21 @@
+#!/bin/bash
+
+# Build the benchmarks against the interpreter's sources (everything but main.c) and run them
+# Usage: bench/run.sh [name ...], with names of files in bench/ without their extension (all of them by default)
+# CC and CFLAGS are passed on to the build, e.g. CFLAGS=-U__SSE2__ bench/run.sh scan for the scalar scanner
+
+# Exit on error
+set -e
+
+cd "$(dirname "$0")/.."
+mkdir -p build/bench
+
+SOURCES=$(ls ./*.c | grep -v main.c)
+NAMES=${@:-$(ls bench/*.c | xargs -n 1 basename | sed 's/\.c$//')}
+
+for name in $NAMES; do
+    echo "== $name =="
+    # NDEBUG leaves out the tracing of common.h
+    ${CC:-clang} -O2 -DNDEBUG -I. $CFLAGS bench/$name.c $SOURCES -o build/bench/$name -lm
+    ./build/bench/$name
+done
@@ -0,0 +1,91 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "scanner.h"
+
+// Scanner throughput, in MB of source per second
+// The source is generated: indented code, comment lines and long string literals, which the scanner
+// skips over a block at a time with SIMD (build with CFLAGS=-U__SSE2__ to compare with the scalar loops)
+// A path can be given to scan a file instead
+
+#define GENERATED_SIZE (64 * 1024 * 1024)
+#define RUNS 5
+
+static double now()
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+static char* generateSource(size_t* size)
+{
+    static const char* lines[] = {
+        "    // Comments take up whole lines of long sources, and are skipped without looking at each character\n",
+        "let total = first + second * 12.5 - third / 4;\n",
+        "        print \"a fairly long string literal, whose body is also skipped a block at a time: ${total}\";\n",
+        "let greeting = \"hello\" + \" \" + \"world\";   // trailing comment\n",
+        "\n",
+        "print {\"key\": 1, \"other\": 2.25}[\"key\"] == #{\"key\": 1}[\"key\"];\n",
+    };
+    int lineCount = sizeof(lines) / sizeof(lines[0]);
+
+    char* source = (char*)malloc(GENERATED_SIZE + 256);
+    size_t length = 0;
+    for (int i = 0; length < GENERATED_SIZE; i++)
+    {
+        const char* line = lines[i % lineCount];
+        size_t lineLength = strlen(line);
+        memcpy(source + length, line, lineLength);
+        length += lineLength;
+    }
+    source[length] = '\0';
+    *size = length;
+    return source;
+}
+
+static char* readSource(const char* path, size_t* size)
+{
+    FILE* file = fopen(path, "rb");
+    if (file == NULL)
+    {
+        fprintf(stderr, "Could not open file \"%s\".\n", path);
+        exit(74);
+    }
+    fseek(file, 0L, SEEK_END);
+    *size = ftell(file);
+    rewind(file);
+
+    char* source = (char*)malloc(*size + 1);
+    *size = fread(source, 1, *size, file);
+    source[*size] = '\0';
+    fclose(file);
+    return source;
+}
+
+int main(int argc, const char* argv[])
+{
+    size_t size;
+    char* source = argc > 1 ? readSource(argv[1], &size) : generateSource(&size);
+
+    double best = 0;
+    long tokens = 0;
+    for (int run = 0; run < RUNS; run++)
+    {
+        double start = now();
+        initScanner(source, 1);
+        tokens = 0;
+        while (scanToken().type != TOKEN_EOF)
+            tokens++;
+        double seconds = now() - start;
+        if (best == 0 || seconds < best)
+            best = seconds;
+    }
+
+    printf("%.1f MB scanned at %.0f MB/s (%ld tokens, best of %d runs)\n", size / 1e6, size / 1e6 / best, tokens,
+           RUNS);
+    free(source);
+    return 0;
+}
@@ -0,0 +1,131 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "memory.h"
+#include "vm.h"
+
+// Small blocks from the VM's slabs against libc malloc, build both and compare:
+//     bench/run.sh slab
+//     CFLAGS=-DLIBC_ALLOCATOR bench/run.sh slab
+// Arrays grown through GROW_ARRAY a step at a time and freed again (the allocator alone, in nanoseconds per call),
+// then a request-like script run over and over with fresh globals each time (microseconds per request)
+// Prints peak RSS at the end
+// Usage: slab [requests]
+
+#define DEFAULT_REQUESTS 20000
+#define ARRAYS 256
+// Arrays are grown to this many values (so up to GROW_CAPACITY's step past it)
+#define MAX_ARRAY_COUNT 48
+#define ARRAY_ROUNDS 20000
+
+static double now()
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+// A handler that builds up some strings and maps and throws them away, with no globals from the last request
+static const char* request =
+    "let s0 = \"start0é\"; let s1 = \"start1é\"; let s2 = \"start2é\"; let s3 = \"start3é\";\n"
+    "let m0 = {}; let m1 = {}; let m2 = {}; let f0 = #{}; let f1 = #{};\n"
+    "let keep = {}; let sink;\n"
+    "s1 = s0 + \"🌍z\" + \"1\"; s3 = s0 + \"abc\" + \"2\";\n"
+    "m0[m0] = s3; sink = \"${m1[\"n\"]} ${s3[0:5]}\";\n"
+    "f0 = f1 + m1; s2 = s1[5:8];\n"
+    "m1 = {m0: 7, 35: s1, \"n\": 7}; sink = f1[20] == null;\n"
+    "m2[\"k11\"] = m1; f1 = f0 + m1;\n"
+    "s2 = s2 + \"üÿï\" + \"13\"; f0 = f1 + m2;\n"
+    "sink = \"${f0[\"n\"]} ${s2[0:5]}\"; keep[19] = s1 + \"!\";\n"
+    "s3 = s2 + \"012345678901234567890123456789\" + \"20\";\n"
+    "s0 = s3 + \"xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx\" + \"23\";\n"
+    "m1[\"k13\"] = m2; m1[true] = s0; m2[s3[0:1]] = s3; m1[32] = m2;\n"
+    "f1 = f0 + m1; sink = m2[\"k38\"] == f1[\"k38\"];\n"
+    "s1 = s0[41:46]; sink = f1[f0] == null;\n"
+    "m0 = {s0[0:1]: 54, \"k17\": s1, \"n\": 54}; f0 = #{\"k32\": 52, \"k28\": s2, \"n\": 52};\n"
+    "s1 = s3 + \"🌍z\" + \"55\"; s2 = s1 + \"üÿï\" + \"56\"; f1 = f0 + m0;\n"
+    "sink = \"${m0[\"n\"]} ${s2[0:5]}\"; keep[51] = s2 + \"!\"; sink = s2[4];\n"
+    "s0 = s1[19:30]; m0[f0] = s2; m0[true] = s1; sink = m1[true] == f1[true];\n";
+
+int main(int argc, const char* argv[])
+{
+    int requests = argc > 1 ? atoi(argv[1]) : DEFAULT_REQUESTS;
+
+    VMOptions options = {false, SIZE_MAX, false, NULL};
+    initVM(options);
+
+#ifdef SLAB_ALLOCATOR
+    printf("slabs:\n");
+#else
+    printf("libc malloc:\n");
+#endif
+
+    // Arrays start at 8 and double, each grown a different number of times so that all the size classes get used
+    Value** arrays = (Value**)calloc(ARRAYS, sizeof(Value*));
+    int* capacities = (int*)calloc(ARRAYS, sizeof(int));
+    long calls = 0;
+    double start = now();
+    for (int round = 0; round < ARRAY_ROUNDS; round++)
+    {
+        for (int i = 0; i < ARRAYS; i++)
+        {
+            int count = 1 + (i * 7 + round) % MAX_ARRAY_COUNT;
+            while (capacities[i] < count)
+            {
+                int oldCapacity = capacities[i];
+                capacities[i] = GROW_CAPACITY(oldCapacity);
+                arrays[i] = GROW_ARRAY(arrays[i], Value, oldCapacity, capacities[i], MEM_CONSTANTS);
+                calls++;
+            }
+            arrays[i][count - 1] = NUMBER_VAL(round);
+        }
+        for (int i = 0; i < ARRAYS; i++)
+        {
+            FREE_ARRAY(Value, arrays[i], capacities[i], MEM_CONSTANTS);
+            arrays[i] = NULL;
+            capacities[i] = 0;
+            calls++;
+        }
+    }
+    printf("  grow and free arrays: %.1f ns/call\n", (now() - start) / calls * 1e9);
+    free(capacities);
+    free(arrays);
+
+    // What the script prints isn't of interest, only the report at the end is
+    fflush(stdout);
+    int output = dup(STDOUT_FILENO);
+    int devNull = open("/dev/null", O_WRONLY);
+    dup2(devNull, STDOUT_FILENO);
+    close(devNull);
+
+    start = now();
+    for (int i = 0; i < requests; i++)
+    {
+        if (interpret(request, 1) != INTERPRET_OK)
+        {
+            fprintf(stderr, "Request %d failed\n", i);
+            return 1;
+        }
+        // A new request starts with fresh globals
+        freeTable(&vm.globals);
+        initTable(&vm.globals);
+    }
+    double elapsed = now() - start;
+    fflush(stdout);
+    dup2(output, STDOUT_FILENO);
+    close(output);
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    printf("  %d requests: %.2f us/request\n", requests, elapsed / requests * 1e6);
+    printf("  peak heap %.1f MB, peak RSS %.1f MB\n", vm.memoryStats.peakHeapBytes / 1e6, usage.ru_maxrss / 1e3);
+    fflush(stdout);
+
+    freeVM();
+    return 0;
+}
@@ -0,0 +1,120 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "object.h"
+#include "table.h"
+#include "vm.h"
+
+// Table operations by table size: inserting every key into an empty table, looking up keys that are in it (hits)
+// and keys that aren't (misses), in a random order so large tables don't fit in the cache,
+// then deleting and inserting keys again, in nanoseconds per operation
+
+#define OPERATIONS_PER_SIZE (16 * 1024 * 1024)
+#define RUNS 3
+
+static double now()
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+// Keys are symbols, like the ones the VM puts in tables
+static ObjString* makeKey(int index)
+{
+    char chars[32];
+    ObjString* key = copyString(chars, snprintf(chars, sizeof(chars), "key_%d", index));
+    stringHash(key);
+    key->isInterned = true;
+    return key;
+}
+
+// Best of RUNS of the given number of passes over the keys (in order), returns nanoseconds per key
+static double timeLookups(Table* table, ObjString** keys, int* order, int count, int passes)
+{
+    double best = 0;
+    for (int run = 0; run < RUNS; run++)
+    {
+        volatile int found = 0;
+        Value value;
+        double start = now();
+        for (int pass = 0; pass < passes; pass++)
+        {
+            for (int i = 0; i < count; i++)
+                found += tableGet(table, keys[order[i]], &value);
+        }
+        double elapsed = (now() - start) / ((double)passes * count) * 1e9;
+        if (run == 0 || elapsed < best)
+            best = elapsed;
+    }
+    return best;
+}
+
+int main()
+{
+    VMOptions options = {false, SIZE_MAX, false, NULL};
+    initVM(options);
+
+    printf("%8s %8s %8s %8s %8s (ns/op)\n", "entries", "insert", "hit", "miss", "del+set");
+    int sizes[] = {64, 1024, 16 * 1024, 256 * 1024, 2 * 1024 * 1024};
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+    {
+        int count = sizes[s];
+        int passes = OPERATIONS_PER_SIZE / count > 0 ? OPERATIONS_PER_SIZE / count : 1;
+
+        // The first half of the keys go in the table, the second half are looked up to miss
+        ObjString** keys = (ObjString**)malloc(sizeof(ObjString*) * count * 2);
+        for (int i = 0; i < count * 2; i++)
+            keys[i] = makeKey(i);
+        int* order = (int*)malloc(sizeof(int) * count);
+        for (int i = 0; i < count; i++)
+            order[i] = i;
+        for (int i = count - 1; i > 0; i--)
+        {
+            int j = rand() % (i + 1);
+            int swap = order[i];
+            order[i] = order[j];
+            order[j] = swap;
+        }
+
+        int insertPasses = passes / 4 > 0 ? passes / 4 : 1;
+        double start = now();
+        for (int pass = 0; pass < insertPasses; pass++)
+        {
+            Table table;
+            initTable(&table);
+            for (int i = 0; i < count; i++)
+                tableSet(&table, keys[i], NUMBER_VAL(i));
+            freeTable(&table);
+        }
+        double insert = (now() - start) / ((double)insertPasses * count) * 1e9;
+
+        Table table;
+        initTable(&table);
+        for (int i = 0; i < count; i++)
+            tableSet(&table, keys[i], NUMBER_VAL(i));
+        double hit = timeLookups(&table, keys, order, count, passes);
+        double miss = timeLookups(&table, keys + count, order, count, passes);
+
+        start = now();
+        for (int pass = 0; pass < insertPasses; pass++)
+        {
+            for (int i = 0; i < count; i++)
+            {
+                tableDelete(&table, keys[order[i]]);
+                tableSet(&table, keys[order[i]], NUMBER_VAL(i));
+            }
+        }
+        double churn = (now() - start) / ((double)insertPasses * count) * 1e9;
+
+        printf("%8d %8.1f %8.1f %8.1f %8.1f\n", count, insert, hit, miss, churn);
+        freeTable(&table);
+        free(order);
+        free(keys);
+    }
+
+    freeVM();
+    return 0;
+}
@@ -15,8 +15,8 @@ void initChunk(Chunk* chunk)
 void freeChunk(Chunk* chunk)
 {
     // Deallocate all of the memory
-    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-    FREE_ARRAY(int, chunk->lines, chunk->capacity);
+    FREE_SCRATCH_ARRAY(uint8_t, chunk->code, chunk->capacity, MEM_CHUNKS);
+    FREE_SCRATCH_ARRAY(int, chunk->lines, chunk->capacity, MEM_CHUNKS);
     freeValueArray(&chunk->constants);
     // Re-initialize the chunk to a blank state
     initChunk(chunk);
@@ -29,8 +29,8 @@ void writeChunk(Chunk* chunk, uint8_t byte, int line)
     {
         int oldCapacity = chunk->capacity;
         chunk->capacity = GROW_CAPACITY(oldCapacity);
-        chunk->code = GROW_ARRAY(chunk->code, uint8_t, oldCapacity, chunk->capacity);
-        chunk->lines = GROW_ARRAY(chunk->lines, int, oldCapacity, chunk->capacity);
+        chunk->code = GROW_SCRATCH_ARRAY(chunk->code, uint8_t, oldCapacity, chunk->capacity, MEM_CHUNKS);
+        chunk->lines = GROW_SCRATCH_ARRAY(chunk->lines, int, oldCapacity, chunk->capacity, MEM_CHUNKS);
     }
 
     // Add the new element
@@ -27,6 +27,9 @@ typedef enum
     OP_LESS,
     // TODO: For better performance, implement an OP_NOT_EQUAL, OP_GREATER_EQUAL, OP_LESS_EQUAL rather than turn it into two operations
     OP_ADD,
+    // Add a chain of values (a + b + c...) in one go, building only the final string
+    // Operand(s): Number of values to add
+    OP_ADD_N,
     OP_SUBTRACT,
     OP_MULTIPLY,
     OP_DIVIDE,
@@ -34,6 +37,22 @@ typedef enum
     OP_NOT,
     OP_NEGATE,
 
+    // Convert values to strings and join them (used for string interpolation)
+    // Operand(s): Number of values to join
+    OP_CONCAT_N,
+    // Get the character of a string at an index (string[index])
+    OP_GET_INDEX,
+    // Get the part of a string between two indices (string[start:end]), either of which may be null
+    OP_SLICE,
+    // Create a map from key/value pairs on the stack ({key: value, ...})
+    // Operand(s): Number of pairs
+    OP_MAP,
+    // Set the value of a map at a key (map[key] = value), leaving the value on the stack
+    OP_SET_INDEX,
+    // Create a frozen map from key/value pairs on the stack (#{key: value, ...})
+    // Operand(s): Number of pairs
+    OP_FROZEN_MAP,
+
     OP_PRINT,
     OP_RETURN,
 } OpCode;
@@ -5,9 +5,27 @@
 #include <stddef.h>
 #include <stdint.h>
 
+// Tracing is left out of builds with NDEBUG (the benchmarks and tests), so only the program's output is printed
+#ifndef NDEBUG
 // Flag used to print the chunk's bytecode
 #define DEBUG_PRINT_CODE
 // Flag used to print each instruction before executing it
 #define DEBUG_TRACE_EXECUTION
+#endif
+// Flag used to scan the whole source into a token array before parsing it
+// (lets scanning and parsing be timed separately, at the cost of memory for all tokens)
+// #define SCAN_AHEAD
+// Flag used to count lookups, probe lengths, deleted slots and resizes of hash tables
+// (printed for the VM's tables when it's freed, or for any table with printTableStats)
+// #define DEBUG_TABLE_STATS
+// Flag used to run a full garbage collection at every safepoint after anything was allocated
+// #define DEBUG_STRESS_GC
+// Flag used to count collections and time their pauses (printed when the VM is freed)
+// #define DEBUG_GC_STATS
+// Flag used to serve the small blocks allocated through reallocate from the VM's own slabs rather than libc
+// (build with -DLIBC_ALLOCATOR to compare with malloc, see bench/slab.c)
+#ifndef LIBC_ALLOCATOR
+#define SLAB_ALLOCATOR
+#endif
 
 #endif
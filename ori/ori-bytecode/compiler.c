@@ -1,9 +1,11 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "common.h"
 #include "compiler.h"
 #include "scanner.h"
+#include "utf8.h"
 
 #ifdef DEBUG_PRINT_CODE
 #include "debug.h"
@@ -17,6 +19,14 @@ typedef struct
     bool hadError;
     // Whether or not the parser is in panic mode and should skip tokens and resynchronize
     bool panicMode;
+#ifdef SCAN_AHEAD
+    // Source the tokens come from
+    const char* source;
+    // All tokens of the source, already scanned
+    TokenArray tokens;
+    // Index of the next token to read from tokens
+    int nextToken;
+#endif
 } Parser;
 
 typedef enum
@@ -30,7 +40,7 @@ typedef enum
     PREC_TERM,       // + -
     PREC_FACTOR,     // * /
     PREC_UNARY,      // ! -
-    PREC_CALL,       // . ()
+    PREC_CALL,       // . () []
     PREC_PRIMARY
 } Precedence;
 
@@ -102,7 +112,11 @@ static void advance()
 
     for (;;)
     {
+#ifdef SCAN_AHEAD
+        parser.current = getToken(&parser.tokens, parser.source, parser.nextToken++);
+#else
         parser.current = scanToken();
+#endif
         // If get an error, want to keep scanning until it reaches valid code OR EOF
         if (parser.current.type != TOKEN_ERROR)
             break;
@@ -194,7 +208,7 @@ static void parsePrecedence(Precedence precedence);
 // Takes given token and adds its lexeme to constant table (as string)
 // Returns the index of that constant in the constant table
 static uint8_t identifierConstant(Token* name) {
-    return makeConstant(OBJ_VAL(copyString(name->start, name->length)));
+    return makeConstant(OBJ_VAL((Obj*)copyLiteral(name->start, name->length)));
 }
 
 // Consumes an identifier token making it into a constant
@@ -243,8 +257,22 @@ static void compileBinary(bool canAssign)
             emitBytes(OP_GREATER, OP_NOT); // (a <= b) == !(a > b)
             break;
         case TOKEN_PLUS:
-            emitByte(OP_ADD);
+        {
+            // Gather the rest of a chain of + (a + b + c...) so it can be added in a single instruction
+            // This way a chain of strings is only built once instead of once per +
+            int operands = 2;
+            while (operands < UINT8_MAX && match(TOKEN_PLUS))
+            {
+                parsePrecedence((Precedence)(rule->precedence + 1));
+                operands++;
+            }
+
+            if (operands == 2)
+                emitByte(OP_ADD);
+            else
+                emitBytes(OP_ADD_N, (uint8_t)operands);
             break;
+        }
         case TOKEN_MINUS:
             emitByte(OP_SUBTRACT);
             break;
@@ -287,17 +315,127 @@ static void compileGrouping(bool canAssign)
 static void compileNumber(bool canAssign)
 {
     // Assume the token for number literal has already been consumed and is in previous
-    // Convert that string lexeme to a double
-    double value = strtod(parser.previous.start, NULL);
-    emitConstant(NUMBER_VAL(value));
+    // The scanner already worked out its value
+    emitConstant(NUMBER_VAL(parser.previous.number));
 }
 
 static void compileString(bool canAssign)
 {
     // Convert content of string into a constant value (removing the quotes)
     // TODO: Add support for escape sequences
-    emitConstant(OBJ_VAL(copyString(parser.previous.start + 1,
-                                    parser.previous.length - 2)));
+    emitConstant(OBJ_VAL((Obj*)copyLiteral(parser.previous.start + 1,
+                                            parser.previous.length - 2)));
+}
+
+static void compileInterpolation(bool canAssign)
+{
+    // An interpolated string is a sequence of TOKEN_INTERPOLATION segments each followed by an expression
+    // and ends with a regular TOKEN_STRING segment, all parts are then joined together at once
+    int parts = 0;
+
+    do
+    {
+        // Skip the opening " or } and the trailing ${ of the segment, leaving out empty segments
+        int length = parser.previous.length - 3;
+        if (length > 0)
+        {
+            emitConstant(OBJ_VAL((Obj*)copyLiteral(parser.previous.start + 1, length)));
+            parts++;
+        }
+
+        parseExpression();
+        parts++;
+    } while (match(TOKEN_INTERPOLATION));
+
+    consume(TOKEN_STRING, "Expect end of string interpolation.");
+    // Skip the } and the closing "
+    int length = parser.previous.length - 2;
+    if (length > 0)
+    {
+        emitConstant(OBJ_VAL((Obj*)copyLiteral(parser.previous.start + 1, length)));
+        parts++;
+    }
+
+    if (parts > UINT8_MAX)
+    {
+        error("Too many parts in string interpolation.");
+        return;
+    }
+
+    emitBytes(OP_CONCAT_N, (uint8_t)parts);
+}
+
+static void compileIndex(bool canAssign)
+{
+    // The string has already been compiled and [ consumed
+    // A missing start or end of a slice is pushed as null (s[:end] and s[start:])
+    if (check(TOKEN_COLON))
+        emitByte(OP_NULL);
+    else
+        parseExpression();
+
+    if (match(TOKEN_COLON))
+    {
+        if (check(TOKEN_RIGHT_BRACKET))
+            emitByte(OP_NULL);
+        else
+            parseExpression();
+
+        consume(TOKEN_RIGHT_BRACKET, "Expect ']' after slice.");
+        emitByte(OP_SLICE);
+        return;
+    }
+
+    consume(TOKEN_RIGHT_BRACKET, "Expect ']' after index.");
+
+    // map[key] = value
+    if (canAssign && match(TOKEN_EQUAL))
+    {
+        parseExpression();
+        emitByte(OP_SET_INDEX);
+        return;
+    }
+
+    emitByte(OP_GET_INDEX);
+}
+
+// Compile the entries of a map literal up to its closing }, pushing each key followed by its value
+// Returns the number of entries
+static int compileEntries()
+{
+    int pairs = 0;
+    if (!check(TOKEN_RIGHT_BRACE))
+    {
+        do
+        {
+            parseExpression();
+            consume(TOKEN_COLON, "Expect ':' after map key.");
+            parseExpression();
+            pairs++;
+        } while (match(TOKEN_COMMA));
+    }
+    consume(TOKEN_RIGHT_BRACE, "Expect '}' after map entries.");
+
+    if (pairs > UINT8_MAX)
+    {
+        error("Too many entries in map literal.");
+        return 0;
+    }
+    return pairs;
+}
+
+static void compileMap(bool canAssign)
+{
+    (void)canAssign;
+    // The { has already been consumed
+    emitBytes(OP_MAP, (uint8_t)compileEntries());
+}
+
+static void compileFrozenMap(bool canAssign)
+{
+    (void)canAssign;
+    // The #{ has already been consumed
+    emitBytes(OP_FROZEN_MAP, (uint8_t)compileEntries());
 }
 
 static void compileNamedVariable(Token name, bool canAssign) {
@@ -353,13 +491,16 @@ static void compileUnary(bool canAssign)
 ParseRule rules[] = {
     {compileGrouping, NULL, PREC_NONE},       // TOKEN_LEFT_PAREN
     {NULL, NULL, PREC_NONE},                  // TOKEN_RIGHT_PAREN
-    {NULL, NULL, PREC_NONE},                  // TOKEN_LEFT_BRACE
+    {compileMap, NULL, PREC_NONE},            // TOKEN_LEFT_BRACE
     {NULL, NULL, PREC_NONE},                  // TOKEN_RIGHT_BRACE
+    {NULL, compileIndex, PREC_CALL},          // TOKEN_LEFT_BRACKET
+    {NULL, NULL, PREC_NONE},                  // TOKEN_RIGHT_BRACKET
     {NULL, NULL, PREC_NONE},                  // TOKEN_COMMA
     {NULL, NULL, PREC_NONE},                  // TOKEN_DOT
     {compileUnary, compileBinary, PREC_TERM}, // TOKEN_MINUS
     {NULL, compileBinary, PREC_TERM},         // TOKEN_PLUS
     {NULL, NULL, PREC_NONE},                  // TOKEN_SEMICOLON
+    {NULL, NULL, PREC_NONE},                  // TOKEN_COLON
     {NULL, compileBinary, PREC_FACTOR},       // TOKEN_SLASH
     {NULL, compileBinary, PREC_FACTOR},       // TOKEN_STAR
     {compileUnary, NULL, PREC_NONE},          // TOKEN_BANG
@@ -370,8 +511,10 @@ ParseRule rules[] = {
     {NULL, compileBinary, PREC_COMPARISON},   // TOKEN_GREATER_EQUAL
     {NULL, compileBinary, PREC_COMPARISON},   // TOKEN_LESS
     {NULL, compileBinary, PREC_COMPARISON},   // TOKEN_LESS_EQUAL
+    {compileFrozenMap, NULL, PREC_NONE},      // TOKEN_HASH_LEFT_BRACE
     {compileVariable, NULL, PREC_NONE},                  // TOKEN_IDENTIFIER
     {compileString, NULL, PREC_NONE},         // TOKEN_STRING
+    {compileInterpolation, NULL, PREC_NONE},  // TOKEN_INTERPOLATION
     {compileNumber, NULL, PREC_NONE},         // TOKEN_NUMBER
     {NULL, NULL, PREC_NONE},                  // TOKEN_AND
     {NULL, NULL, PREC_NONE},                  // TOKEN_CLASS
@@ -518,9 +661,37 @@ static void parseStatement() {
     }
 }
 
-bool compile(const char* source, Chunk* chunk)
+// Check that the source is valid UTF-8, reporting where it isn't
+// Strings are made from the source, so this is what lets them all be assumed to be valid
+static bool validateSource(const char* source, int line)
 {
-    initScanner(source);
+    size_t length = strlen(source);
+    if (isValidUtf8(source, length))
+        return true;
+
+    long offset = findInvalidUtf8(source, length);
+    for (long i = 0; i < offset; i++)
+    {
+        if (source[i] == '\n')
+            line++;
+    }
+    fprintf(stderr, "[line %d] Error: Invalid UTF-8 in source.\n", line);
+    return false;
+}
+
+bool compile(const char* source, int line, Chunk* chunk)
+{
+    if (!validateSource(source, line))
+        return false;
+
+#ifdef SCAN_AHEAD
+    parser.source = source;
+    parser.nextToken = 0;
+    initTokenArray(&parser.tokens);
+    scanTokens(source, line, &parser.tokens);
+#else
+    initScanner(source, line);
+#endif
     compilingChunk = chunk;
 
     parser.hadError = false;
@@ -534,5 +705,9 @@ bool compile(const char* source, Chunk* chunk)
 
     endCompiler();
 
+#ifdef SCAN_AHEAD
+    freeTokenArray(&parser.tokens);
+#endif
+
     return !parser.hadError;
 }
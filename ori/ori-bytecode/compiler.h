@@ -5,7 +5,8 @@
 #include "vm.h"
 
 // Compile the given source code as bytecode into the given chunk
+// (line is the line number of the first line of source, used for error reporting)
 // Returns true if it succeeded
-bool compile(const char* source, Chunk* chunk);
+bool compile(const char* source, int line, Chunk* chunk);
 
 #endif
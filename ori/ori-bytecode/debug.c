@@ -25,6 +25,14 @@ static int constantInstruction(const char* name, Chunk* chunk, int offset)
     return offset + 2;
 }
 
+// Print an instruction with a single byte operand
+static int byteInstruction(const char* name, Chunk* chunk, int offset)
+{
+    uint8_t operand = chunk->code[offset + 1];
+    printf("%-16s %4d\n", name, operand);
+    return offset + 2;
+}
+
 // Print a simple instruction without operands
 static int simpleInstruction(const char* name, int offset)
 {
@@ -77,6 +85,8 @@ int disassembleInstruction(Chunk* chunk, int offset)
             return simpleInstruction("OP_LESS", offset);
         case OP_ADD:
             return simpleInstruction("OP_ADD", offset);
+        case OP_ADD_N:
+            return byteInstruction("OP_ADD_N", chunk, offset);
         case OP_SUBTRACT:
             return simpleInstruction("OP_SUBTRACT", offset);
         case OP_MULTIPLY:
@@ -89,6 +99,19 @@ int disassembleInstruction(Chunk* chunk, int offset)
         case OP_NEGATE:
             return simpleInstruction("OP_NEGATE", offset);
 
+        case OP_CONCAT_N:
+            return byteInstruction("OP_CONCAT_N", chunk, offset);
+        case OP_GET_INDEX:
+            return simpleInstruction("OP_GET_INDEX", offset);
+        case OP_SLICE:
+            return simpleInstruction("OP_SLICE", offset);
+        case OP_MAP:
+            return byteInstruction("OP_MAP", chunk, offset);
+        case OP_SET_INDEX:
+            return simpleInstruction("OP_SET_INDEX", offset);
+        case OP_FROZEN_MAP:
+            return byteInstruction("OP_FROZEN_MAP", chunk, offset);
+
         case OP_PRINT:
             return simpleInstruction("OP_PRINT", offset);
         case OP_RETURN:
@@ -0,0 +1,423 @@
+#include <string.h>
+
+#include "hamt.h"
+#include "memory.h"
+#include "object.h"
+#include "value.h"
+
+// Branch of the node at the given shift that the hash goes down
+#define FRAGMENT(hash, shift) (((hash) >> (shift)) & (HAMT_BRANCHES - 1))
+// Number of bits set, with the POPCNT instruction when it's available (-mpopcnt or -march=native)
+// Otherwise __builtin_popcount is a call into a slow library routine, so count them in parallel (SWAR) instead
+#ifdef __POPCNT__
+#define POPCOUNT(bits) __builtin_popcount(bits)
+#else
+static inline int popcount(uint32_t bits)
+{
+    bits = bits - ((bits >> 1) & 0x55555555);
+    bits = (bits & 0x33333333) + ((bits >> 2) & 0x33333333);
+    bits = (bits + (bits >> 4)) & 0x0F0F0F0F;
+    return (int)((bits * 0x01010101) >> 24);
+}
+#define POPCOUNT(bits) popcount(bits)
+#endif
+
+// Index of a branch among those set in the bitmap (how many of them come before it)
+#define BRANCH_INDEX(map, bit) (POPCOUNT((map) & ((bit) - 1)))
+
+#define ENTRY_KEY(node, index) ((node)->slots[2 * (index)])
+#define ENTRY_VALUE(node, index) ((node)->slots[2 * (index) + 1])
+#define CHILD_SLOT(node, index) ((node)->slots[2 * (node)->entryCount + (index)])
+#define CHILD(node, index) ((HamtNode*)AS_OBJ(CHILD_SLOT(node, index)))
+
+// Builder numbers, 0 is never used (it's the owner of nodes that no builder may change)
+static uint64_t nextOwner = 1;
+
+static inline int slotsUsed(HamtNode* node)
+{
+    return 2 * node->entryCount + node->childCount;
+}
+
+static HamtNode* newNode(int capacity, uint64_t owner)
+{
+    HamtNode* node = (HamtNode*)allocateObject(sizeof(HamtNode) + sizeof(Value) * capacity, OBJ_HAMT_NODE);
+    node->entryMap = 0;
+    node->nodeMap = 0;
+    node->owner = owner;
+    node->entryCount = 0;
+    node->childCount = 0;
+    node->capacity = capacity;
+    return node;
+}
+
+// Get a version of node that can be changed and has room for extra more slots:
+// the node itself if it belongs to the builder (and has the room), otherwise a copy of it
+static HamtNode* editableNode(HamtNode* node, uint64_t owner, int extra)
+{
+    int needed = slotsUsed(node) + extra;
+    bool isOwned = owner != 0 && node->owner == owner;
+    if (isOwned && node->capacity >= needed)
+        return node;
+
+    // Nodes are made just big enough, most are never changed again
+    // But one that the builder has to grow is likely to keep growing, so it gets twice the room
+    // (up to the most a node other than a collision node can use, 2 slots for each of the 32 branches)
+    int capacity = needed;
+    if (isOwned)
+    {
+        capacity = needed * 2;
+        if (capacity > 2 * HAMT_BRANCHES)
+            capacity = needed > 2 * HAMT_BRANCHES ? needed : 2 * HAMT_BRANCHES;
+    }
+
+    HamtNode* copy = newNode(capacity, owner);
+    copy->entryMap = node->entryMap;
+    copy->nodeMap = node->nodeMap;
+    copy->entryCount = node->entryCount;
+    copy->childCount = node->childCount;
+    memcpy(copy->slots, node->slots, sizeof(Value) * slotsUsed(node));
+    return copy;
+}
+
+// Insert an entry as the index-th entry of the node (which must have room for it)
+static void insertEntry(HamtNode* node, int index, Value key, Value value)
+{
+    Value* slot = &node->slots[2 * index];
+    memmove(slot + 2, slot, sizeof(Value) * (slotsUsed(node) - 2 * index));
+    slot[0] = key;
+    slot[1] = value;
+    node->entryCount++;
+}
+
+static void removeEntry(HamtNode* node, int index)
+{
+    Value* slot = &node->slots[2 * index];
+    memmove(slot, slot + 2, sizeof(Value) * (slotsUsed(node) - 2 * index - 2));
+    node->entryCount--;
+}
+
+// Insert a child as the index-th child of the node (which must have room for it)
+static void insertChild(HamtNode* node, int index, HamtNode* child)
+{
+    Value* slot = &CHILD_SLOT(node, index);
+    memmove(slot + 1, slot, sizeof(Value) * (node->childCount - index));
+    *slot = OBJ_VAL((Obj*)child);
+    node->childCount++;
+}
+
+static void removeChild(HamtNode* node, int index)
+{
+    Value* slot = &CHILD_SLOT(node, index);
+    memmove(slot, slot + 1, sizeof(Value) * (node->childCount - index - 1));
+    node->childCount--;
+}
+
+// Make a node holding two entries with different keys that both go down the same branch up to shift
+static HamtNode* mergeEntries(int shift, Value key1, Value value1, uint32_t hash1,
+                              Value key2, Value value2, uint32_t hash2, uint64_t owner)
+{
+    if (shift >= HAMT_MAX_SHIFT)
+    {
+        // Same hash, nothing left to tell the keys apart with
+        HamtNode* node = newNode(4, owner);
+        insertEntry(node, 0, key1, value1);
+        insertEntry(node, 1, key2, value2);
+        return node;
+    }
+
+    uint32_t fragment1 = FRAGMENT(hash1, shift);
+    uint32_t fragment2 = FRAGMENT(hash2, shift);
+    if (fragment1 == fragment2)
+    {
+        // Still the same branch, one level further down might tell them apart
+        HamtNode* node = newNode(1, owner);
+        node->nodeMap = 1u << fragment1;
+        insertChild(node, 0, mergeEntries(shift + HAMT_BITS, key1, value1, hash1, key2, value2, hash2, owner));
+        return node;
+    }
+
+    // Entries are kept in the order of their branches
+    HamtNode* node = newNode(4, owner);
+    node->entryMap = (1u << fragment1) | (1u << fragment2);
+    insertEntry(node, 0, fragment1 < fragment2 ? key1 : key2, fragment1 < fragment2 ? value1 : value2);
+    insertEntry(node, 1, fragment1 < fragment2 ? key2 : key1, fragment1 < fragment2 ? value2 : value1);
+    return node;
+}
+
+// Set key to value in the subtrie of node (at the given shift)
+// Returns the node to use in its place, which is node itself when it was changed in place
+// added is set to true if the key wasn't there before
+static HamtNode* setInNode(HamtNode* node, int shift, uint32_t hash, Value key, Value value, uint64_t owner, bool* added)
+{
+    if (shift >= HAMT_MAX_SHIFT)
+    {
+        for (int i = 0; i < node->entryCount; i++)
+        {
+            if (valuesEqual(ENTRY_KEY(node, i), key))
+            {
+                HamtNode* edited = editableNode(node, owner, 0);
+                ENTRY_VALUE(edited, i) = value;
+                return edited;
+            }
+        }
+
+        HamtNode* edited = editableNode(node, owner, 2);
+        insertEntry(edited, edited->entryCount, key, value);
+        *added = true;
+        return edited;
+    }
+
+    uint32_t bit = 1u << FRAGMENT(hash, shift);
+
+    if (node->entryMap & bit)
+    {
+        int index = BRANCH_INDEX(node->entryMap, bit);
+        Value otherKey = ENTRY_KEY(node, index);
+        if (valuesEqual(otherKey, key))
+        {
+            HamtNode* edited = editableNode(node, owner, 0);
+            ENTRY_VALUE(edited, index) = value;
+            return edited;
+        }
+
+        // Another key is on this branch, both of them move down into a new child node
+        HamtNode* child = mergeEntries(shift + HAMT_BITS, otherKey, ENTRY_VALUE(node, index), hashValue(otherKey),
+                                       key, value, hash, owner);
+        HamtNode* edited = editableNode(node, owner, 0);
+        removeEntry(edited, index);
+        edited->entryMap &= ~bit;
+        insertChild(edited, BRANCH_INDEX(edited->nodeMap, bit), child);
+        edited->nodeMap |= bit;
+        *added = true;
+        return edited;
+    }
+
+    if (node->nodeMap & bit)
+    {
+        int index = BRANCH_INDEX(node->nodeMap, bit);
+        HamtNode* child = CHILD(node, index);
+        HamtNode* newChild = setInNode(child, shift + HAMT_BITS, hash, key, value, owner, added);
+        // The child was changed in place, so this node still points to the right one
+        if (newChild == child)
+            return node;
+
+        HamtNode* edited = editableNode(node, owner, 0);
+        CHILD_SLOT(edited, index) = OBJ_VAL((Obj*)newChild);
+        return edited;
+    }
+
+    HamtNode* edited = editableNode(node, owner, 2);
+    insertEntry(edited, BRANCH_INDEX(edited->entryMap, bit), key, value);
+    edited->entryMap |= bit;
+    *added = true;
+    return edited;
+}
+
+static ObjFrozenMap* newFrozenMap(HamtNode* root, int count)
+{
+    ObjFrozenMap* map = (ObjFrozenMap*)allocateObject(sizeof(ObjFrozenMap), OBJ_FROZEN_MAP);
+    map->root = root;
+    map->count = count;
+    map->hash = newIdentityHash();
+    map->isPrinting = false;
+    return map;
+}
+
+// Set key to value in the trie starting at root (which may be NULL when it is empty)
+static HamtNode* setInTrie(HamtNode* root, Value key, Value value, uint64_t owner, bool* added)
+{
+    uint32_t hash = hashValue(key);
+    if (root == NULL)
+    {
+        root = newNode(2, owner);
+        root->entryMap = 1u << FRAGMENT(hash, 0);
+        insertEntry(root, 0, key, value);
+        *added = true;
+        return root;
+    }
+    return setInNode(root, 0, hash, key, value, owner, added);
+}
+
+void initHamtBuilder(HamtBuilder* builder, ObjFrozenMap* from)
+{
+    builder->root = from == NULL ? NULL : from->root;
+    builder->count = from == NULL ? 0 : from->count;
+    // 64 bits never run out, so a number is never given to two builders
+    builder->owner = nextOwner++;
+}
+
+void hamtBuilderSet(HamtBuilder* builder, Value key, Value value)
+{
+    bool added = false;
+    builder->root = setInTrie(builder->root, key, value, builder->owner, &added);
+    if (added)
+        builder->count++;
+}
+
+ObjFrozenMap* finishHamtBuilder(HamtBuilder* builder)
+{
+    // The nodes keep their owner, but no other builder will ever have it
+    return newFrozenMap(builder->root, builder->count);
+}
+
+bool hamtGet(ObjFrozenMap* map, Value key, Value* value)
+{
+    HamtNode* node = map->root;
+    if (node == NULL)
+        return false;
+
+    uint32_t hash = hashValue(key);
+    for (int shift = 0; shift < HAMT_MAX_SHIFT; shift += HAMT_BITS)
+    {
+        uint32_t bit = 1u << FRAGMENT(hash, shift);
+        if (node->entryMap & bit)
+        {
+            int index = BRANCH_INDEX(node->entryMap, bit);
+            if (!valuesEqual(ENTRY_KEY(node, index), key))
+                return false;
+            *value = ENTRY_VALUE(node, index);
+            return true;
+        }
+        if (!(node->nodeMap & bit))
+            return false;
+
+        node = CHILD(node, BRANCH_INDEX(node->nodeMap, bit));
+    }
+
+    // A collision node
+    for (int i = 0; i < node->entryCount; i++)
+    {
+        if (valuesEqual(ENTRY_KEY(node, i), key))
+        {
+            *value = ENTRY_VALUE(node, i);
+            return true;
+        }
+    }
+    return false;
+}
+
+ObjFrozenMap* hamtSet(ObjFrozenMap* map, Value key, Value value)
+{
+    bool added = false;
+    HamtNode* root = setInTrie(map->root, key, value, 0, &added);
+    return newFrozenMap(root, map->count + (added ? 1 : 0));
+}
+
+// Remove key from the subtrie of node (at the given shift)
+// Returns the node to use in its place: node itself when the key isn't there, NULL when it was its only entry
+// An entry left alone in a node moves up into its parent (where it was before mergeEntries pushed it down),
+// so the shape of a trie only depends on the keys it holds and not on the order they came and went in
+static HamtNode* removeFromNode(HamtNode* node, int shift, uint32_t hash, Value key)
+{
+    if (shift >= HAMT_MAX_SHIFT)
+    {
+        for (int i = 0; i < node->entryCount; i++)
+        {
+            if (valuesEqual(ENTRY_KEY(node, i), key))
+            {
+                if (node->entryCount == 1)
+                    return NULL;
+                HamtNode* edited = editableNode(node, 0, 0);
+                removeEntry(edited, i);
+                return edited;
+            }
+        }
+        return node;
+    }
+
+    uint32_t bit = 1u << FRAGMENT(hash, shift);
+
+    if (node->entryMap & bit)
+    {
+        int index = BRANCH_INDEX(node->entryMap, bit);
+        if (!valuesEqual(ENTRY_KEY(node, index), key))
+            return node;
+        if (node->entryCount == 1 && node->childCount == 0)
+            return NULL;
+
+        HamtNode* edited = editableNode(node, 0, 0);
+        removeEntry(edited, index);
+        edited->entryMap &= ~bit;
+        return edited;
+    }
+
+    if (node->nodeMap & bit)
+    {
+        int index = BRANCH_INDEX(node->nodeMap, bit);
+        HamtNode* child = CHILD(node, index);
+        HamtNode* newChild = removeFromNode(child, shift + HAMT_BITS, hash, key);
+        if (newChild == child)
+            return node;
+
+        if (newChild == NULL || (newChild->entryCount == 1 && newChild->childCount == 0))
+        {
+            if (newChild == NULL && node->entryCount == 0 && node->childCount == 1)
+                return NULL;
+
+            // The child goes away, and the entry it has left (if any) takes its branch in this node
+            HamtNode* edited = editableNode(node, 0, newChild == NULL ? 0 : 2);
+            removeChild(edited, index);
+            edited->nodeMap &= ~bit;
+            if (newChild != NULL)
+            {
+                insertEntry(edited, BRANCH_INDEX(edited->entryMap, bit), ENTRY_KEY(newChild, 0),
+                            ENTRY_VALUE(newChild, 0));
+                edited->entryMap |= bit;
+            }
+            return edited;
+        }
+
+        HamtNode* edited = editableNode(node, 0, 0);
+        CHILD_SLOT(edited, index) = OBJ_VAL((Obj*)newChild);
+        return edited;
+    }
+
+    return node;
+}
+
+ObjFrozenMap* hamtRemove(ObjFrozenMap* map, Value key)
+{
+    if (map->root == NULL)
+        return map;
+
+    HamtNode* root = removeFromNode(map->root, 0, hashValue(key), key);
+    if (root == map->root)
+        return map;
+    return newFrozenMap(root, map->count - 1);
+}
+
+void initHamtIterator(HamtIterator* iterator, ObjFrozenMap* map)
+{
+    iterator->nodes[0] = map->root;
+    iterator->positions[0] = 0;
+    iterator->depth = map->root == NULL ? -1 : 0;
+}
+
+bool hamtNext(HamtIterator* iterator, Value* key, Value* value)
+{
+    while (iterator->depth >= 0)
+    {
+        HamtNode* node = iterator->nodes[iterator->depth];
+        int position = iterator->positions[iterator->depth]++;
+
+        if (position < node->entryCount)
+        {
+            *key = ENTRY_KEY(node, position);
+            *value = ENTRY_VALUE(node, position);
+            return true;
+        }
+
+        if (position < node->entryCount + node->childCount)
+        {
+            // Go through the child's entries before coming back to this node
+            iterator->depth++;
+            iterator->nodes[iterator->depth] = CHILD(node, position - node->entryCount);
+            iterator->positions[iterator->depth] = 0;
+            continue;
+        }
+
+        iterator->depth--;
+    }
+
+    return false;
+}
@@ -0,0 +1,78 @@
+#ifndef ori_hamt_h
+#define ori_hamt_h
+
+#include "common.h"
+#include "object.h"
+#include "value.h"
+
+// Each level of the trie branches on the next 5 bits of the key's hash (32 branches per node)
+#define HAMT_BITS 5
+#define HAMT_BRANCHES (1 << HAMT_BITS)
+// Past this shift all 32 bits of the hash have been used, keys that get there have the same hash
+// and share a collision node (which just holds them in a list)
+#define HAMT_MAX_SHIFT 32
+// Deepest a path can go: levels for shifts 0, 5... 30, then a collision node
+#define HAMT_MAX_DEPTH (HAMT_MAX_SHIFT / HAMT_BITS + 2)
+
+// A node of a hash array mapped trie (the compressed CHAMP layout)
+// Only the branches that are used take up room: entryMap and nodeMap have a bit set for each branch
+// holding an entry or a child node, and the slot of a branch is the number of bits set before its own
+// Nodes are never changed once they can be shared between maps, updates copy the path down to the change instead
+// (except by the builder that owns them, see HamtBuilder)
+struct sHamtNode
+{
+    Obj obj;
+    uint32_t entryMap;
+    uint32_t nodeMap;
+    int entryCount;
+    // Builder that may change this node in place, 0 for nodes made by single updates
+    // Builders get a new number each, so a node can't be changed once its builder is done with it
+    uint64_t owner;
+    int childCount;
+    // Number of slots allocated, builders leave some room so that adding to a node they own doesn't reallocate it
+    int capacity;
+    // Entries (key then value) followed by children (as object values)
+    // In a collision node (past HAMT_MAX_SHIFT) the bitmaps are unused and entries are in no particular order
+    Value slots[];
+};
+
+// Builds a map by changing nodes in place rather than copying them for every update (a transient)
+// Only nodes the builder created itself are changed, those shared with existing maps are still copied,
+// so building from an existing map leaves it untouched
+typedef struct
+{
+    HamtNode* root;
+    int count;
+    uint64_t owner;
+} HamtBuilder;
+
+// Start building a map from the entries of from (or from nothing if it is NULL)
+void initHamtBuilder(HamtBuilder* builder, ObjFrozenMap* from);
+// Add or replace the entry of key (which like for ValueTable must be a flat string if it's a string, and not NaN)
+void hamtBuilderSet(HamtBuilder* builder, Value key, Value value);
+// Get the map that was built, the builder can't be used after this
+ObjFrozenMap* finishHamtBuilder(HamtBuilder* builder);
+
+// Get the value of key in the map and store it in value
+// Returns true if the key exists
+bool hamtGet(ObjFrozenMap* map, Value key, Value* value);
+// Get a new map with key set to value, sharing everything but the path to key with map
+ObjFrozenMap* hamtSet(ObjFrozenMap* map, Value key, Value value);
+// Get a new map without key, sharing everything but the path to key with map (map itself if key isn't in it)
+ObjFrozenMap* hamtRemove(ObjFrozenMap* map, Value key);
+
+// Walks over all entries of a map
+typedef struct
+{
+    HamtNode* nodes[HAMT_MAX_DEPTH];
+    // Next slot to visit in each node, entries first then children
+    int positions[HAMT_MAX_DEPTH];
+    int depth;
+} HamtIterator;
+
+void initHamtIterator(HamtIterator* iterator, ObjFrozenMap* map);
+// Get the next entry of the map
+// Returns false once all of them have been visited
+bool hamtNext(HamtIterator* iterator, Value* key, Value* value);
+
+#endif
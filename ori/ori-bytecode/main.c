@@ -1,85 +1,303 @@
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "chunk.h"
 #include "common.h"
 #include "debug.h"
+#include "scanner.h"
 #include "vm.h"
 
+// A growable buffer of source code that is being read in
+typedef struct
+{
+    size_t length;
+    size_t capacity;
+    char* chars;
+} SourceBuffer;
+
+// Append the given characters to the end of the buffer (keeping it null terminated)
+static void appendSource(SourceBuffer* buffer, const char* chars, size_t length)
+{
+    if (buffer->capacity < buffer->length + length + 1)
+    {
+        while (buffer->capacity < buffer->length + length + 1)
+            buffer->capacity = buffer->capacity < 1024 ? 1024 : buffer->capacity * 2;
+        buffer->chars = (char*)realloc(buffer->chars, buffer->capacity);
+    }
+
+    memcpy(buffer->chars + buffer->length, chars, length);
+    buffer->length += length;
+    buffer->chars[buffer->length] = '\0';
+}
+
+// Count how many lines the given text spans
+static int countLines(const char* chars, size_t length)
+{
+    int lines = 0;
+    for (const char* c = memchr(chars, '\n', length); c != NULL; c = memchr(c + 1, '\n', length - (c + 1 - chars)))
+        lines++;
+    return lines;
+}
+
+// Exit with the status for the error, if there was one
+// The VM is freed first, which also prints its statistics when asked to
+static void exitOnError(InterpretResult result)
+{
+    if (result == INTERPRET_OK)
+        return;
+
+    freeVM();
+    exit(result == INTERPRET_COMPILE_ERROR ? 65 : 70);
+}
+
 static void repl()
 {
-    // TODO: Allow for infinite line length and multiline input
-    char line[1024];
+    char* line = NULL;
+    size_t lineCapacity = 0;
+    SourceBuffer source = {0, 0, NULL};
+    SourceProgress progress;
+    initSourceProgress(&progress);
 
     // Start infinite repl loop
     for (;;)
     {
-        printf("> ");
+        // Ask for more input with a different prompt when the code so far is unfinished
+        printf(source.length == 0 ? "> " : "... ");
 
-        if (!fgets(line, sizeof(line), stdin))
+        // getline grows the line buffer as needed, so lines can be any length
+        ssize_t length = getline(&line, &lineCapacity, stdin);
+        if (length == -1)
         {
             printf("\n");
             break;
         }
 
-        interpret(line);
+        // Keep reading lines until they form complete declarations (allows for multiline input)
+        appendSource(&source, line, (size_t)length);
+        if (!isSourceComplete(source.chars, &progress))
+            continue;
+
+        interpret(source.chars, 1);
+        source.length = 0;
+        initSourceProgress(&progress);
     }
+
+    free(line);
+    free(source.chars);
+}
+
+// Source code that is read in a line at a time, and run as soon as it forms complete declarations
+// Only the code that's currently running is ever held in memory, no matter how big the input is
+typedef struct
+{
+    SourceBuffer source;
+    // Only the lines added since the last check are scanned, so a long declaration takes linear time to read
+    SourceProgress progress;
+    // Line number of the first line in the source buffer
+    int firstLine;
+    InterpretResult result;
+} DeclarationReader;
+
+static void initDeclarationReader(DeclarationReader* reader)
+{
+    reader->source = (SourceBuffer){0, 0, NULL};
+    initSourceProgress(&reader->progress);
+    reader->firstLine = 1;
+    reader->result = INTERPRET_OK;
 }
 
-static char* readFile(const char* path)
+// Add a line (with its newline, if it has one) and run the declarations it completes
+// Returns false once running them failed, the rest of the input isn't needed then
+static bool readLine(DeclarationReader* reader, const char* line, size_t length)
 {
-    FILE* file = fopen(path, "rb");
+    appendSource(&reader->source, line, length);
+    if (!isSourceComplete(reader->source.chars, &reader->progress))
+        return true;
+
+    reader->result = interpret(reader->source.chars, reader->firstLine);
 
-    if (file == NULL)
+    // Done with that code, reuse the buffer for the next declarations
+    reader->firstLine += countLines(reader->source.chars, reader->source.length);
+    reader->source.length = 0;
+    initSourceProgress(&reader->progress);
+    return reader->result == INTERPRET_OK;
+}
+
+// Run whatever's left once the input has ended, and exit if anything failed
+static void finishDeclarationReader(DeclarationReader* reader)
+{
+    // Whatever's left is unfinished, compiling it reports the error
+    if (reader->result == INTERPRET_OK && reader->source.length > 0)
+        reader->result = interpret(reader->source.chars, reader->firstLine);
+
+    free(reader->source.chars);
+    exitOnError(reader->result);
+}
+
+// Compiles and runs the stream a few complete declarations at a time (as soon as they have been read)
+static void runStream(FILE* stream)
+{
+    char* line = NULL;
+    size_t lineCapacity = 0;
+    DeclarationReader reader;
+    initDeclarationReader(&reader);
+
+    ssize_t length;
+    while ((length = getline(&line, &lineCapacity, stream)) != -1)
     {
-        fprintf(stderr, "Could not open file \"%s\".\n", path);
-        exit(74);
+        if (!readLine(&reader, line, (size_t)length))
+            break;
     }
 
-    // Get required buffer size by going to the end of the file and counting how many bytes we've passed
-    fseek(file, 0L, SEEK_END);
-    size_t fileSize = ftell(file);
-    rewind(file);
+    free(line);
+    finishDeclarationReader(&reader);
+}
+
+// Map the file into memory (read-only) rather than reading it through a stream,
+// so its lines don't need to be copied out of the stream's buffer and the OS can page them in and out as needed
+// Lines are found by the length of the mapping, so it doesn't need a null terminator
+// Returns false if the file can't be mapped (e.g. it's a pipe), *source is NULL for an empty file
+static bool mapFile(const char* path, char** source, size_t* size)
+{
+    int file = open(path, O_RDONLY);
+    if (file == -1)
+        return false;
 
-    // TODO: Support UTF-8 rather than just char/ASCII
-    char* buffer = (char*)malloc(fileSize + 1);
-    size_t bytesRead = fread(buffer, sizeof(char), fileSize, file);
+    struct stat info;
+    if (fstat(file, &info) == -1 || !S_ISREG(info.st_mode))
+    {
+        close(file);
+        return false;
+    }
 
-    // Check that it read the file correctly
-    if (bytesRead < fileSize)
+    *size = (size_t)info.st_size;
+    *source = NULL;
+    if (*size == 0)
     {
-        fprintf(stderr, "Could not read file \"%s\".\n", path);
-        exit(74);
+        close(file);
+        return true;
     }
 
-    // Terminate string with null byte
-    buffer[bytesRead] = '\0';
+    void* mapping = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, file, 0);
+    // The mapping stays valid after closing the file
+    close(file);
+    if (mapping == MAP_FAILED)
+        return false;
 
-    fclose(file);
-    return buffer;
+    // It's read from start to end once
+    madvise(mapping, *size, MADV_SEQUENTIAL);
+    *source = (char*)mapping;
+    return true;
 }
 
+// Runs the file a few complete declarations at a time, like runStream
 static void runFile(const char* path)
 {
-    char* source = readFile(path);
-    InterpretResult result = interpret(source);
-    // readFile gives ownership of the string, so need to free it once done
-    free(source);
-
-    if (result == INTERPRET_COMPILE_ERROR)
-        exit(65);
-    if (result == INTERPRET_RUNTIME_ERROR)
-        exit(70);
+    char* source;
+    size_t size;
+    if (!mapFile(path, &source, &size))
+    {
+        FILE* file = fopen(path, "rb");
+        if (file == NULL)
+        {
+            fprintf(stderr, "Could not open file \"%s\".\n", path);
+            exit(74);
+        }
+        runStream(file);
+        fclose(file);
+        return;
+    }
+
+    DeclarationReader reader;
+    initDeclarationReader(&reader);
+    const char* end = source + size;
+    for (const char* line = source; line < end;)
+    {
+        const char* newline = memchr(line, '\n', (size_t)(end - line));
+        const char* next = newline == NULL ? end : newline + 1;
+        if (!readLine(&reader, line, (size_t)(next - line)))
+            break;
+        line = next;
+    }
+
+    if (source != NULL)
+        munmap(source, size);
+    finishDeclarationReader(&reader);
+}
+
+static void usage()
+{
+    fprintf(stderr, "Usage: ori [--arena] [--mem-stats] [--mem-limit=bytes[K|M|G]] [--alloc-profile=path]\n"
+                    "           [path | -]\n");
+    exit(64);
+}
+
+// Parse a number of bytes, optionally followed by K, M or G (powers of 1024)
+// Returns false if it isn't one
+static bool parseSize(const char* text, size_t* size)
+{
+    char* end;
+    unsigned long long number = strtoull(text, &end, 10);
+    if (end == text)
+        return false;
+
+    int shift = 0;
+    if (*end == 'K')
+        shift = 10;
+    else if (*end == 'M')
+        shift = 20;
+    else if (*end == 'G')
+        shift = 30;
+    if (shift != 0)
+        end++;
+
+    if (*end != '\0' || number == 0 || number > (SIZE_MAX >> shift))
+        return false;
+    *size = (size_t)number << shift;
+    return true;
 }
 
 int main(int argc, const char* argv[])
 {
-    initVM();
+    VMOptions options = {false, SIZE_MAX, false, NULL};
+
+    // Options come before the path
+    while (argc > 1 && strncmp(argv[1], "--", 2) == 0)
+    {
+        // --arena frees the memory of each run all at once, for running many short scripts
+        if (strcmp(argv[1], "--arena") == 0)
+            options.useArenas = true;
+        // --mem-stats prints where the memory went once done
+        else if (strcmp(argv[1], "--mem-stats") == 0)
+            options.printMemoryStats = true;
+        // --alloc-profile=path writes how much each line allocated there
+        else if (strncmp(argv[1], "--alloc-profile=", 16) == 0 && argv[1][16] != '\0')
+            options.allocationProfilePath = argv[1] + 16;
+        // --mem-limit=size fails scripts that need a bigger heap
+        else if (strncmp(argv[1], "--mem-limit=", 12) != 0 || !parseSize(argv[1] + 12, &options.memoryLimit))
+            usage();
+        argc--;
+        argv++;
+    }
+
+    initVM(options);
 
     if (argc == 1)
     {
-        repl();
+        // Only be interactive when talking to a terminal, otherwise run whatever is piped in
+        if (isatty(STDIN_FILENO))
+            repl();
+        else
+            runStream(stdin);
+    }
+    else if (argc == 2 && strcmp(argv[1], "-") == 0)
+    {
+        runStream(stdin);
     }
     else if (argc == 2)
     {
@@ -87,8 +305,7 @@ int main(int argc, const char* argv[])
     }
     else
     {
-        fprintf(stderr, "Usage: ori [path]\n");
-        exit(64);
+        usage();
     }
 
     freeVM();
@@ -1,11 +1,201 @@
+#include <setjmp.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
 
 #include "common.h"
+#include "hamt.h"
 #include "memory.h"
+#include "profiler.h"
 #include "vm.h"
 
-void* reallocate(void* previous, size_t oldSize, size_t newSize)
+#if NURSERY_MAX_OBJECT > REGION_MAX_CELL
+#error "Objects promoted out of the nursery have to fit in a cell"
+#endif
+
+// Objects in the nursery are 8 byte aligned (the alignment of Value)
+#define ALIGN(size) (((size) + 7) & ~(size_t)7)
+
+// Offset of the first cell of a region, right after its header
+#define FIRST_CELL ((sizeof(Region) + REGION_GRANULE - 1) / REGION_GRANULE * REGION_GRANULE)
+
+// Region an old object (that isn't large) is in, and the index of its first granule there
+#define REGION_OF(object) ((Region*)((uintptr_t)(object) & ~(uintptr_t)(REGION_SIZE - 1)))
+#define GRANULE_OF(object) (((uintptr_t)(object) & (REGION_SIZE - 1)) / REGION_GRANULE)
+
+// Whether the collection in progress is a minor one, in which case tracing copies young objects
+// rather than marking them
+static bool isCollectingNursery = false;
+// Whether a collection is in progress (promoting objects allocates cells, which can't fail halfway)
+static bool isCollecting = false;
+
+// Cell size of each size class, and the size class of each size in granules (the smallest class it fits in)
+static int classSizes[SIZE_CLASS_COUNT];
+static uint8_t granuleClasses[REGION_MAX_CELL / REGION_GRANULE + 1];
+
+#ifdef DEBUG_GC_STATS
+// Seconds from a monotonic clock, for timing pauses
+static double now()
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (double)time.tv_sec + (double)time.tv_nsec * 1e-9;
+}
+#endif
+
+// Count newly allocated bytes, requesting a full collection once there are enough of them
+// (nextGC is never past the memory limit, so going over the limit requests one too)
+static inline void countAllocation(size_t size)
+{
+    vm.bytesAllocated += size;
+    if (vm.bytesAllocated > vm.memoryStats.peakHeapBytes)
+        vm.memoryStats.peakHeapBytes = vm.bytesAllocated;
+#ifdef DEBUG_STRESS_GC
+    vm.collectionRequest = GC_MAJOR;
+#endif
+    if (vm.bytesAllocated > vm.nextGC)
+        vm.collectionRequest = GC_MAJOR;
+}
+
+// Count bytes as used for the category
+static inline void countBytes(MemoryCategory category, size_t size)
+{
+    MemoryStats* stats = &vm.memoryStats;
+    stats->bytes[category] += size;
+    if (stats->bytes[category] > stats->peakBytes[category])
+        stats->peakBytes[category] = stats->bytes[category];
+}
+
+// Count bytes as no longer used for the category
+static inline void uncountBytes(MemoryCategory category, size_t size)
+{
+    vm.memoryStats.bytes[category] -= size;
+}
+
+// Give up on an allocation
+// A running chunk is stopped with a runtime error (see interpret), anything else can't go on and exits
+// (compiling isn't limited and the collector can't stop halfway, so for them it's the system that ran out)
+static void failAllocation(AllocationFailure failure)
+{
+    if (vm.allocationFailure != NULL && !isCollecting)
+        longjmp(*vm.allocationFailure, failure);
+
+    fprintf(stderr, "Out of memory.\n");
+    exit(1);
+}
+
+static void finishSweeping();
+
+// Whether size more bytes fit in the heap without going over the memory limit
+static inline bool fitsUnderLimit(size_t size)
+{
+    return vm.bytesAllocated <= vm.options.memoryLimit && size <= vm.options.memoryLimit - vm.bytesAllocated;
+}
+
+// Make sure size more bytes can be allocated without going over the memory limit (only while a chunk runs)
+// The garbage of the last full collection is counted until it's swept, so that's finished first if they don't fit,
+// and the allocation fails if they still don't (collecting isn't possible in the middle of an instruction)
+static void reserveBytes(size_t size)
+{
+    if (vm.allocationFailure == NULL || isCollecting || fitsUnderLimit(size))
+        return;
+
+    finishSweeping();
+    if (!fitsUnderLimit(size))
+        failAllocation(ALLOCATION_OVER_LIMIT);
+}
+
+// Limit a collection threshold to halfway from the live bytes to the memory limit
+// The rest is left for what gets allocated before the requested collection runs (see reserveBytes)
+static size_t limitThreshold(size_t threshold, size_t live)
+{
+    size_t limit = vm.options.memoryLimit;
+    size_t cap = live < limit ? live + (limit - live) / 2 : limit;
+    return threshold < cap ? threshold : cap;
+}
+
+#ifdef SLAB_ALLOCATOR
+// Size class of a block of the given size (at most SLAB_MAX_BLOCK)
+static inline int blockClass(size_t size)
+{
+    return granuleClasses[(size + REGION_GRANULE - 1) / REGION_GRANULE];
+}
+
+// Returns NULL if there's no memory left for a new slab
+static void* allocateBlock(int classIndex)
+{
+    SlabClass* slabClass = &vm.slabClasses[classIndex];
+    void* block = slabClass->freeList;
+    if (block != NULL)
+    {
+        slabClass->freeList = *(void**)block;
+        return block;
+    }
+
+    size_t size = (size_t)classSizes[classIndex];
+    if ((size_t)(slabClass->end - slabClass->unused) < size)
+    {
+        // The rest of the previous slab is too small for a block, so it's left unused
+        uint8_t* slab = (uint8_t*)mmap(NULL, SLAB_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (slab == MAP_FAILED)
+            return NULL;
+        // Slabs start with a pointer to the next one
+        *(void**)slab = vm.slabs;
+        vm.slabs = slab;
+        slabClass->unused = slab + REGION_GRANULE;
+        slabClass->end = slab + SLAB_SIZE;
+    }
+
+    block = slabClass->unused;
+    slabClass->unused += size;
+    return block;
+}
+
+static inline void freeBlock(void* block, int classIndex)
 {
+    SlabClass* slabClass = &vm.slabClasses[classIndex];
+    *(void**)block = slabClass->freeList;
+    slabClass->freeList = block;
+}
+#endif
+
+// Resize the memory (from oldSize bytes to newSize), freeing it for a newSize of 0
+// Returns NULL if the memory can't be had, the previous memory is left as it was then
+static void* resizeMemory(void* previous, size_t oldSize, size_t newSize)
+{
+#ifdef SLAB_ALLOCATOR
+    bool wasSmall = previous != NULL && oldSize <= SLAB_MAX_BLOCK;
+    bool isSmall = newSize != 0 && newSize <= SLAB_MAX_BLOCK;
+    if (wasSmall || isSmall)
+    {
+        // Blocks of the same class have the same size, growing or shrinking within it changes nothing
+        if (wasSmall && isSmall && blockClass(oldSize) == blockClass(newSize))
+            return previous;
+
+        void* memory = NULL;
+        if (isSmall)
+            memory = allocateBlock(blockClass(newSize));
+        else if (newSize != 0)
+            memory = malloc(newSize);
+        // The old block is only given up once its contents are in the new one
+        if (memory == NULL && newSize != 0)
+            return NULL;
+
+        if (previous != NULL)
+        {
+            if (memory != NULL)
+                memcpy(memory, previous, oldSize < newSize ? oldSize : newSize);
+            if (wasSmall)
+                freeBlock(previous, blockClass(oldSize));
+            else
+                free(previous);
+        }
+        return memory;
+    }
+#endif
+
     // Handles freeing data
     if (newSize == 0)
     {
@@ -17,27 +207,954 @@ void* reallocate(void* previous, size_t oldSize, size_t newSize)
     return realloc(previous, newSize);
 }
 
+void* reallocate(void* previous, size_t oldSize, size_t newSize, MemoryCategory category)
+{
+    if (newSize > oldSize)
+        reserveBytes(newSize - oldSize);
+
+    void* memory = resizeMemory(previous, oldSize, newSize);
+    if (memory == NULL && newSize != 0)
+        failAllocation(ALLOCATION_OUT_OF_MEMORY);
+
+    if (newSize > oldSize)
+    {
+        countAllocation(newSize - oldSize);
+        countBytes(category, newSize - oldSize);
+        // Objects are profiled by allocateObject, by type
+        if (vm.options.allocationProfilePath != NULL && category != MEM_OBJECTS)
+            profileAllocation(PROFILE_CATEGORY_KIND(category), newSize - oldSize);
+    }
+    else
+    {
+        vm.bytesAllocated -= oldSize - newSize;
+        uncountBytes(category, oldSize - newSize);
+    }
+    return memory;
+}
+
+// Map size bytes of memory (zeroed) starting at a multiple of alignment
+static uint8_t* mapAligned(size_t size, size_t alignment, int flags)
+{
+    // mmap doesn't take an alignment, so map more than needed and unmap what's around the aligned part
+    uint8_t* memory = (uint8_t*)mmap(NULL, size + alignment, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | flags,
+                                     -1, 0);
+    if (memory == MAP_FAILED)
+        failAllocation(ALLOCATION_OUT_OF_MEMORY);
+    uint8_t* start = (uint8_t*)(((uintptr_t)memory + alignment - 1) & ~(uintptr_t)(alignment - 1));
+    if (start > memory)
+        munmap(memory, start - memory);
+    munmap(start + size, memory + alignment - start);
+    return start;
+}
+
+static void initArena(Arena* arena, size_t size)
+{
+    // Nothing is backed until it's used, so the whole size can be reserved up front
+    arena->start = mapAligned(size, ARENA_ALIGNMENT, MAP_NORESERVE);
+#ifdef MADV_HUGEPAGE
+    madvise(arena->start, size, MADV_HUGEPAGE);
+#endif
+    arena->top = arena->start;
+    arena->end = arena->start + size;
+}
+
+// Get size bytes from the arena, or NULL if it's full
+static inline void* arenaAllocate(Arena* arena, size_t size)
+{
+    size = ALIGN(size);
+    if ((size_t)(arena->end - arena->top) < size)
+        return NULL;
+
+    void* memory = arena->top;
+    arena->top += size;
+    return memory;
+}
+
+// Free everything allocated from the arena
+// A single call no matter how much that was, the pages past the retained ones are simply given back
+static void resetArena(Arena* arena)
+{
+    size_t used = arena->top - arena->start;
+    if (used > ARENA_RETAINED)
+        madvise(arena->start + ARENA_RETAINED, used - ARENA_RETAINED, MADV_DONTNEED);
+    arena->top = arena->start;
+}
+
+void* reallocateScratch(void* previous, size_t oldSize, size_t newSize, MemoryCategory category)
+{
+    if (!vm.options.useArenas)
+        return reallocate(previous, oldSize, newSize, category);
+
+    // Nothing is freed before the call returns, shrinking keeps the same memory
+    // (it's still counted as freed, the scratch arena isn't part of the heap the memory limit applies to)
+    if (newSize <= oldSize)
+    {
+        uncountBytes(category, oldSize - newSize);
+        return newSize == 0 ? NULL : previous;
+    }
+    countBytes(category, newSize - oldSize);
+
+    // The last allocation can grow in place
+    Arena* arena = &vm.scratch;
+    if (previous != NULL && (uint8_t*)previous + ALIGN(oldSize) == arena->top &&
+        (size_t)(arena->end - (uint8_t*)previous) >= ALIGN(newSize))
+    {
+        arena->top = (uint8_t*)previous + ALIGN(newSize);
+        return previous;
+    }
+
+    void* memory = arenaAllocate(arena, newSize);
+    if (memory == NULL)
+        failAllocation(ALLOCATION_OUT_OF_MEMORY);
+    if (previous != NULL)
+        memcpy(memory, previous, oldSize);
+    return memory;
+}
+
+static void pushObject(ObjArray* array, Obj* object)
+{
+    if (array->capacity < array->count + 1)
+    {
+        array->capacity = GROW_CAPACITY(array->capacity);
+        array->objects = (Obj**)realloc(array->objects, sizeof(Obj*) * array->capacity);
+        if (array->objects == NULL)
+            exit(1);
+    }
+    array->objects[array->count++] = object;
+}
+
+// Fill in the size class tables
+static void initSizeClasses()
+{
+    int size = 0;
+    for (int i = 0; i < SIZE_CLASS_COUNT; i++)
+    {
+        // 16 bytes more each time up to 256, then a quarter of the power of 2 the size is at
+        int step = size < 256 ? 16 : (1 << (31 - __builtin_clz((uint32_t)size))) / 4;
+        size += step;
+        classSizes[i] = size;
+    }
+
+    int sizeClass = 0;
+    for (int granules = 0; granules <= REGION_MAX_CELL / REGION_GRANULE; granules++)
+    {
+        while (classSizes[sizeClass] < granules * REGION_GRANULE)
+            sizeClass++;
+        granuleClasses[granules] = (uint8_t)sizeClass;
+    }
+}
+
+void initHeap()
+{
+    initSizeClasses();
+    for (int i = 0; i < SIZE_CLASS_COUNT; i++)
+        vm.sizeClasses[i] = (SizeClass){NULL, NULL, NULL};
+    vm.largeObjects = (ObjArray){0, 0, NULL};
+#ifdef SLAB_ALLOCATOR
+    for (int i = 0; i < SIZE_CLASS_COUNT; i++)
+        vm.slabClasses[i] = (SlabClass){NULL, NULL, NULL};
+    vm.slabs = NULL;
+#endif
+    vm.cellBytes = 0;
+    vm.markedBytes = 0;
+
+    // The nursery is allocated once and reused after every minor collection
+    // With arenas, a nursery bigger than the memory limit would let a call use more than it before being collected
+    size_t nurserySize = NURSERY_SIZE;
+    if (vm.options.useArenas)
+    {
+        nurserySize = ARENA_NURSERY_SIZE;
+        if (vm.options.memoryLimit < nurserySize)
+            nurserySize = (vm.options.memoryLimit + ARENA_ALIGNMENT - 1) / ARENA_ALIGNMENT * ARENA_ALIGNMENT;
+        initArena(&vm.scratch, ARENA_SCRATCH_SIZE);
+    }
+    initArena(&vm.nursery, nurserySize);
+    vm.bytesAllocated = 0;
+    vm.nextGC = limitThreshold(GC_INITIAL_THRESHOLD, 0);
+    vm.collectionRequest = GC_NONE;
+    memset(&vm.memoryStats, 0, sizeof(vm.memoryStats));
+    vm.remembered = (ObjArray){0, 0, NULL};
+    vm.youngGlobals = (ObjArray){0, 0, NULL};
+    vm.youngOwners = (ObjArray){0, 0, NULL};
+    vm.grayStack = (ObjArray){0, 0, NULL};
+#ifdef DEBUG_GC_STATS
+    memset(&vm.gcStats, 0, sizeof(vm.gcStats));
+#endif
+}
+
+static inline bool isYoung(Obj* object)
+{
+    return (uint8_t*)object >= vm.nursery.start && (uint8_t*)object < vm.nursery.end;
+}
+
+void* allocateYoung(size_t size)
+{
+    size = ALIGN(size);
+    if (size > NURSERY_MAX_OBJECT)
+        return NULL;
+
+    void* object = arenaAllocate(&vm.nursery, size);
+    if (object == NULL)
+    {
+        // Objects go to the old generation until the collection can run
+        if (vm.collectionRequest == GC_NONE)
+            vm.collectionRequest = GC_MINOR;
+        return NULL;
+    }
+
+#ifdef DEBUG_STRESS_GC
+    vm.collectionRequest = GC_MAJOR;
+#endif
+    return object;
+}
+
+void rememberObject(Obj* object)
+{
+    object->isRemembered = true;
+    pushObject(&vm.remembered, object);
+}
+
+void writeBarrier(Obj* object, Value value)
+{
+    if (IS_OBJ(value) && isYoung(AS_OBJ(value)) && !isYoung(object) && !object->isRemembered)
+        rememberObject(object);
+}
+
+void globalWriteBarrier(ObjString* name, Value value)
+{
+    if (!IS_OBJ(value) || !isYoung(AS_OBJ(value)))
+        return;
+
+    pushObject(&vm.youngGlobals, (Obj*)name);
+    if (vm.youngGlobals.count >= YOUNG_GLOBALS_MAX && vm.collectionRequest == GC_NONE)
+        vm.collectionRequest = GC_MINOR;
+}
+
+void trackYoungOwner(Obj* object)
+{
+    if (isYoung(object))
+        pushObject(&vm.youngOwners, object);
+}
+
+// Size of the object's own allocation
+static size_t objectSize(Obj* object)
+{
+    switch (object->type)
+    {
+        case OBJ_STRING:
+        {
+            // Static strings' characters belong to the literal region and slices' to their parent,
+            // others are stored inline
+            ObjString* string = (ObjString*)object;
+            bool isInline = !string->isStatic && string->parent == NULL;
+            return sizeof(ObjString) + (isInline ? string->length + 1 : 0);
+        }
+        case OBJ_ROPE:
+            return sizeof(ObjRope);
+        case OBJ_MAP:
+            return sizeof(ObjMap);
+        case OBJ_FROZEN_MAP:
+            // Its nodes are objects of their own (shared with other maps)
+            return sizeof(ObjFrozenMap);
+        case OBJ_HAMT_NODE:
+            return sizeof(HamtNode) + sizeof(Value) * ((HamtNode*)object)->capacity;
+    }
+    return 0; // Unreachable
+}
+
+// Free the memory the object owns outside of its own allocation
+static void releaseObject(Obj* object)
+{
+    switch (object->type)
+    {
+        case OBJ_STRING:
+        {
+            ObjString* string = (ObjString*)object;
+            if (string->codePoints != NULL)
+            {
+                int offsetCount = string->codePoints->count / CODE_POINT_STRIDE + 1;
+                reallocate(string->codePoints, sizeof(CodePointIndex) + sizeof(int) * offsetCount, 0, MEM_STRINGS);
+            }
+            break;
+        }
+        case OBJ_MAP:
+            freeValueTable(&((ObjMap*)object)->table);
+            break;
+        default:
+            break;
+    }
+}
+
+// Free a large object
 static void freeObject(Obj* object)
+{
+    releaseObject(object);
+    vm.memoryStats.oldObjectBytes[object->type] -= objectSize(object);
+    reallocate(object, objectSize(object), 0, MEM_OBJECTS);
+}
+
+static Region* newRegion(SizeClass* sizeClass, int cellSize)
+{
+    uint8_t* start = mapAligned(REGION_SIZE, REGION_SIZE, 0);
+
+    // The mapping comes zeroed, so both bitmaps are already clear
+    // Cells are taken from the free list, which starts out as every cell of the region in order
+    // (built as they're needed, so that pages of cells that are never used aren't touched)
+    Region* region = (Region*)start;
+    region->cellSize = cellSize;
+    region->cellCount = 0;
+    region->freeList = NULL;
+    region->unused = start + FIRST_CELL;
+
+    region->previous = NULL;
+    region->next = sizeClass->regions;
+    if (sizeClass->regions != NULL)
+        sizeClass->regions->previous = region;
+    sizeClass->regions = region;
+    return region;
+}
+
+static void freeRegion(SizeClass* sizeClass, Region* region)
+{
+    if (region->previous != NULL)
+        region->previous->next = region->next;
+    else
+        sizeClass->regions = region->next;
+    if (region->next != NULL)
+        region->next->previous = region->previous;
+    munmap(region, REGION_SIZE);
+}
+
+// Whether the region has a free cell
+static inline bool hasFreeCell(Region* region)
+{
+    return region->freeList != NULL || region->unused + region->cellSize <= (uint8_t*)region + REGION_SIZE;
+}
+
+// Free the cells of the region holding objects the last full collection didn't reach, and clear its marks
+// Only the bitmaps are read, a word at a time, plus the objects that died (to free what they own)
+static void sweepRegion(Region* region)
+{
+#ifdef DEBUG_GC_STATS
+    double start = now();
+#endif
+
+    for (int i = 0; i < REGION_BITMAP_WORDS; i++)
+    {
+        // Only allocated cells are ever marked, so the marks are exactly the cells that are still allocated
+        uint64_t dead = region->allocated[i] & ~region->marks[i];
+        region->allocated[i] = region->marks[i];
+        region->marks[i] = 0;
+
+        for (; dead != 0; dead &= dead - 1)
+        {
+            Obj* object = (Obj*)((uint8_t*)region + (size_t)(i * 64 + __builtin_ctzll(dead)) * REGION_GRANULE);
+            releaseObject(object);
+            vm.memoryStats.oldObjectBytes[object->type] -= region->cellSize;
+            uncountBytes(MEM_OBJECTS, region->cellSize);
+#ifdef DEBUG_GC_STATS
+            vm.gcStats.sweptObjects++;
+            vm.gcStats.sweptBytes += region->cellSize;
+#endif
+            *(void**)object = region->freeList;
+            region->freeList = object;
+            region->cellCount--;
+            vm.cellBytes -= region->cellSize;
+            vm.bytesAllocated -= region->cellSize;
+        }
+    }
+
+#ifdef DEBUG_GC_STATS
+    vm.gcStats.sweptRegions++;
+    vm.gcStats.sweepSeconds += now() - start;
+#endif
+}
+
+// Get a free cell of the given size class
+// Regions that haven't been swept since the last full collection are swept one at a time until one has a free cell,
+// so the cost of sweeping is spread over allocations instead of being part of a pause
+static void* allocateCell(int classIndex)
+{
+    reserveBytes((size_t)classSizes[classIndex]);
+
+    SizeClass* sizeClass = &vm.sizeClasses[classIndex];
+    Region* region = sizeClass->current;
+    while (region == NULL || !hasFreeCell(region))
+    {
+        if (sizeClass->sweepNext != NULL)
+        {
+            region = sizeClass->sweepNext;
+            sizeClass->sweepNext = region->next;
+            sweepRegion(region);
+        }
+        else
+        {
+            region = newRegion(sizeClass, classSizes[classIndex]);
+        }
+    }
+    sizeClass->current = region;
+
+    void* cell;
+    if (region->freeList != NULL)
+    {
+        cell = region->freeList;
+        region->freeList = *(void**)cell;
+    }
+    else
+    {
+        cell = region->unused;
+        region->unused += region->cellSize;
+    }
+
+    size_t granule = GRANULE_OF(cell);
+    region->allocated[granule / 64] |= 1ull << (granule % 64);
+    region->cellCount++;
+    vm.cellBytes += region->cellSize;
+    countAllocation(region->cellSize);
+    countBytes(MEM_OBJECTS, region->cellSize);
+    return cell;
+}
+
+Obj* allocateOld(size_t size, ObjType type)
+{
+    if (size > REGION_MAX_CELL)
+    {
+        vm.memoryStats.oldObjectBytes[type] += size;
+        Obj* object = (Obj*)reallocate(NULL, 0, size, MEM_OBJECTS);
+        object->isLarge = true;
+        pushObject(&vm.largeObjects, object);
+        return object;
+    }
+
+    int classIndex = granuleClasses[(size + REGION_GRANULE - 1) / REGION_GRANULE];
+    vm.memoryStats.oldObjectBytes[type] += classSizes[classIndex];
+    Obj* object = (Obj*)allocateCell(classIndex);
+    object->isLarge = false;
+    return object;
+}
+
+bool isMarked(Obj* object)
+{
+    if (object->isLarge)
+        return object->isMarked;
+
+    size_t granule = GRANULE_OF(object);
+    return (REGION_OF(object)->marks[granule / 64] >> (granule % 64)) & 1;
+}
+
+// Where a young object that was copied out of the nursery left the address of its copy
+// Every object has at least 8 bytes of fields after the header, which nothing reads once it has been copied
+#define FORWARDING_ADDRESS(object) (*(Obj**)((uint8_t*)(object) + 8))
+
+// Copy a young object into the old generation, leaving the address of the copy behind in it
+// The copy's references are traced later (it's pushed on the gray stack), the rest of the young object stays intact
+// until the nursery is emptied (slices need their parent's old address to find their characters again,
+// which is why the forwarding address doesn't overwrite a string's chars)
+static Obj* promote(Obj* object)
+{
+    if (object->isForwarded)
+        return FORWARDING_ADDRESS(object);
+
+    size_t size = objectSize(object);
+    int slots = 0;
+    if (object->type == OBJ_HAMT_NODE)
+    {
+        // Builders are done with the node by now, so the room it had for growing isn't needed anymore
+        HamtNode* node = (HamtNode*)object;
+        slots = 2 * node->entryCount + node->childCount;
+        size = sizeof(HamtNode) + sizeof(Value) * slots;
+    }
+
+    // Young objects always fit in a cell, so the copy's header (isLarge included) can be copied as is
+    Obj* copy = allocateOld(size, object->type);
+    memcpy(copy, object, size);
+    if (object->type == OBJ_HAMT_NODE)
+        ((HamtNode*)copy)->capacity = slots;
+    if (object->type == OBJ_STRING && ((ObjString*)object)->chars == ((ObjString*)object)->storage)
+        ((ObjString*)copy)->chars = ((ObjString*)copy)->storage;
+
+    object->isForwarded = true;
+    FORWARDING_ADDRESS(object) = copy;
+    pushObject(&vm.grayStack, copy);
+
+#ifdef DEBUG_GC_STATS
+    vm.gcStats.promotedBytes += size;
+#endif
+    return copy;
+}
+
+Obj* traceObject(Obj* object)
+{
+    if (object == NULL)
+        return NULL;
+
+    if (isCollectingNursery)
+        return isYoung(object) ? promote(object) : object;
+
+    if (object->isLarge)
+    {
+        if (object->isMarked)
+            return object;
+        object->isMarked = true;
+    }
+    else
+    {
+        Region* region = REGION_OF(object);
+        size_t granule = GRANULE_OF(object);
+        uint64_t bit = 1ull << (granule % 64);
+        if (region->marks[granule / 64] & bit)
+            return object;
+        region->marks[granule / 64] |= bit;
+        vm.markedBytes += region->cellSize;
+    }
+
+    pushObject(&vm.grayStack, object);
+    return object;
+}
+
+void traceValue(Value* value)
+{
+    if (IS_OBJ(*value))
+        value->as.obj = traceObject(AS_OBJ(*value));
+}
+
+// Trace everything the object references
+static void traceReferences(Obj* object)
 {
     switch (object->type)
     {
         case OBJ_STRING:
         {
             ObjString* string = (ObjString*)object;
-            FREE_ARRAY(char, string->chars, string->length + 1);
-            FREE(ObjString, object);
+            // Static strings are old from the start, so this is only reached by full collections
+            if (string->isStatic)
+                LITERAL_BLOCK_OF(string->chars)->isMarked = true;
+            if (string->parent != NULL)
+            {
+                // A slice's characters are at the same offset in its parent wherever the parent is
+                ObjString* parent = (ObjString*)traceObject((Obj*)string->parent);
+                string->chars = parent->chars + (string->chars - string->parent->chars);
+                string->parent = parent;
+            }
+            break;
+        }
+        case OBJ_ROPE:
+        {
+            ObjRope* rope = (ObjRope*)object;
+            rope->left = traceObject(rope->left);
+            rope->right = traceObject(rope->right);
+            rope->flat = (ObjString*)traceObject((Obj*)rope->flat);
+            break;
+        }
+        case OBJ_MAP:
+            traceValueTable(&((ObjMap*)object)->table);
+            break;
+        case OBJ_FROZEN_MAP:
+        {
+            ObjFrozenMap* map = (ObjFrozenMap*)object;
+            map->root = (HamtNode*)traceObject((Obj*)map->root);
+            break;
+        }
+        case OBJ_HAMT_NODE:
+        {
+            // Entries (key and value) followed by children
+            HamtNode* node = (HamtNode*)object;
+            int slots = 2 * node->entryCount + node->childCount;
+            for (int i = 0; i < slots; i++)
+                traceValue(&node->slots[i]);
             break;
         }
     }
 }
 
-void freeObjects()
+// Trace the stack and the constants of the chunk being run (globals are traced by each collection its own way)
+static void traceRoots()
+{
+    for (Value* slot = vm.stack; slot < vm.stackTop; slot++)
+        traceValue(slot);
+
+    // The only objects the compiler creates are the constants of the chunk it compiles,
+    // and collections never happen while it runs, so by now they're all in the chunk being run
+    ValueArray* constants = &vm.chunk->constants;
+    for (int i = 0; i < constants->count; i++)
+        traceValue(&constants->values[i]);
+}
+
+static void traceGrayObjects()
+{
+    while (vm.grayStack.count > 0)
+        traceReferences(vm.grayStack.objects[--vm.grayStack.count]);
+}
+
+// Copy the young objects in use into the old generation, and empty the nursery
+static void collectNursery()
+{
+    isCollectingNursery = true;
+
+    traceRoots();
+    // Globals are only traced if they may hold young objects
+    // Past one name per global it's quicker to go through the whole table than to look each of them up
+    if (vm.youngGlobals.count > vm.globals.count)
+    {
+        traceTable(&vm.globals);
+    }
+    else
+    {
+        for (int i = 0; i < vm.youngGlobals.count; i++)
+        {
+            Value* value = tableFindValue(&vm.globals, (ObjString*)vm.youngGlobals.objects[i]);
+            if (value != NULL)
+                traceValue(value);
+        }
+    }
+    vm.youngGlobals.count = 0;
+    // Old objects are only traced if they may point to young ones
+    for (int i = 0; i < vm.remembered.count; i++)
+    {
+        traceReferences(vm.remembered.objects[i]);
+        vm.remembered.objects[i]->isRemembered = false;
+    }
+    vm.remembered.count = 0;
+    traceGrayObjects();
+
+    // Whatever wasn't copied is dead
+    for (int i = 0; i < vm.youngOwners.count; i++)
+    {
+        if (!vm.youngOwners.objects[i]->isForwarded)
+            releaseObject(vm.youngOwners.objects[i]);
+    }
+    vm.youngOwners.count = 0;
+#ifdef DEBUG_STRESS_GC
+    // Anything still pointing into the nursery now finds garbage rather than the object that used to be there
+    memset(vm.nursery.start, 0xCC, vm.nursery.top - vm.nursery.start);
+#endif
+    resetArena(&vm.nursery);
+
+    isCollectingNursery = false;
+}
+
+// Sweep the regions that are left from the last full collection, since marking needs all marks to be clear
+// Regions left empty are given back to the system (other than those cells are being allocated from)
+static void finishSweeping()
+{
+    for (int i = 0; i < SIZE_CLASS_COUNT; i++)
+    {
+        SizeClass* sizeClass = &vm.sizeClasses[i];
+        Region* region = sizeClass->sweepNext;
+        while (region != NULL)
+        {
+            Region* next = region->next;
+            sweepRegion(region);
+            if (region->cellCount == 0 && region != sizeClass->current)
+                freeRegion(sizeClass, region);
+            region = next;
+        }
+        sizeClass->sweepNext = NULL;
+    }
+}
+
+// Free the large objects that weren't marked, and unmark the others for the next collection
+// (there are few of them, so they're swept right away)
+static void sweepLargeObjects()
 {
-    Obj* object = vm.objects;
-    while (object != NULL)
+    int count = 0;
+    for (int i = 0; i < vm.largeObjects.count; i++)
     {
-        Obj* next = object->next;
+        Obj* object = vm.largeObjects.objects[i];
+        if (object->isMarked)
+        {
+            object->isMarked = false;
+            vm.largeObjects.objects[count++] = object;
+            continue;
+        }
+
+#ifdef DEBUG_GC_STATS
+        vm.gcStats.sweptObjects++;
+        vm.gcStats.sweptBytes += objectSize(object);
+#endif
         freeObject(object);
-        object = next;
+    }
+    vm.largeObjects.count = count;
+}
+
+// Bytes mapped for a literal block with the given capacity
+static size_t literalBlockSize(size_t capacity)
+{
+    return (sizeof(LiteralBlock) + capacity + LITERAL_BLOCK_SIZE - 1) & ~(size_t)(LITERAL_BLOCK_SIZE - 1);
+}
+
+LiteralBlock* allocateLiteralBlock(size_t size)
+{
+    size_t mapped = literalBlockSize(size);
+    countAllocation(mapped);
+    countBytes(MEM_LITERALS, mapped);
+
+    LiteralBlock* block = (LiteralBlock*)mapAligned(mapped, LITERAL_BLOCK_SIZE, 0);
+    block->next = NULL;
+    block->used = 0;
+    block->capacity = mapped - sizeof(LiteralBlock);
+    block->isMarked = false;
+    return block;
+}
+
+static void freeLiteralBlock(LiteralBlock* block)
+{
+    size_t mapped = literalBlockSize(block->capacity);
+    vm.bytesAllocated -= mapped;
+    uncountBytes(MEM_LITERALS, mapped);
+    munmap(block, mapped);
+}
+
+// Free the literal blocks that no static string reached by the full collection points into
+// The current block (the first one) is kept for the literals still to come, but starts over if nothing uses it
+static void sweepLiterals()
+{
+    LiteralBlock** link = &vm.literals;
+    while (*link != NULL)
+    {
+        LiteralBlock* block = *link;
+        if (block->isMarked || block == vm.literals)
+        {
+            if (!block->isMarked)
+                block->used = 0;
+            block->isMarked = false;
+            link = &block->next;
+            continue;
+        }
+
+        *link = block->next;
+        freeLiteralBlock(block);
+    }
+}
+
+// Mark the old objects in use, the others are freed as their regions get swept (the nursery has to be empty)
+static void collectOld()
+{
+    finishSweeping();
+
+    vm.markedBytes = 0;
+    traceRoots();
+    traceTable(&vm.globals);
+    traceGrayObjects();
+
+    // Symbols are only kept alive by what uses them, the interning table just forgets those that are gone
+    tableRemoveWhite(&vm.strings);
+    sweepLargeObjects();
+    sweepLiterals();
+
+    // Every region has to be swept before cells can be allocated from it again
+    for (int i = 0; i < SIZE_CLASS_COUNT; i++)
+    {
+        vm.sizeClasses[i].sweepNext = vm.sizeClasses[i].regions;
+        vm.sizeClasses[i].current = NULL;
+    }
+
+    // The cells that weren't marked are as good as freed already
+    size_t live = vm.bytesAllocated - (vm.cellBytes - vm.markedBytes);
+    vm.nextGC = live * GC_HEAP_GROW_FACTOR;
+    if (vm.nextGC < GC_INITIAL_THRESHOLD)
+        vm.nextGC = GC_INITIAL_THRESHOLD;
+    vm.nextGC = limitThreshold(vm.nextGC, live);
+}
+
+#ifdef DEBUG_GC_STATS
+// Count a pause in the histogram of its kind of collection
+static void recordPause(long* buckets, double pause)
+{
+    // Bucket is the highest set bit of the pause in microseconds, so under 2 -> 0, 2-3 -> 1, 4-7 -> 2...
+    long microseconds = (long)(pause * 1e6);
+    int bucket = microseconds < 2 ? 0 : 63 - __builtin_clzl((unsigned long)microseconds);
+    if (bucket >= GC_PAUSE_BUCKETS)
+        bucket = GC_PAUSE_BUCKETS - 1;
+    buckets[bucket]++;
+}
+#endif
+
+bool collectGarbage()
+{
+#ifdef DEBUG_GC_STATS
+    double start = now();
+#endif
+
+    isCollecting = true;
+    bool isMajor = vm.collectionRequest == GC_MAJOR;
+    collectNursery();
+    // Promoting can be what takes the old generation over its threshold
+    if (isMajor || vm.bytesAllocated > vm.nextGC)
+    {
+        isMajor = true;
+        collectOld();
+    }
+    vm.collectionRequest = GC_NONE;
+    // The cells a full collection didn't mark (and whatever they own) are only freed as their regions get swept,
+    // so the heap isn't really over its limit until they all are
+    if (isMajor && vm.bytesAllocated > vm.options.memoryLimit)
+        finishSweeping();
+    isCollecting = false;
+
+#ifdef DEBUG_GC_STATS
+    double pause = now() - start;
+    if (isMajor)
+    {
+        vm.gcStats.majorCollections++;
+        vm.gcStats.majorSeconds += pause;
+        if (pause > vm.gcStats.maxMajorPause)
+            vm.gcStats.maxMajorPause = pause;
+        recordPause(vm.gcStats.majorPauses, pause);
+    }
+    else
+    {
+        vm.gcStats.minorCollections++;
+        vm.gcStats.minorSeconds += pause;
+        if (pause > vm.gcStats.maxMinorPause)
+            vm.gcStats.maxMinorPause = pause;
+        recordPause(vm.gcStats.minorPauses, pause);
+    }
+#endif
+
+    return vm.bytesAllocated <= vm.options.memoryLimit;
+}
+
+void releaseCallMemory()
+{
+    if (!vm.options.useArenas)
+        return;
+
+    // Whatever the call allocated that's still reachable is promoted to the old generation now, and the rest goes
+    // with the nursery, so every call starts from an empty one (a call that allocated nothing has nothing to move)
+    if (vm.nursery.top != vm.nursery.start)
+        collectGarbage();
+    resetArena(&vm.scratch);
+}
+
+void freeLiterals()
+{
+    LiteralBlock* block = vm.literals;
+    while (block != NULL)
+    {
+        LiteralBlock* next = block->next;
+        freeLiteralBlock(block);
+        block = next;
+    }
+    vm.literals = NULL;
+}
+
+void freeSlabs()
+{
+#ifdef SLAB_ALLOCATOR
+    void* slab = vm.slabs;
+    while (slab != NULL)
+    {
+        void* next = *(void**)slab;
+        munmap(slab, SLAB_SIZE);
+        slab = next;
+    }
+    vm.slabs = NULL;
+#endif
+}
+
+void freeObjects()
+{
+    // Young objects only need what they own outside of the nursery freed
+    for (int i = 0; i < vm.youngOwners.count; i++)
+        releaseObject(vm.youngOwners.objects[i]);
+    free(vm.youngOwners.objects);
+    free(vm.remembered.objects);
+    free(vm.youngGlobals.objects);
+    free(vm.grayStack.objects);
+    munmap(vm.nursery.start, vm.nursery.end - vm.nursery.start);
+    if (vm.options.useArenas)
+        munmap(vm.scratch.start, vm.scratch.end - vm.scratch.start);
+
+    for (int i = 0; i < SIZE_CLASS_COUNT; i++)
+    {
+        SizeClass* sizeClass = &vm.sizeClasses[i];
+        while (sizeClass->regions != NULL)
+        {
+            Region* region = sizeClass->regions;
+            for (int word = 0; word < REGION_BITMAP_WORDS; word++)
+            {
+                for (uint64_t bits = region->allocated[word]; bits != 0; bits &= bits - 1)
+                {
+                    Obj* object = (Obj*)((uint8_t*)region + (size_t)(word * 64 + __builtin_ctzll(bits)) * REGION_GRANULE);
+                    releaseObject(object);
+                    vm.memoryStats.oldObjectBytes[object->type] -= region->cellSize;
+                }
+            }
+            vm.cellBytes -= (size_t)region->cellCount * region->cellSize;
+            vm.bytesAllocated -= (size_t)region->cellCount * region->cellSize;
+            uncountBytes(MEM_OBJECTS, (size_t)region->cellCount * region->cellSize);
+            freeRegion(sizeClass, region);
+        }
+    }
+
+    for (int i = 0; i < vm.largeObjects.count; i++)
+        freeObject(vm.largeObjects.objects[i]);
+    free(vm.largeObjects.objects);
+}
+
+#ifdef DEBUG_GC_STATS
+// Print the non-empty buckets of a pause histogram
+static void printPauses(const char* name, long* buckets)
+{
+    fprintf(stderr, "%s pauses (us):", name);
+    for (int i = 0; i < GC_PAUSE_BUCKETS; i++)
+    {
+        if (buckets[i] == 0)
+            continue;
+        long low = 1l << i;
+        if (i == 0)
+            fprintf(stderr, " <2: %ld", buckets[i]);
+        else if (i == GC_PAUSE_BUCKETS - 1)
+            fprintf(stderr, " %ld+: %ld", low, buckets[i]);
+        else
+            fprintf(stderr, " %ld-%ld: %ld", low, 2 * low - 1, buckets[i]);
+    }
+    fprintf(stderr, "\n");
+}
+
+void printGcStats()
+{
+    GcStats* stats = &vm.gcStats;
+    fprintf(stderr, "== gc ==\n");
+    fprintf(stderr, "minor collections %ld: %.3f ms, longest %.3f ms, promoted %zu bytes\n",
+            stats->minorCollections, stats->minorSeconds * 1000, stats->maxMinorPause * 1000, stats->promotedBytes);
+    printPauses("minor", stats->minorPauses);
+    fprintf(stderr, "major collections %ld: %.3f ms, longest %.3f ms\n", stats->majorCollections,
+            stats->majorSeconds * 1000, stats->maxMajorPause * 1000);
+    printPauses("major", stats->majorPauses);
+    fprintf(stderr, "swept %ld objects (%zu bytes) in %ld regions, %.3f ms\n", stats->sweptObjects,
+            stats->sweptBytes, stats->sweptRegions, stats->sweepSeconds * 1000);
+    fprintf(stderr, "heap %zu bytes (%zu in cells, next full collection at %zu), nursery %zu of %zu bytes used\n",
+            vm.bytesAllocated, vm.cellBytes, vm.nextGC, (size_t)(vm.nursery.top - vm.nursery.start),
+            (size_t)(vm.nursery.end - vm.nursery.start));
+}
+#endif
+
+const char* memoryCategoryNames[MEM_CATEGORY_COUNT] = {"chunks",  "constants", "tokens", "tables",
+                                                     "strings", "literals",  "objects"};
+const char* objTypeNames[OBJ_TYPE_COUNT] = {"string", "rope", "map", "frozen map", "hamt node"};
+
+void printMemoryStats()
+{
+    MemoryStats* stats = &vm.memoryStats;
+
+    fprintf(stderr, "== memory ==\n");
+    fprintf(stderr, "heap %zu bytes, peak %zu", vm.bytesAllocated, stats->peakHeapBytes);
+    if (vm.options.memoryLimit != SIZE_MAX)
+        fprintf(stderr, ", limit %zu", vm.options.memoryLimit);
+    fprintf(stderr, "\nnursery %zu of %zu bytes used\n", (size_t)(vm.nursery.top - vm.nursery.start),
+            (size_t)(vm.nursery.end - vm.nursery.start));
+
+    fprintf(stderr, "%-12s %12s %12s\n", "category", "bytes", "peak");
+    for (int i = 0; i < MEM_CATEGORY_COUNT; i++)
+        fprintf(stderr, "%-12s %12zu %12zu\n", memoryCategoryNames[i], stats->bytes[i], stats->peakBytes[i]);
+
+    // Bytes allocated count young objects too, old bytes are those taken in the old generation right now
+    fprintf(stderr, "%-12s %12s %12s %12s\n", "type", "allocated", "bytes", "old bytes");
+    for (int i = 0; i < OBJ_TYPE_COUNT; i++)
+    {
+        fprintf(stderr, "%-12s %12ld %12zu %12zu\n", objTypeNames[i], stats->objectsAllocated[i],
+                stats->objectBytesAllocated[i], stats->oldObjectBytes[i]);
     }
 }
@@ -3,12 +3,32 @@
 
 #include "object.h"
 
-#define ALLOCATE(type, count) \
-    (type*)reallocate(NULL, 0, sizeof(type) * (count))
+// What memory allocated through reallocate is used for, so that it can be accounted for separately
+typedef enum
+{
+    // Bytecode and line numbers of chunks
+    MEM_CHUNKS,
+    // Chunks' constant arrays
+    MEM_CONSTANTS,
+    // The compiler's token arrays (SCAN_AHEAD)
+    MEM_TOKENS,
+    // Arrays of hash tables (globals, the interning table and maps)
+    MEM_TABLES,
+    // What strings use outside of their objects (code point indexes, and the stack for flattening ropes)
+    MEM_STRINGS,
+    // The literal region holding the characters of static strings
+    MEM_LITERALS,
+    // Objects of the old generation (in cells of regions, or on their own when large)
+    MEM_OBJECTS,
+    MEM_CATEGORY_COUNT
+} MemoryCategory;
+
+#define ALLOCATE(type, count, category) \
+    (type*)reallocate(NULL, 0, sizeof(type) * (count), category)
 
 // Frees the given pointer of the given type (reallocating it to 0)
-#define FREE(type, pointer) \
-    reallocate(pointer, sizeof(type), 0)
+#define FREE(type, pointer, category) \
+    reallocate(pointer, sizeof(type), 0, category)
 
 // Calculates a new capacity based on current given capacity
 // Initially use size 8, then double it if more is needed
@@ -16,18 +36,257 @@
     ((capacity) < 8 ? 8 : (capacity)*2)
 
 // Grows the array to the new size for the given type
-#define GROW_ARRAY(previous, type, oldCount, count)        \
-    (type*)reallocate(previous, sizeof(type) * (oldCount), \
-                      sizeof(type) * (count))
+#define GROW_ARRAY(previous, type, oldCount, count, category) \
+    (type*)reallocate(previous, sizeof(type) * (oldCount),    \
+                      sizeof(type) * (count), category)
 
 // Frees the given array, by reallocating with new size 0
-#define FREE_ARRAY(type, pointer, oldCount) \
-    reallocate(pointer, sizeof(type) * (oldCount), 0)
+#define FREE_ARRAY(type, pointer, oldCount, category) \
+    reallocate(pointer, sizeof(type) * (oldCount), 0, category)
+
+// Same as GROW_ARRAY and FREE_ARRAY for memory that only lasts for one call to interpret (a chunk's arrays),
+// which comes from the scratch arena when the VM uses arenas
+#define GROW_SCRATCH_ARRAY(previous, type, oldCount, count, category) \
+    (type*)reallocateScratch(previous, sizeof(type) * (oldCount),    \
+                             sizeof(type) * (count), category)
+
+#define FREE_SCRATCH_ARRAY(type, pointer, oldCount, category) \
+    reallocateScratch(pointer, sizeof(type) * (oldCount), 0, category)
+
+// New objects are allocated in the nursery by bumping a pointer, most of them are dead by the time it fills up
+// A minor collection then copies the ones still in use into the old generation and empties the nursery,
+// which only costs time for the objects that survive
+#define NURSERY_SIZE (1024 * 1024)
+// Globals set to young objects between two collections that are remembered before the next one is requested early
+// (the same globals can be set over and over, their names are kept as many times)
+#define YOUNG_GLOBALS_MAX (64 * 1024)
+
+// Objects bigger than this go to the old generation right away, copying them would cost more than allocating them there
+#define NURSERY_MAX_OBJECT (4 * 1024)
+
+// When the VM uses arenas (ori --arena), the nursery is big enough for everything a call to interpret allocates
+// (or nearly, it's collected as usual if it does fill up), and emptied by a minor collection once the call returns
+// Only addresses are reserved, pages are backed by memory as they're first used
+#define ARENA_NURSERY_SIZE ((size_t)1024 * 1024 * 1024)
+// Reservation for the arrays of a call's chunk
+#define ARENA_SCRATCH_SIZE ((size_t)256 * 1024 * 1024)
+// Arenas start on a huge page boundary, so the kernel can back them with huge pages
+#define ARENA_ALIGNMENT (2 * 1024 * 1024)
+// Bytes at the start of an arena that stay backed when it's emptied (for the next call to reuse)
+// Pages past that go back to the system
+#define ARENA_RETAINED (4 * 1024 * 1024)
+
+// Old objects live in regions of REGION_SIZE bytes (aligned to their size, so an object's region is found by masking
+// its address), each holding cells of a single size class
+// Whether a cell is allocated and whether it's marked are kept in bitmaps at the start of its region rather than in
+// the objects, so sweeping a region only reads its bitmaps (and the objects that died), not every object in it
+#define REGION_SIZE (256 * 1024)
+// Bitmaps have a bit for every REGION_GRANULE bytes, cells are a multiple of it (so a cell's bit is its offset / 16)
+#define REGION_GRANULE 16
+#define REGION_BITMAP_WORDS (REGION_SIZE / REGION_GRANULE / 64)
+// Biggest cell, old objects bigger than this are allocated on their own
+#define REGION_MAX_CELL 4096
+// Size classes go up 16 bytes at a time to 256, then by a quarter of each power of 2 (320, 384, 448, 512, 640...)
+#define SIZE_CLASS_COUNT 32
+
+typedef struct sRegion
+{
+    // Regions of the same size class, most recently created first
+    struct sRegion* next;
+    struct sRegion* previous;
+    int cellSize;
+    // Number of allocated cells
+    int cellCount;
+    // Free cells, each holding a pointer to the next
+    void* freeList;
+    // Cells from here to the end of the region have never been used (they're not on the free list)
+    uint8_t* unused;
+    // Bit of the first granule of each cell that was reached by the last full collection
+    uint64_t marks[REGION_BITMAP_WORDS];
+    // Bit of the first granule of each cell that holds an object
+    uint64_t allocated[REGION_BITMAP_WORDS];
+    // Cells follow (starting at the first granule after the header)
+} Region;
+
+typedef struct
+{
+    Region* regions;
+    // Region cells are allocated from
+    Region* current;
+    // Next region to sweep, regions from there on haven't been swept since the last full collection
+    // (regions created since then are at the front of the list, before it)
+    Region* sweepNext;
+} SizeClass;
+
+// Literal blocks are mapped on their own, LITERAL_BLOCK_SIZE bytes aligned to their size (or more for a literal that
+// doesn't fit, which then starts in their first LITERAL_BLOCK_SIZE bytes), so that the block holding the characters
+// of a static string is found by masking their address
+#define LITERAL_BLOCK_SIZE (64 * 1024)
+#define LITERAL_BLOCK_OF(chars) ((LiteralBlock*)((uintptr_t)(chars) & ~(uintptr_t)(LITERAL_BLOCK_SIZE - 1)))
+
+// Blocks of up to SLAB_MAX_BLOCK bytes allocated through reallocate come from slabs of SLAB_SIZE bytes
+// Blocks are rounded up to the same size classes as cells, and freed ones are kept on a free list for their class
+// (reallocate is told the old size, so blocks don't need a header to know their class)
+#define SLAB_SIZE (64 * 1024)
+#define SLAB_MAX_BLOCK REGION_MAX_CELL
+
+typedef struct
+{
+    // Free blocks, each holding a pointer to the next
+    void* freeList;
+    // Part of the class's newest slab that has never been used
+    uint8_t* unused;
+    uint8_t* end;
+} SlabClass;
+
+// Bytes allocated through reallocate (the old generation, and the memory objects own outside of themselves)
+// before the first full collection, after which it's GC_HEAP_GROW_FACTOR times what survived the last one
+// Under a memory limit it's never more than halfway from what survived to the limit, the other half is left
+// for what an instruction allocates before the collection it requests can run
+#define GC_INITIAL_THRESHOLD (1024 * 1024)
+#define GC_HEAP_GROW_FACTOR 2
+
+typedef enum
+{
+    GC_NONE,
+    // Only empty the nursery
+    GC_MINOR,
+    // Empty the nursery, then mark and sweep the old generation
+    GC_MAJOR
+} CollectionKind;
+
+// Why an allocation failed while a chunk was running, the value interpret gets back from longjmp
+typedef enum
+{
+    // It would have taken the heap over the memory limit
+    ALLOCATION_OVER_LIMIT = 1,
+    // The system had no memory left to give
+    ALLOCATION_OUT_OF_MEMORY
+} AllocationFailure;
+
+// A range of memory allocated by bumping a pointer, and freed all at once
+typedef struct
+{
+    uint8_t* start;
+    // Where the next allocation goes
+    uint8_t* top;
+    uint8_t* end;
+} Arena;
+
+// A growable array of objects for the collector's own bookkeeping
+// (grown with realloc directly, it isn't part of the heap)
+typedef struct
+{
+    int count;
+    int capacity;
+    Obj** objects;
+} ObjArray;
+
+// Names of the categories and of the object types, for reports
+extern const char* memoryCategoryNames[MEM_CATEGORY_COUNT];
+extern const char* objTypeNames[OBJ_TYPE_COUNT];
+
+// Where the heap's memory goes, always counted (printed by ori --mem-stats)
+typedef struct
+{
+    // Bytes in use for each category, and the most there ever were
+    size_t bytes[MEM_CATEGORY_COUNT];
+    size_t peakBytes[MEM_CATEGORY_COUNT];
+    // Most bytes the heap ever had (what the memory limit applies to, see vm.h)
+    size_t peakHeapBytes;
+    // Objects allocated of each type (young or old) and their bytes
+    long objectsAllocated[OBJ_TYPE_COUNT];
+    size_t objectBytesAllocated[OBJ_TYPE_COUNT];
+    // Bytes of objects of each type in the old generation (dead ones included until they're swept)
+    size_t oldObjectBytes[OBJ_TYPE_COUNT];
+} MemoryStats;
+
+#ifdef DEBUG_GC_STATS
+// Pauses are counted in buckets of powers of 2 microseconds: under 2, 2-3, 4-7... up to 2^(GC_PAUSE_BUCKETS - 1) and more
+#define GC_PAUSE_BUCKETS 16
+
+typedef struct
+{
+    long minorCollections;
+    long majorCollections;
+    // Total and longest pause of each kind of collection (a major one includes emptying the nursery)
+    double minorSeconds;
+    double maxMinorPause;
+    double majorSeconds;
+    double maxMajorPause;
+    long minorPauses[GC_PAUSE_BUCKETS];
+    long majorPauses[GC_PAUSE_BUCKETS];
+    // Bytes copied out of the nursery, and objects freed by sweeping
+    size_t promotedBytes;
+    long sweptObjects;
+    size_t sweptBytes;
+    // Regions swept (while allocating rather than during a pause) and the time it took
+    long sweptRegions;
+    double sweepSeconds;
+} GcStats;
+#endif
 
 // Dynamic memory management, used for allocating, resizing, freeing, etc.
 // Returns void* which is a pointer to data of "any type"
-void* reallocate(void* previous, size_t oldSize, size_t newSize);
-// Frees all dynamically allocated objects on the VM's linked list
+// Never collects garbage itself, it only requests a collection once enough has been allocated (see collectGarbage)
+// The bytes are counted as used for the given category
+// While a chunk runs, an allocation that would take the heap over the memory limit (or that the system can't give)
+// doesn't return, it jumps back to interpret with the AllocationFailure (see vm.allocationFailure)
+// The previous memory is left as it was then, so callers keep their data as long as they allocate before changing it
+void* reallocate(void* previous, size_t oldSize, size_t newSize, MemoryCategory category);
+// Like reallocate, but for memory that's only used during the current call to interpret
+// With arenas it's taken from the scratch arena, and only freed when the call returns
+void* reallocateScratch(void* previous, size_t oldSize, size_t newSize, MemoryCategory category);
+// Set up the nursery and the collector's state (and the scratch arena when using arenas), following vm.options
+void initHeap();
+// Free what the call to interpret that just returned allocated, other than what's still reachable
+// (objects reachable from globals are promoted to the old generation, the arenas are emptied)
+void releaseCallMemory();
+// Map a new literal block with room for at least the given number of characters
+LiteralBlock* allocateLiteralBlock(size_t size);
+// Get room for an object of the given size in the nursery
+// Returns NULL if the object is too big for it or it's full (requesting a collection)
+void* allocateYoung(size_t size);
+// Get room for an object of the given size and type in the old generation
+// (sweeping regions as needed to find a free cell)
+// The object's isLarge flag is set, the rest of it is up to the caller
+// Fails like reallocate when the heap can't take the object
+Obj* allocateOld(size_t size, ObjType type);
+// Whether the last full collection reached the object
+bool isMarked(Obj* object);
+// Add an old object to the remembered set, so the next minor collection traces the young objects it points to
+void rememberObject(Obj* object);
+// Record that object now points to value (for any object that may be old, before a collection traces it)
+// An old object pointing into the nursery needs to be remembered, no other roots reach those young objects
+void writeBarrier(Obj* object, Value value);
+// Record that the global with the given name was set to value
+// Globals aren't an object the remembered set can hold, their names are kept in vm.youngGlobals instead
+void globalWriteBarrier(ObjString* name, Value value);
+// Record that a young object owns memory outside of the nursery (map entries, a code point index),
+// which has to be freed if the object dies before being promoted
+void trackYoungOwner(Obj* object);
+// Run the requested collection
+// Only called at safepoints, between instructions, when every object in use is reachable from the roots
+// (the stack, globals and the chunk's constants), and no C code holds on to an object that may move
+// Returns false if the heap is still over the memory limit afterwards
+bool collectGarbage();
+// Trace an object the collector has reached (marking it, or copying it out of the nursery)
+// Returns where the object is now
+Obj* traceObject(Obj* object);
+// Trace the object of the value (if any), updating the value if it moved
+void traceValue(Value* value);
+// Frees all dynamically allocated objects, young or old
 void freeObjects();
+// Frees all of the VM's literal blocks
+void freeLiterals();
+// Gives the slabs back to the system (once everything allocated through reallocate has been freed)
+void freeSlabs();
+// Print how much memory each category and each type of object uses (to stderr)
+void printMemoryStats();
+
+#ifdef DEBUG_GC_STATS
+// Print the collector's counters and the size of the heap
+void printGcStats();
+#endif
 
 #endif
@@ -1,9 +1,11 @@
 #include <stdio.h>
 #include <string.h>
 
+#include "hamt.h"
 #include "memory.h"
 #include "object.h"
 #include "table.h"
+#include "utf8.h"
 #include "value.h"
 #include "vm.h"
 
@@ -11,72 +13,460 @@
 #define ALLOCATE_OBJ(type, objectType) \
     (type*)allocateObject(sizeof(type), objectType)
 
-static Obj* allocateObject(size_t size, ObjType type)
+// isLarge is up to the allocator (old objects are found through their regions or vm.largeObjects, not linked)
+static Obj* initObject(Obj* object, ObjType type)
 {
-    Obj* object = (Obj*)reallocate(NULL, 0, size);
     object->type = type;
+    object->isMarked = false;
+    object->isRemembered = false;
+    object->isForwarded = false;
+    return object;
+}
+
+// Allocate an object in the old generation right away, for objects that are known to live long
+static Obj* allocateTenured(size_t size, ObjType type)
+{
+    vm.memoryStats.objectsAllocated[type]++;
+    vm.memoryStats.objectBytesAllocated[type] += size;
+    return initObject(allocateOld(size, type), type);
+}
+
+Obj* allocateObject(size_t size, ObjType type)
+{
+    if (vm.options.allocationProfilePath != NULL)
+        profileAllocation(type, size);
 
-    // Insert newly allocated object to the VM's list
-    object->next = vm.objects;
-    vm.objects = object;
+    // Most objects die young, those in the nursery are freed all at once by the next collection
+    Obj* object = (Obj*)allocateYoung(size);
+    if (object != NULL)
+    {
+        vm.memoryStats.objectsAllocated[type]++;
+        vm.memoryStats.objectBytesAllocated[type] += size;
+        object->isLarge = false;
+        return initObject(object, type);
+    }
 
+    // An old object can then be made to point to young ones like any new object,
+    // so it's remembered until the next collection
+    object = allocateTenured(size, type);
+    rememberObject(object);
     return object;
 }
 
-static ObjString* allocateString(char* chars, int length, uint32_t hash)
+uint32_t newIdentityHash()
 {
-    ObjString* string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
-    string->length = length;
-    string->chars = chars;
-    string->hash = hash;
+    // Objects are numbered in the order they are created, mixed so the hashes are spread out
+    static uint64_t nextIdentity = 1;
+    return hashBits(nextIdentity++);
+}
 
-    // Add the string to the VM's string interning table
-    // NOTE: See table.c's findEntry TODO note. 
-    // This could be done only in a special Symbols object if wanted.
-    tableSet(&vm.strings, string, NULL_VAL);
+// Size of a string object holding length characters inline
+#define STRING_SIZE(length) (sizeof(ObjString) + (length) + 1)
 
-    return string;
+// Constants for the string hash (odd numbers with evenly mixed bits, from wyhash)
+#define HASH_SECRET0 0xa0761d6478bd642full
+#define HASH_SECRET1 0xe7037ed1a0b428dbull
+#define HASH_SECRET2 0x8ebc6af09c88c6e3ull
+
+// Multiply the two numbers into 128 bits and fold the halves together
+static inline uint64_t hashMix(uint64_t a, uint64_t b)
+{
+#ifdef __SIZEOF_INT128__
+    __uint128_t product = (__uint128_t)a * b;
+    return (uint64_t)product ^ (uint64_t)(product >> 64);
+#else
+    // Same thing using 32 bit halves when 128 bit integers are not available
+    uint64_t aHigh = a >> 32, aLow = (uint32_t)a, bHigh = b >> 32, bLow = (uint32_t)b;
+    uint64_t high = aHigh * bHigh, middle0 = aHigh * bLow, middle1 = aLow * bHigh, low = aLow * bLow;
+    uint64_t carry = ((low >> 32) + (uint32_t)middle0 + (uint32_t)middle1) >> 32;
+    return (low + (middle0 << 32) + (middle1 << 32)) ^ (high + (middle0 >> 32) + (middle1 >> 32) + carry);
+#endif
 }
 
-static uint32_t hashString(const char* key, int length) {
-    // FNV-1a hash algorithm
-    uint32_t hash = 2166136261u;
-    for(int i = 0; i < length; i++) {
-        hash ^= key[i];
-        hash *= 16777619;
+// Read 8 or 4 bytes at once, memcpy takes care of alignment and compiles down to a single load
+static inline uint64_t read64(const char* p)
+{
+    uint64_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static inline uint64_t read32(const char* p)
+{
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static uint32_t hashString(const char* key, int length)
+{
+    // Hashes 16 bytes per step rather than 1 (the same construction as wyhash):
+    // each step multiplies two 64 bit words into 128 bits, which mixes every input bit into every output bit
+    // The secrets are different for every process (see initVM), so which keys collide can't be known in advance
+    // NOTE: Both operands of each multiplication include a secret, otherwise an input word that zeroes one of them
+    // (or two words swapped) would collide no matter the seed
+    uint64_t secret1 = HASH_SECRET1 ^ vm.hashSeed[0];
+    uint64_t secret2 = HASH_SECRET2 ^ vm.hashSeed[1];
+    uint64_t seed = HASH_SECRET0;
+    uint64_t a;
+    uint64_t b;
+
+    if (length <= 16)
+    {
+        if (length >= 4)
+        {
+            // Two (possibly overlapping) 4 byte reads from each end cover all of the bytes
+            int middle = (length >> 3) << 2;
+            a = (read32(key) << 32) | read32(key + middle);
+            b = (read32(key + length - 4) << 32) | read32(key + length - 4 - middle);
+        }
+        else if (length > 0)
+        {
+            a = ((uint64_t)(uint8_t)key[0] << 16) | ((uint64_t)(uint8_t)key[length >> 1] << 8) | (uint8_t)key[length - 1];
+            b = 0;
+        }
+        else
+        {
+            a = b = 0;
+        }
+    }
+    else
+    {
+        const char* p = key;
+        int remaining = length;
+        while (remaining > 16)
+        {
+            seed = hashMix(read64(p) ^ secret1, read64(p + 8) ^ secret2 ^ seed);
+            p += 16;
+            remaining -= 16;
+        }
+        // The last 16 bytes (overlapping with the previous step if needed)
+        a = read64(p + remaining - 16);
+        b = read64(p + remaining - 8);
     }
-    return hash;
+
+    uint64_t hash = hashMix(a ^ secret1 ^ (uint64_t)length, b ^ secret2 ^ seed);
+    // Tables only use the low bits, fold the high ones into them
+    return (uint32_t)(hash ^ (hash >> 32));
 }
 
-ObjString* takeString(char* chars, int length)
+uint32_t hashBits(uint64_t bits)
 {
-    uint32_t hash = hashString(chars, length);
+    uint64_t hash = hashMix(bits ^ HASH_SECRET1 ^ vm.hashSeed[0], HASH_SECRET2 ^ vm.hashSeed[1]);
+    return (uint32_t)(hash ^ (hash >> 32));
+}
 
-    // Check if this exact string already exits, if so, instead of copying it, just pass it
-    ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
-    if (interned != NULL) {
-        // Also need to free up the chars passed because no longer need it
-        // And takeString takes ownership of it so it has to handle freeing it
-        FREE_ARRAY(char, chars, length + 1);
-        return interned;
+#define ROTATE_LEFT(x, bits) (((x) << (bits)) | ((x) >> (64 - (bits))))
+
+// One round of SipHash
+#define SIP_ROUND(v0, v1, v2, v3)                                               \
+    do                                                                          \
+    {                                                                           \
+        v0 += v1; v1 = ROTATE_LEFT(v1, 13); v1 ^= v0; v0 = ROTATE_LEFT(v0, 32); \
+        v2 += v3; v3 = ROTATE_LEFT(v3, 16); v3 ^= v2;                           \
+        v0 += v3; v3 = ROTATE_LEFT(v3, 21); v3 ^= v0;                           \
+        v2 += v1; v1 = ROTATE_LEFT(v1, 17); v1 ^= v2; v2 = ROTATE_LEFT(v2, 32); \
+    } while (false)
+
+uint32_t hashStringKeyed(const char* key, int length)
+{
+    // SipHash-1-3 (one round per word, three to finish), keyed with the VM's secret key
+    // Much slower than hashString, but finding collisions without knowing the key is as hard as breaking SipHash
+    uint64_t v0 = vm.sipKey[0] ^ 0x736f6d6570736575ull;
+    uint64_t v1 = vm.sipKey[1] ^ 0x646f72616e646f6dull;
+    uint64_t v2 = vm.sipKey[0] ^ 0x6c7967656e657261ull;
+    uint64_t v3 = vm.sipKey[1] ^ 0x7465646279746573ull;
+
+    const char* p = key;
+    const char* end = key + (length & ~7);
+    for (; p < end; p += 8)
+    {
+        uint64_t word = read64(p);
+        v3 ^= word;
+        SIP_ROUND(v0, v1, v2, v3);
+        v0 ^= word;
     }
 
-    return allocateString(chars, length, hash);
+    // The last 0 to 7 bytes, with the length in the top byte
+    uint64_t last = (uint64_t)length << 56;
+    for (int i = 0; i < (length & 7); i++)
+        last |= (uint64_t)(uint8_t)p[i] << (8 * i);
+    v3 ^= last;
+    SIP_ROUND(v0, v1, v2, v3);
+    v0 ^= last;
+
+    v2 ^= 0xFF;
+    SIP_ROUND(v0, v1, v2, v3);
+    SIP_ROUND(v0, v1, v2, v3);
+    SIP_ROUND(v0, v1, v2, v3);
+
+    uint64_t hash = v0 ^ v1 ^ v2 ^ v3;
+    return (uint32_t)(hash ^ (hash >> 32));
+}
+
+ObjString* makeString(int length, bool isAscii)
+{
+    // The characters come right after the header, so the whole string is a single allocation
+    ObjString* string = (ObjString*)allocateObject(STRING_SIZE(length), OBJ_STRING);
+    string->length = length;
+    string->hash = 0;
+    string->isHashed = false;
+    string->isKeyedHashed = false;
+    string->isInterned = false;
+    string->isStatic = false;
+    string->isAscii = isAscii;
+    string->codePoints = NULL;
+    string->parent = NULL;
+    string->chars = string->storage;
+    string->storage[length] = '\0';
+    return string;
 }
 
 ObjString* copyString(const char* chars, int length)
+{
+    ObjString* string = makeString(length, isAscii(chars, length));
+    memcpy(string->storage, chars, length);
+    return string;
+}
+
+ObjString* sliceString(ObjString* string, int start, int end)
+{
+    int length = end - start;
+    // Slices always reference the string that owns the characters
+    ObjString* parent = string->parent != NULL ? string->parent : string;
+
+    if (length < SLICE_MIN_LENGTH || length < parent->length / SLICE_MAX_WASTE)
+        return copyString(string->chars + start, length);
+
+    // Only the header is allocated, the characters stay in the parent
+    ObjString* slice = ALLOCATE_OBJ(ObjString, OBJ_STRING);
+    slice->length = length;
+    slice->hash = 0;
+    slice->isHashed = false;
+    slice->isKeyedHashed = false;
+    slice->isInterned = false;
+    slice->isStatic = false;
+    // Only checking the slice's own characters would take linear time,
+    // so a slice of a non-ASCII string is treated as non-ASCII (which is only slower to index)
+    slice->isAscii = parent->isAscii;
+    slice->codePoints = NULL;
+    slice->parent = parent;
+    slice->chars = string->chars + start;
+    return slice;
+}
+
+uint32_t stringHash(ObjString* string)
+{
+    if (!string->isHashed)
+    {
+        string->hash = hashString(string->chars, string->length);
+        string->isHashed = true;
+    }
+    return string->hash;
+}
+
+uint32_t stringKeyedHash(ObjString* string)
+{
+    if (!string->isKeyedHashed)
+    {
+        string->keyedHash = hashStringKeyed(string->chars, string->length);
+        string->isKeyedHashed = true;
+    }
+    return string->keyedHash;
+}
+
+// Build the code point index of a non-ASCII string
+static CodePointIndex* indexCodePoints(ObjString* string)
+{
+    int count = countCodePoints(string->chars, string->length);
+    int offsetCount = count / CODE_POINT_STRIDE + 1;
+    size_t size = sizeof(CodePointIndex) + sizeof(int) * offsetCount;
+    CodePointIndex* index = (CodePointIndex*)reallocate(NULL, 0, size, MEM_STRINGS);
+    index->count = count;
+    // A young string can die without ever being traced, the index still needs to be freed then
+    trackYoungOwner((Obj*)string);
+
+    int codePoint = 0;
+    for (int i = 0; i < string->length; i++)
+    {
+        // Skip continuation bytes, every other byte starts a code point
+        if (((uint8_t)string->chars[i] & 0xC0) == 0x80)
+            continue;
+        if (codePoint % CODE_POINT_STRIDE == 0)
+            index->offsets[codePoint / CODE_POINT_STRIDE] = i;
+        codePoint++;
+    }
+
+    return index;
+}
+
+int stringLength(ObjString* string)
+{
+    if (string->isAscii)
+        return string->length;
+    if (string->codePoints == NULL)
+        string->codePoints = indexCodePoints(string);
+    return string->codePoints->count;
+}
+
+int codePointOffset(ObjString* string, int index)
+{
+    if (string->isAscii)
+        return index;
+
+    // The index is built the first time it's needed, so indexing is O(1) amortized
+    if (string->codePoints == NULL)
+        string->codePoints = indexCodePoints(string);
+    if (index == string->codePoints->count)
+        return string->length;
+
+    // Walk from the closest indexed code point
+    int offset = string->codePoints->offsets[index / CODE_POINT_STRIDE];
+    for (int i = index % CODE_POINT_STRIDE; i > 0; i--)
+    {
+        offset++;
+        while (((uint8_t)string->chars[offset] & 0xC0) == 0x80)
+            offset++;
+    }
+    return offset;
+}
+
+// Copy the given characters into the VM's literal region (null terminating them)
+// Returns a pointer to the copy, which stays valid for as long as the static string using it is
+static char* storeLiteral(const char* chars, int length)
+{
+    LiteralBlock* block = vm.literals;
+    size_t size = (size_t)length + 1;
+
+    if (block == NULL || block->capacity - block->used < size)
+    {
+        block = allocateLiteralBlock(size);
+        block->next = vm.literals;
+        vm.literals = block;
+    }
+
+    char* literal = block->chars + block->used;
+    memcpy(literal, chars, length);
+    literal[length] = '\0';
+    block->used += size;
+    return literal;
+}
+
+ObjString* copyLiteral(const char* chars, int length)
 {
     uint32_t hash = hashString(chars, length);
 
-    // Check if this exact string already exists, if so, instead of copying it, just pass it
+    // Check if this symbol already exists, if so, just pass it rather than allocating a new one
     ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
     if (interned != NULL) return interned;
 
-    char* heapChars = ALLOCATE(char, length + 1);
-    memcpy(heapChars, chars, length);
-    heapChars[length] = '\0';
+    // Only the header is allocated, the characters live in the literal region
+    // Symbols are referenced by chunks and the interning table, so they skip the nursery
+    ObjString* string = (ObjString*)allocateTenured(sizeof(ObjString), OBJ_STRING);
+    string->length = length;
+    string->hash = hash;
+    string->isHashed = true;
+    string->isKeyedHashed = false;
+    string->isInterned = true;
+    string->isStatic = true;
+    string->isAscii = isAscii(chars, length);
+    string->codePoints = NULL;
+    string->parent = NULL;
+    string->chars = storeLiteral(chars, length);
 
-    return allocateString(heapChars, length, hash);
+    // Add the symbol to the VM's string interning table
+    tableSet(&vm.strings, string, NULL_VAL);
+    return string;
+}
+
+ObjMap* newMap()
+{
+    ObjMap* map = ALLOCATE_OBJ(ObjMap, OBJ_MAP);
+    initValueTable(&map->table);
+    map->hash = newIdentityHash();
+    map->isPrinting = false;
+    // Its entries are allocated separately, they need to be freed if it dies young
+    trackYoungOwner((Obj*)map);
+    return map;
+}
+
+ObjRope* makeRope(Obj* left, Obj* right)
+{
+    ObjRope* rope = ALLOCATE_OBJ(ObjRope, OBJ_ROPE);
+    rope->length = anyStringLength(left) + anyStringLength(right);
+    rope->left = left;
+    rope->right = right;
+    rope->isAscii = anyStringIsAscii(left) && anyStringIsAscii(right);
+    rope->flat = NULL;
+    return rope;
+}
+
+int anyStringLength(Obj* string)
+{
+    if (string->type == OBJ_ROPE)
+        return ((ObjRope*)string)->length;
+    return ((ObjString*)string)->length;
+}
+
+bool anyStringIsAscii(Obj* string)
+{
+    if (string->type == OBJ_ROPE)
+        return ((ObjRope*)string)->isAscii;
+    return ((ObjString*)string)->isAscii;
+}
+
+void copyChars(Obj* string, char* dest)
+{
+    // Ropes built with s = s + piece are as deep as the number of pieces,
+    // so walk them with an explicit stack rather than recursion
+    // The pieces are copied from last to first, going right to left so the stack only grows with right-nested ropes
+    int capacity = 8;
+    int count = 0;
+    Obj** stack = ALLOCATE(Obj*, capacity, MEM_STRINGS);
+    stack[count++] = string;
+    int end = anyStringLength(string);
+
+    while (count > 0)
+    {
+        Obj* piece = stack[--count];
+        if (piece->type == OBJ_ROPE && ((ObjRope*)piece)->flat != NULL)
+            piece = (Obj*)((ObjRope*)piece)->flat;
+
+        if (piece->type == OBJ_STRING)
+        {
+            ObjString* flat = (ObjString*)piece;
+            end -= flat->length;
+            memcpy(dest + end, flat->chars, flat->length);
+            continue;
+        }
+
+        if (capacity < count + 2)
+        {
+            int oldCapacity = capacity;
+            capacity = GROW_CAPACITY(oldCapacity);
+            stack = GROW_ARRAY(stack, Obj*, oldCapacity, capacity, MEM_STRINGS);
+        }
+        stack[count++] = ((ObjRope*)piece)->left;
+        stack[count++] = ((ObjRope*)piece)->right;
+    }
+
+    FREE_ARRAY(Obj*, stack, capacity, MEM_STRINGS);
+}
+
+ObjString* flattenRope(ObjRope* rope)
+{
+    if (rope->flat != NULL)
+        return rope->flat;
+
+    ObjString* flat = makeString(rope->length, rope->isAscii);
+    copyChars((Obj*)rope, flat->storage);
+    rope->flat = flat;
+    writeBarrier((Obj*)rope, OBJ_VAL((Obj*)flat));
+
+    // The pieces are no longer needed, the flat string has everything
+    rope->left = NULL;
+    rope->right = NULL;
+    return rope->flat;
 }
 
 void printObject(Value value)
@@ -84,7 +474,69 @@ void printObject(Value value)
     switch (OBJ_TYPE(value))
     {
         case OBJ_STRING:
-            printf("%s", AS_CSTRING(value));
+            printf("%.*s", AS_STRING(value)->length, AS_CSTRING(value));
+            break;
+        case OBJ_ROPE:
+            printf("%s", flattenRope(AS_ROPE(value))->chars);
+            break;
+        case OBJ_MAP:
+        {
+            // Entries come out in the order of their slots, which is unrelated to the order they were added in
+            ObjMap* map = AS_MAP(value);
+            if (map->isPrinting)
+            {
+                printf("{...}");
+                break;
+            }
+
+            ValueTable* table = &map->table;
+            bool isFirst = true;
+            map->isPrinting = true;
+            printf("{");
+            for (int i = 0; i < table->capacity; i++)
+            {
+                if (table->control[i] & CONTROL_EMPTY)
+                    continue;
+                printf(isFirst ? "" : ", ");
+                printValue(table->entries[i].key);
+                printf(": ");
+                printValue(table->entries[i].value);
+                isFirst = false;
+            }
+            printf("}");
+            map->isPrinting = false;
+            break;
+        }
+        case OBJ_FROZEN_MAP:
+        {
+            ObjFrozenMap* map = AS_FROZEN_MAP(value);
+            if (map->isPrinting)
+            {
+                printf("#{...}");
+                break;
+            }
+
+            HamtIterator iterator;
+            initHamtIterator(&iterator, map);
+            Value key;
+            Value entryValue;
+            bool isFirst = true;
+            map->isPrinting = true;
+            printf("#{");
+            while (hamtNext(&iterator, &key, &entryValue))
+            {
+                printf(isFirst ? "" : ", ");
+                printValue(key);
+                printf(": ");
+                printValue(entryValue);
+                isFirst = false;
+            }
+            printf("}");
+            map->isPrinting = false;
+            break;
+        }
+        case OBJ_HAMT_NODE:
+            // Nodes are only ever reached through their map
             break;
     }
 }
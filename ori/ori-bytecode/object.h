@@ -1,47 +1,221 @@
 #ifndef ori_object_h
 #define ori_object_h
 
+#include <limits.h>
+
 #include "common.h"
+#include "table.h"
 #include "value.h"
 
 // Extracts object type tag from a given value
 #define OBJ_TYPE(value) (AS_OBJ(value)->type)
 
 #define IS_STRING(value) isObjType(value, OBJ_STRING)
+#define IS_ROPE(value) isObjType(value, OBJ_ROPE)
+#define IS_MAP(value) isObjType(value, OBJ_MAP)
+#define IS_FROZEN_MAP(value) isObjType(value, OBJ_FROZEN_MAP)
+// Whether the value is a string in any of its representations (flat ObjString or ObjRope)
+#define IS_ANY_STRING(value) (IS_STRING(value) || IS_ROPE(value))
 
 #define AS_STRING(value) ((ObjString*)AS_OBJ(value))
 #define AS_CSTRING(value) (((ObjString*)AS_OBJ(value))->chars)
+#define AS_ROPE(value) ((ObjRope*)AS_OBJ(value))
+#define AS_MAP(value) ((ObjMap*)AS_OBJ(value))
+#define AS_FROZEN_MAP(value) ((ObjFrozenMap*)AS_OBJ(value))
+
+// Non-ASCII strings keep the byte offset of every CODE_POINT_STRIDE-th code point (see CodePointIndex)
+#define CODE_POINT_STRIDE 32
+
+// Slices shorter than this are copied, copying a few characters costs about as much as referencing them
+#define SLICE_MIN_LENGTH 32
+// Slices are copied when they are less than 1/SLICE_MAX_WASTE the length of the string they come from,
+// so a small slice can't keep a much larger string alive
+// (repeatedly slicing off the front of a string still only copies a fraction of it each time it happens)
+#define SLICE_MAX_WASTE 8
+
+// Concatenations that make strings at least this long create a rope rather than copying
+// Below that, copying the characters is cheap and the result can be used as is right away
+#define ROPE_MIN_LENGTH 256
 
 typedef enum
 {
-    OBJ_STRING
+    OBJ_STRING,
+    OBJ_ROPE,
+    OBJ_MAP,
+    OBJ_FROZEN_MAP,
+    // Internal to frozen maps, never a value that scripts see
+    OBJ_HAMT_NODE
 } ObjType;
 
+#define OBJ_TYPE_COUNT (OBJ_HAMT_NODE + 1)
+
+// The header is 2 bytes (the type and the collector's flags), so that the fields of every type of object can start
+// right after it in the first 8 bytes rather than after a whole word of padding
+// Old objects are found through their regions (and large ones in vm.largeObjects), they don't need to be linked
 struct sObj
 {
-    ObjType type;
-    // Reference to the next Obj (making a linked list)
-    // This is used for the GC to have a list of all dynamically allocated Objs
-    struct sObj* next;
+    uint8_t type;
+    // Whether the object was too big for a cell of a region and has its own allocation (see memory.h)
+    bool isLarge : 1;
+    // Whether a full collection has reached the object (only for large objects, others are marked in their region)
+    bool isMarked : 1;
+    // Whether the object is in the collector's remembered set (an old object that may point to young ones)
+    bool isRemembered : 1;
+    // Whether a young object has been copied out of the nursery, the address of its copy is then stored
+    // in the 8 bytes following the header (see memory.c)
+    bool isForwarded : 1;
 };
 
+// Where code points start in a non-ASCII string, so that finding one only takes walking over
+// at most CODE_POINT_STRIDE - 1 others from the closest offset rather than the whole string
+typedef struct
+{
+    // Number of code points in the string
+    int count;
+    // Byte offset of code points 0, CODE_POINT_STRIDE, 2 * CODE_POINT_STRIDE...
+    int offsets[];
+} CodePointIndex;
+
 struct sObjString
 {
     // First field is obj so that a pointer can easily
     // be converted between one and the other
     Obj obj;
+    // The flags share the first 8 bytes with the header and the length
+    bool isHashed : 1;
+    // Whether this string is a symbol (an identifier or literal) in the VM's interning table
+    // Only one interned string exists for given characters, so two of them can be compared by pointer
+    bool isInterned : 1;
+    // Whether chars points into the VM's literal region (see copyLiteral) instead of storage
+    bool isStatic : 1;
+    // Whether all of the characters are ASCII, in which case each byte is a code point
+    // Strings are always valid UTF-8 (the source is validated before it's compiled)
+    bool isAscii : 1;
+    // Whether keyedHash has been computed
+    bool isKeyedHashed : 1;
     int length;
-    // TODO: Use "flexible array members" to avoid having an extra pointer to chars
-    // TODO: Allow for unicode UTF-8 rather than ASCII char
-    char* chars;
     // Cached hash of the string so it doesn't have to be calculated multiple times
+    // Only computed the first time it's needed (see stringHash), most runtime strings never need it
     uint32_t hash;
+    // Cached keyed hash, for the keys of tables that switched over to it (see stringKeyedHash)
+    // It fits in what would otherwise be padding before the next pointer
+    uint32_t keyedHash;
+    // Code point offsets of a non-ASCII string, NULL until the string is first indexed
+    CodePointIndex* codePoints;
+    // For a slice, the string whose characters it shares (kept alive by the slice), NULL otherwise
+    // This is always a string with its own characters, slices of slices share their parent
+    struct sObjString* parent;
+    // The string's UTF-8 characters: its inline storage, the literal region (static strings) or its parent's (slices)
+    // NOTE: Slices' characters are not null terminated, always use length
+    // NOTE: The pointer is kept (even though it's right next to storage most of the time)
+    // so that strings whose characters live elsewhere can be used the same way
+    char* chars;
+    // Characters of the string (null terminated), in the same allocation as the rest of the object
+    char storage[];
 };
 
-// Convert the given c-string into an ObjString (taking ownership of the c-string)
-ObjString* takeString(char* chars, int length);
-// Convert the given c-string into an ObjString (copying the characters)
+// Longest a string (or rope) can be, in bytes (lengths are ints, and there has to be room for the null byte)
+#define STRING_MAX_LENGTH (INT_MAX - 1)
+
+// A string made of the concatenation of two other strings (each either an ObjString or an ObjRope)
+// The characters are only copied into a single ObjString (flattened) when they are actually needed,
+// so building a long string piece by piece takes linear rather than quadratic time
+typedef struct
+{
+    Obj obj;
+    bool isAscii;
+    int length;
+    Obj* left;
+    Obj* right;
+    // The flattened string once it has been needed (left and right are then dropped)
+    ObjString* flat;
+} ObjRope;
+
+// A mutable table from keys of any type to values ({key: value, ...} in ori)
+typedef struct
+{
+    Obj obj;
+    // Set while the map is being printed, so a map that contains itself prints as {...} there instead of forever
+    bool isPrinting;
+    // Hash of the map as a key, its address can't be used since the collector moves young objects
+    uint32_t hash;
+    ValueTable table;
+} ObjMap;
+
+typedef struct sHamtNode HamtNode;
+
+// An immutable map (#{key: value, ...} in ori), stored as a hash array mapped trie (see hamt.h)
+// Adding to it makes a new map that shares all but the changed nodes with it,
+// so keeping both versions costs O(log32 n) rather than a copy of the whole map
+typedef struct
+{
+    Obj obj;
+    // Set while the map is being printed (see ObjMap)
+    bool isPrinting;
+    // Number of entries
+    int count;
+    // Hash of the map as a key (see ObjMap)
+    uint32_t hash;
+    // NULL when the map is empty
+    HamtNode* root;
+} ObjFrozenMap;
+
+// A block of memory that holds the characters of string literals back to back
+// Literals are copied into the current block rather than each getting their own allocation
+// The strings can be interned and outlive their chunk, so a block is kept for as long as any of them is in use
+// (full collections mark the blocks of the static strings they reach, and free the others, see memory.h)
+typedef struct sLiteralBlock
+{
+    struct sLiteralBlock* next;
+    size_t used;
+    size_t capacity;
+    // Whether the last full collection reached a static string whose characters are in the block
+    bool isMarked;
+    char chars[];
+} LiteralBlock;
+
+// Allocate an object of the given size (at least the size of Obj)
+// It starts out in the nursery, unless it's too big for it or the nursery is full (see memory.c)
+Obj* allocateObject(size_t size, ObjType type);
+// Pick the identity hash of a new object, which stays the same when the object is moved
+uint32_t newIdentityHash();
+// Allocate a new (not interned) string with room for length characters, which the caller fills in
+// isAscii tells whether those characters will all be ASCII
+ObjString* makeString(int length, bool isAscii);
+// Convert the given c-string into a new (not interned) ObjString, copying the characters
 ObjString* copyString(const char* chars, int length);
+// Convert the given characters of a literal or identifier (from source code) into an interned symbol
+// whose characters are stored in the VM's literal region
+ObjString* copyLiteral(const char* chars, int length);
+// Get the characters of string between the byte offsets start and end (which must be within the string)
+// This references the string's characters rather than copying them, unless the slice is small (see SLICE_MIN_LENGTH)
+ObjString* sliceString(ObjString* string, int start, int end);
+// Get the hash of the string (computing it the first time)
+uint32_t stringHash(ObjString* string);
+// Hash the given characters with a keyed hash (SipHash), used by tables that are getting too many collisions
+uint32_t hashStringKeyed(const char* key, int length);
+// Get the keyed hash of the string (computing it the first time)
+uint32_t stringKeyedHash(ObjString* string);
+// Hash 64 bits (a number's bits or a pointer) with the same seeded mixing as strings
+uint32_t hashBits(uint64_t bits);
+// Number of code points in the string
+int stringLength(ObjString* string);
+// Byte offset of the code point at index (which must be at most the string's number of code points)
+int codePointOffset(ObjString* string, int index);
+
+// Create a rope of the concatenation of the two given strings (ObjString or ObjRope)
+ObjRope* makeRope(Obj* left, Obj* right);
+// Get the flat ObjString with the rope's characters (creating it the first time)
+ObjString* flattenRope(ObjRope* rope);
+// Copy the characters of the given string (ObjString or ObjRope) into dest
+void copyChars(Obj* string, char* dest);
+// Length of the given string (ObjString or ObjRope) in bytes
+int anyStringLength(Obj* string);
+// Whether the given string (ObjString or ObjRope) is all ASCII
+bool anyStringIsAscii(Obj* string);
+
+// Create a new empty map
+ObjMap* newMap();
 
 // Print the given object value
 void printObject(Value value);
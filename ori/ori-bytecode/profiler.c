@@ -0,0 +1,135 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "profiler.h"
+#include "vm.h"
+
+#define PROFILE_INITIAL_CAPACITY 256
+// Number of sites printed to stderr, the file has all of them
+#define PROFILE_TOP_SITES 20
+
+static inline AllocationSite* siteSlot(AllocationSite* sites, int capacity, int line, int kind)
+{
+    uint32_t index = hashBits(((uint64_t)line << 8) | (uint64_t)kind) & (capacity - 1);
+    while (sites[index].line != 0 && (sites[index].line != line || sites[index].kind != kind))
+        index = (index + 1) & (capacity - 1);
+    return &sites[index];
+}
+
+static void growProfile(AllocationProfile* profile)
+{
+    int capacity = profile->capacity == 0 ? PROFILE_INITIAL_CAPACITY : profile->capacity * 2;
+    AllocationSite* sites = (AllocationSite*)calloc(capacity, sizeof(AllocationSite));
+    if (sites == NULL)
+        exit(1);
+
+    for (int i = 0; i < profile->capacity; i++)
+    {
+        AllocationSite* site = &profile->sites[i];
+        if (site->line != 0)
+            *siteSlot(sites, capacity, site->line, site->kind) = *site;
+    }
+
+    free(profile->sites);
+    profile->sites = sites;
+    profile->capacity = capacity;
+    profile->last = NULL;
+}
+
+static AllocationSite* findSite(AllocationProfile* profile, int line, int kind)
+{
+    // Kept at most 3/4 full
+    if (4 * (profile->count + 1) > 3 * profile->capacity)
+        growProfile(profile);
+
+    AllocationSite* site = siteSlot(profile->sites, profile->capacity, line, kind);
+    if (site->line == 0)
+    {
+        site->line = line;
+        site->kind = kind;
+        profile->count++;
+    }
+    return site;
+}
+
+void profileAllocation(int kind, size_t size)
+{
+    // vm.ip is only set while a chunk runs, and then points past the byte of the instruction last read
+    if (vm.ip == NULL)
+        return;
+    int line = vm.chunk->lines[vm.ip - vm.chunk->code - 1];
+
+    AllocationProfile* profile = &vm.allocationProfile;
+    AllocationSite* site = profile->last;
+    if (site == NULL || site->line != line || site->kind != kind)
+    {
+        site = findSite(profile, line, kind);
+        profile->last = site;
+    }
+    site->count++;
+    site->bytes += size;
+}
+
+static const char* kindName(int kind)
+{
+    return kind < OBJ_TYPE_COUNT ? objTypeNames[kind] : memoryCategoryNames[kind - OBJ_TYPE_COUNT];
+}
+
+// Most bytes first, then most allocations, then by line
+static int compareSites(const void* a, const void* b)
+{
+    const AllocationSite* siteA = (const AllocationSite*)a;
+    const AllocationSite* siteB = (const AllocationSite*)b;
+    if (siteA->bytes != siteB->bytes)
+        return siteA->bytes > siteB->bytes ? -1 : 1;
+    if (siteA->count != siteB->count)
+        return siteA->count > siteB->count ? -1 : 1;
+    if (siteA->line != siteB->line)
+        return siteA->line < siteB->line ? -1 : 1;
+    return siteA->kind - siteB->kind;
+}
+
+void writeAllocationProfile(const char* path)
+{
+    AllocationProfile* profile = &vm.allocationProfile;
+    AllocationSite* sorted = (AllocationSite*)malloc(sizeof(AllocationSite) * (profile->count + 1));
+    if (sorted == NULL)
+        exit(1);
+    int count = 0;
+    for (int i = 0; i < profile->capacity; i++)
+    {
+        if (profile->sites[i].line != 0)
+            sorted[count++] = profile->sites[i];
+    }
+    qsort(sorted, count, sizeof(AllocationSite), compareSites);
+
+    // One stack per site, script;line;kind followed by its bytes
+    FILE* file = fopen(path, "w");
+    if (file == NULL)
+    {
+        fprintf(stderr, "Could not write the allocation profile to \"%s\".\n", path);
+    }
+    else
+    {
+        for (int i = 0; i < count; i++)
+            fprintf(file, "script;line %d;%s %zu\n", sorted[i].line, kindName(sorted[i].kind), sorted[i].bytes);
+        fclose(file);
+    }
+
+    fprintf(stderr, "== allocation sites ==\n");
+    fprintf(stderr, "%12s %12s %8s  %s\n", "bytes", "count", "line", "kind");
+    for (int i = 0; i < count && i < PROFILE_TOP_SITES; i++)
+    {
+        fprintf(stderr, "%12zu %12ld %8d  %s\n", sorted[i].bytes, sorted[i].count, sorted[i].line,
+                kindName(sorted[i].kind));
+    }
+
+    free(sorted);
+}
+
+void freeAllocationProfile()
+{
+    free(vm.allocationProfile.sites);
+    vm.allocationProfile = (AllocationProfile){0, 0, NULL, NULL};
+}
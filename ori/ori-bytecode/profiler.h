@@ -0,0 +1,43 @@
+#ifndef ori_profiler_h
+#define ori_profiler_h
+
+#include "common.h"
+#include "memory.h"
+#include "object.h"
+
+// Allocation-site profiler (ori --alloc-profile=path)
+// Every object allocated and every array or table grown while a chunk runs is counted against the source line
+// of the instruction that did it, and against what was allocated (the object's type, or the memory category)
+// Allocations made while compiling or by the collector aren't counted
+
+// What an allocation was for: an ObjType, or PROFILE_CATEGORY_KIND(category) for memory that isn't an object
+#define PROFILE_CATEGORY_KIND(category) (OBJ_TYPE_COUNT + (int)(category))
+#define PROFILE_KIND_COUNT (OBJ_TYPE_COUNT + MEM_CATEGORY_COUNT)
+
+typedef struct
+{
+    int line;
+    int kind;
+    long count;
+    size_t bytes;
+} AllocationSite;
+
+// Sites by line and kind, in a hash table (open addressing, line 0 marks an empty slot)
+// Grown with calloc (and its sites re-inserted) rather than through reallocate, it isn't part of the heap it measures
+typedef struct
+{
+    int count;
+    int capacity;
+    AllocationSite* sites;
+    // Site of the last allocation, most allocations come in runs from the same one
+    AllocationSite* last;
+} AllocationProfile;
+
+// Count an allocation of the given kind and size against the line that's running (if any)
+void profileAllocation(int kind, size_t size);
+// Write the sites to the path as collapsed stacks (what flamegraph tools read), weighted by bytes,
+// and print the sites that allocated the most to stderr
+void writeAllocationProfile(const char* path);
+void freeAllocationProfile();
+
+#endif
@@ -1,9 +1,28 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "common.h"
+#include "memory.h"
 #include "scanner.h"
 
+// Use SIMD to look at a whole block of characters at once when skipping over
+// whitespace, comments and string bodies (which make up most of large sources)
+// SSE2 (16 byte blocks) is on by default on x86-64
+// 32 byte blocks with AVX2 are compiled in as well, and used when the CPU running the scanner has it
+#if defined(__SSE2__)
+#include <immintrin.h>
+#define SCAN_BLOCKS
+#if defined(__AVX2__)
+#define AVX2_TARGET
+#elif defined(__GNUC__)
+#define AVX2_TARGET __attribute__((target("avx2")))
+#endif
+#endif
+
+// Characters checked one at a time before looking at blocks
+#define SCAN_SHORT_RUN 8
+
 typedef struct
 {
     // Pointer to the begining of the current lexeme being scanned
@@ -11,17 +30,37 @@ typedef struct
     // Pointer to the current character being looked at
     const char* current;
     int line;
+    // Number of unclosed { for each string interpolation currently being scanned
+    // This is used to tell apart the } that ends an interpolation from any other }
+    int braces[MAX_INTERPOLATION_NESTING];
+    // How many string interpolations are currently open
+    int interpolationDepth;
 } Scanner;
 
 // Like for VM, keep a global instance so we don't have to pass it around
 // TODO: To allow for embedding, make everything pass around scanner
 Scanner scanner;
 
-void initScanner(const char* source)
+static void initKeywords();
+
+#ifdef AVX2_TARGET
+// Whether the CPU supports AVX2, checked when the scanner is first initialized
+static bool hasAvx2;
+#endif
+
+void initScanner(const char* source, int line)
 {
     scanner.start = source;
     scanner.current = source;
-    scanner.line = 1;
+    scanner.line = line;
+    scanner.interpolationDepth = 0;
+    initKeywords();
+#if defined(__AVX2__)
+    hasAvx2 = true;
+#elif defined(AVX2_TARGET)
+    __builtin_cpu_init();
+    hasAvx2 = __builtin_cpu_supports("avx2");
+#endif
 }
 
 static bool isAtEnd()
@@ -30,16 +69,45 @@ static bool isAtEnd()
     return *scanner.current == '\0';
 }
 
+// Character classes, looked up in a table rather than with range checks
+#define CHAR_DIGIT 0x1
+#define CHAR_ALPHA 0x2
+
+static const uint8_t charClasses[256] = {
+    ['0'] = CHAR_DIGIT, ['1'] = CHAR_DIGIT, ['2'] = CHAR_DIGIT, ['3'] = CHAR_DIGIT, ['4'] = CHAR_DIGIT,
+    ['5'] = CHAR_DIGIT, ['6'] = CHAR_DIGIT, ['7'] = CHAR_DIGIT, ['8'] = CHAR_DIGIT, ['9'] = CHAR_DIGIT,
+
+    ['a'] = CHAR_ALPHA, ['b'] = CHAR_ALPHA, ['c'] = CHAR_ALPHA, ['d'] = CHAR_ALPHA, ['e'] = CHAR_ALPHA,
+    ['f'] = CHAR_ALPHA, ['g'] = CHAR_ALPHA, ['h'] = CHAR_ALPHA, ['i'] = CHAR_ALPHA, ['j'] = CHAR_ALPHA,
+    ['k'] = CHAR_ALPHA, ['l'] = CHAR_ALPHA, ['m'] = CHAR_ALPHA, ['n'] = CHAR_ALPHA, ['o'] = CHAR_ALPHA,
+    ['p'] = CHAR_ALPHA, ['q'] = CHAR_ALPHA, ['r'] = CHAR_ALPHA, ['s'] = CHAR_ALPHA, ['t'] = CHAR_ALPHA,
+    ['u'] = CHAR_ALPHA, ['v'] = CHAR_ALPHA, ['w'] = CHAR_ALPHA, ['x'] = CHAR_ALPHA, ['y'] = CHAR_ALPHA,
+    ['z'] = CHAR_ALPHA,
+
+    ['A'] = CHAR_ALPHA, ['B'] = CHAR_ALPHA, ['C'] = CHAR_ALPHA, ['D'] = CHAR_ALPHA, ['E'] = CHAR_ALPHA,
+    ['F'] = CHAR_ALPHA, ['G'] = CHAR_ALPHA, ['H'] = CHAR_ALPHA, ['I'] = CHAR_ALPHA, ['J'] = CHAR_ALPHA,
+    ['K'] = CHAR_ALPHA, ['L'] = CHAR_ALPHA, ['M'] = CHAR_ALPHA, ['N'] = CHAR_ALPHA, ['O'] = CHAR_ALPHA,
+    ['P'] = CHAR_ALPHA, ['Q'] = CHAR_ALPHA, ['R'] = CHAR_ALPHA, ['S'] = CHAR_ALPHA, ['T'] = CHAR_ALPHA,
+    ['U'] = CHAR_ALPHA, ['V'] = CHAR_ALPHA, ['W'] = CHAR_ALPHA, ['X'] = CHAR_ALPHA, ['Y'] = CHAR_ALPHA,
+    ['Z'] = CHAR_ALPHA,
+
+    ['_'] = CHAR_ALPHA,
+};
+
 static bool isDigit(char c)
 {
-    return c >= '0' && c <= '9';
+    return charClasses[(uint8_t)c] & CHAR_DIGIT;
 }
 
 static bool isAlpha(char c)
 {
-    return (c >= 'a' && c <= 'z') ||
-           (c >= 'A' && c <= 'Z') ||
-           (c == '_');
+    return charClasses[(uint8_t)c] & CHAR_ALPHA;
+}
+
+// Whether the character can appear in an identifier (after its first character)
+static bool isAlphaNumeric(char c)
+{
+    return charClasses[(uint8_t)c] & (CHAR_ALPHA | CHAR_DIGIT);
 }
 
 // Advance scanner to next character
@@ -83,6 +151,7 @@ static Token makeToken(TokenType type)
     token.start = scanner.start;
     token.length = (int)(scanner.current - scanner.start);
     token.line = scanner.line;
+    token.number = 0;
 
     return token;
 }
@@ -95,10 +164,134 @@ static Token errorToken(const char* message)
     token.start = message;
     token.length = (int)strlen(message);
     token.line = scanner.line;
+    token.number = 0;
 
     return token;
 }
 
+#ifdef SCAN_BLOCKS
+// Bitmask with one bit for each character of the aligned 16 byte block that is equal to any of a, b, or c
+static inline uint32_t matchBlock16(const char* block, char a, char b, char c)
+{
+    __m128i chars = _mm_load_si128((const __m128i*)block);
+    __m128i matches = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(chars, _mm_set1_epi8(a)), _mm_cmpeq_epi8(chars, _mm_set1_epi8(b))),
+        _mm_cmpeq_epi8(chars, _mm_set1_epi8(c)));
+    return (uint32_t)_mm_movemask_epi8(matches);
+}
+
+// Only ever load aligned blocks: they can't cross a page boundary,
+// so reading past the null terminator (but within its block) is always safe
+static const char* findAny16(const char* p, char a, char b, char c)
+{
+    uintptr_t misalignment = (uintptr_t)p & 15;
+    const char* block = p - misalignment;
+    uint32_t mask = (matchBlock16(block, a, b, c) | matchBlock16(block, '\0', '\0', '\0')) & (0xFFFFu << misalignment);
+    while (mask == 0)
+    {
+        block += 16;
+        mask = matchBlock16(block, a, b, c) | matchBlock16(block, '\0', '\0', '\0');
+    }
+    return block + __builtin_ctz(mask);
+}
+
+static const char* skipBlanks16(const char* p)
+{
+    uintptr_t misalignment = (uintptr_t)p & 15;
+    const char* block = p - misalignment;
+    uint32_t mask = ~matchBlock16(block, ' ', '\t', '\r') & (0xFFFFu << misalignment);
+    while (mask == 0)
+    {
+        block += 16;
+        mask = ~matchBlock16(block, ' ', '\t', '\r') & 0xFFFFu;
+    }
+    return block + __builtin_ctz(mask);
+}
+#endif
+
+#ifdef AVX2_TARGET
+// Same as the 16 byte versions, with 32 byte blocks
+AVX2_TARGET static inline uint32_t matchBlock32(const char* block, char a, char b, char c)
+{
+    __m256i chars = _mm256_load_si256((const __m256i*)block);
+    __m256i matches = _mm256_or_si256(
+        _mm256_or_si256(_mm256_cmpeq_epi8(chars, _mm256_set1_epi8(a)), _mm256_cmpeq_epi8(chars, _mm256_set1_epi8(b))),
+        _mm256_cmpeq_epi8(chars, _mm256_set1_epi8(c)));
+    return (uint32_t)_mm256_movemask_epi8(matches);
+}
+
+AVX2_TARGET static const char* findAny32(const char* p, char a, char b, char c)
+{
+    uintptr_t misalignment = (uintptr_t)p & 31;
+    const char* block = p - misalignment;
+    uint32_t mask = (matchBlock32(block, a, b, c) | matchBlock32(block, '\0', '\0', '\0')) & (0xFFFFFFFFu << misalignment);
+    while (mask == 0)
+    {
+        block += 32;
+        mask = matchBlock32(block, a, b, c) | matchBlock32(block, '\0', '\0', '\0');
+    }
+    return block + __builtin_ctz(mask);
+}
+
+AVX2_TARGET static const char* skipBlanks32(const char* p)
+{
+    uintptr_t misalignment = (uintptr_t)p & 31;
+    const char* block = p - misalignment;
+    uint32_t mask = ~matchBlock32(block, ' ', '\t', '\r') & (0xFFFFFFFFu << misalignment);
+    while (mask == 0)
+    {
+        block += 32;
+        mask = ~matchBlock32(block, ' ', '\t', '\r');
+    }
+    return block + __builtin_ctz(mask);
+}
+#endif
+
+// Find the first character at or after p that is either a, b, c, or the null terminator
+static const char* findAny(const char* p, char a, char b, char c)
+{
+#ifdef SCAN_BLOCKS
+    // Most runs are short (short strings, spaces between tokens), which take less time to check one character
+    // at a time than to set up a block, so only the rest of longer runs is looked at in blocks
+    for (const char* end = p + SCAN_SHORT_RUN; p < end; p++)
+    {
+        if (*p == a || *p == b || *p == c || *p == '\0')
+            return p;
+    }
+#ifdef AVX2_TARGET
+    if (hasAvx2)
+        return findAny32(p, a, b, c);
+#endif
+    return findAny16(p, a, b, c);
+#else
+    while (*p != a && *p != b && *p != c && *p != '\0')
+        p++;
+    return p;
+#endif
+}
+
+// Find the first character at or after p that isn't a space, tab or carriage return
+// Newlines are not skipped so that the caller can keep count of lines
+static const char* skipBlanks(const char* p)
+{
+#ifdef SCAN_BLOCKS
+    for (const char* end = p + SCAN_SHORT_RUN; p < end; p++)
+    {
+        if (*p != ' ' && *p != '\t' && *p != '\r')
+            return p;
+    }
+#ifdef AVX2_TARGET
+    if (hasAvx2)
+        return skipBlanks32(p);
+#endif
+    return skipBlanks16(p);
+#else
+    while (*p == ' ' || *p == '\t' || *p == '\r')
+        p++;
+    return p;
+#endif
+}
+
 // Skip all whitespaces and comments until it encounters a "meaningful" character
 static void skipWhitespaceAndComments()
 {
@@ -110,7 +303,7 @@ static void skipWhitespaceAndComments()
             case ' ':
             case '\r':
             case '\t':
-                advance();
+                scanner.current = skipBlanks(scanner.current);
                 break;
 
             // Bump line number if newline
@@ -124,8 +317,7 @@ static void skipWhitespaceAndComments()
                 if (peekNext() == '/')
                 {
                     // Comment goes until the end of the line
-                    while (peek() != '\n' && !isAtEnd())
-                        advance();
+                    scanner.current = findAny(scanner.current, '\n', '\n', '\n');
                 }
                 // Don't want to consume the / if the next character wasn't another /
                 else
@@ -142,79 +334,69 @@ static void skipWhitespaceAndComments()
     }
 }
 
-// Check if the next few characters match the given "rest" string
-// Returns the given token type if true, otherwise returns identifier
-static TokenType checkKeyword(int start, int length, const char* rest, TokenType type)
+typedef struct
+{
+    const char* name;
+    int length;
+    TokenType type;
+} Keyword;
+
+static const Keyword keywordList[] = {
+    {"and", 3, TOKEN_AND},
+    {"class", 5, TOKEN_CLASS},
+    {"else", 4, TOKEN_ELSE},
+    {"false", 5, TOKEN_FALSE},
+    {"for", 3, TOKEN_FOR},
+    {"function", 8, TOKEN_FUNCTION},
+    {"if", 2, TOKEN_IF},
+    {"let", 3, TOKEN_LET},
+    {"null", 4, TOKEN_NULL},
+    {"or", 2, TOKEN_OR},
+    {"print", 5, TOKEN_PRINT},
+    {"return", 6, TOKEN_RETURN},
+    {"super", 5, TOKEN_SUPER},
+    {"this", 4, TOKEN_THIS},
+    {"true", 4, TOKEN_TRUE},
+    {"while", 5, TOKEN_WHILE},
+};
+
+// Number of slots in the keyword hash table (must be a power of 2)
+#define KEYWORD_SLOTS 32
+
+// Perfect hash of the keywords: every keyword lands in its own slot
+// Only valid for lexemes of at least 2 characters, which all keywords are
+// NOTE: The multipliers were found by brute force, they need to be searched again when adding a keyword
+static int keywordHash(const char* start, int length)
 {
-    if (scanner.current - scanner.start == start + length && memcmp(scanner.start + start, rest, length) == 0)
+    return ((uint8_t)start[0] * 4 + (uint8_t)start[1] * 17 + length) & (KEYWORD_SLOTS - 1);
+}
+
+// Keywords laid out by their hash, filled in when the scanner is first initialized
+static Keyword keywords[KEYWORD_SLOTS];
+
+static void initKeywords()
+{
+    if (keywords[keywordHash("and", 3)].name != NULL)
+        return;
+
+    for (size_t i = 0; i < sizeof(keywordList) / sizeof(keywordList[0]); i++)
     {
-        return type;
+        const Keyword* keyword = &keywordList[i];
+        keywords[keywordHash(keyword->name, keyword->length)] = *keyword;
     }
-    return TOKEN_IDENTIFIER;
 }
 
-// Scan the next characters and determines the type of the token (identifier, keyword, etc.)
+// Determines whether the current lexeme is a keyword or an identifier
 static TokenType getIdentifierType()
 {
-    // Finite state machine to try and match the keywords
-    switch (scanner.start[0])
-    {
-        case 'a':
-            return checkKeyword(1, 2, "nd", TOKEN_AND);
-        case 'c':
-            return checkKeyword(1, 4, "lass", TOKEN_CLASS);
-        case 'e':
-            return checkKeyword(1, 3, "lse", TOKEN_ELSE);
-        case 'f':
-        {
-            // Check that there is a second letter after f
-            if (scanner.current - scanner.start > 1)
-            {
-                switch (scanner.start[1])
-                {
-                    case 'a':
-                        return checkKeyword(2, 3, "lse", TOKEN_FALSE);
-                    case 'o':
-                        return checkKeyword(2, 1, "r", TOKEN_FOR);
-                    case 'u':
-                        return checkKeyword(2, 6, "nction", TOKEN_FUNCTION);
-                }
-            }
-            break;
-        }
-        case 'i':
-            return checkKeyword(1, 1, "f", TOKEN_IF);
-        case 'l':
-            return checkKeyword(1, 2, "et", TOKEN_LET);
-        case 'n':
-            return checkKeyword(1, 3, "ull", TOKEN_NULL);
-        case 'o':
-            return checkKeyword(1, 1, "r", TOKEN_OR);
-        case 'p':
-            return checkKeyword(1, 4, "rint", TOKEN_PRINT);
-        case 'r':
-            return checkKeyword(1, 5, "eturn", TOKEN_RETURN);
-        case 's':
-            return checkKeyword(1, 4, "uper", TOKEN_SUPER);
-        case 't':
-        {
-            // Check that there is a second letter after t
-            if (scanner.current - scanner.start > 1)
-            {
-                switch (scanner.start[1])
-                {
-                    case 'h':
-                        return checkKeyword(2, 2, "is", TOKEN_THIS);
-                    case 'r':
-                        return checkKeyword(2, 2, "ue", TOKEN_TRUE);
-                }
-            }
-            break;
-        }
+    int length = (int)(scanner.current - scanner.start);
+    if (length < 2)
+        return TOKEN_IDENTIFIER;
 
-        case 'w':
-            return checkKeyword(1, 4, "hile", TOKEN_WHILE);
-    }
+    // Only one keyword can have this hash, so a single comparison is enough
+    const Keyword* keyword = &keywords[keywordHash(scanner.start, length)];
+    if (keyword->length == length && memcmp(scanner.start, keyword->name, length) == 0)
+        return keyword->type;
 
     return TOKEN_IDENTIFIER;
 }
@@ -222,16 +404,93 @@ static TokenType getIdentifierType()
 static Token readIdentifier()
 {
     // Identifiers can be alphanumeric and _
-    while (isAlpha(peek()) || isDigit(peek()))
+    while (isAlphaNumeric(peek()))
         advance();
 
     return makeToken(getIdentifierType());
 }
 
+// Powers of ten that are exactly representable as doubles
+static const double exactPowersOfTen[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+// Largest integer up to which every integer is exactly representable as a double
+#define MAX_EXACT_INTEGER (1ull << 53)
+// A uint64_t can hold any 19 digit number
+#define MAX_MANTISSA_DIGITS 19
+
+// Digits of a number literal read so far, as an integer mantissa and a power of ten exponent
+// (the value of the literal is mantissa * 10^exponent)
+typedef struct
+{
+    uint64_t mantissa;
+    int digits;
+    int exponent;
+    // Whether a non-zero digit didn't fit in the mantissa
+    bool truncated;
+} NumberDigits;
+
+static void addDigit(NumberDigits* number, char c, bool inFraction)
+{
+    int digit = c - '0';
+    if (number->digits < MAX_MANTISSA_DIGITS)
+    {
+        number->mantissa = number->mantissa * 10 + digit;
+        // Leading zeros don't take up any room in the mantissa
+        if (number->mantissa != 0)
+            number->digits++;
+        if (inFraction)
+            number->exponent--;
+    }
+    else
+    {
+        // No more room, drop the digit but keep track of its magnitude
+        if (digit != 0)
+            number->truncated = true;
+        if (!inFraction)
+            number->exponent++;
+    }
+}
+
+// Value of the literal whose digits were read (and which spans the current lexeme)
+static double numberValue(NumberDigits* number)
+{
+    // Fast path (Clinger's): when both the mantissa and the power of ten are exact doubles,
+    // a single multiplication or division gives the correctly rounded result
+    if (!number->truncated && number->mantissa <= MAX_EXACT_INTEGER)
+    {
+        if (number->exponent == 0)
+            return (double)number->mantissa;
+        if (number->exponent < 0 && number->exponent >= -22)
+            return (double)number->mantissa / exactPowersOfTen[-number->exponent];
+        if (number->exponent > 0 && number->exponent <= 22)
+            return (double)number->mantissa * exactPowersOfTen[number->exponent];
+    }
+
+    // Slow path for long or very precise literals: let strtod do the correctly rounded conversion
+    // Copy the lexeme so strtod can't read past it (e.g. "1e5" is the number 1 followed by the identifier e5)
+    // NOTE: Literals always use a '.', which strtod only accepts in the "C" locale (the default, ori never changes it)
+    int length = (int)(scanner.current - scanner.start);
+    char buffer[64];
+    char* chars = length < (int)sizeof(buffer) ? buffer : (char*)malloc(length + 1);
+    memcpy(chars, scanner.start, length);
+    chars[length] = '\0';
+    double value = strtod(chars, NULL);
+    if (chars != buffer)
+        free(chars);
+    return value;
+}
+
+// Reads a number literal, working out its value as the digits go by (its first digit has already been consumed)
 static Token readNumber()
 {
+    NumberDigits number = {0, 0, 0, false};
+    addDigit(&number, scanner.current[-1], false);
+
     while (isDigit(peek()))
-        advance();
+        addDigit(&number, advance(), false);
 
     // Look for decimal part
     if (peek() == '.' && isDigit(peekNext()))
@@ -240,19 +499,39 @@ static Token readNumber()
         advance();
 
         while (isDigit(peek()))
-            advance();
+            addDigit(&number, advance(), true);
     }
 
-    return makeToken(TOKEN_NUMBER);
+    Token token = makeToken(TOKEN_NUMBER);
+    token.number = numberValue(&number);
+    return token;
 }
 
+// Reads a string segment, starting after its opening " or after the } closing an interpolation
 static Token readString()
 {
-    // TODO: String interpolation with ${}
-
     // Keep advancing until it finds a " or reaches the end
-    while (peek() != '"' && !isAtEnd())
+    for (;;)
     {
+        // Jump straight to the next character that needs attention
+        scanner.current = findAny(scanner.current, '"', '\n', '$');
+        if (peek() == '"' || isAtEnd())
+            break;
+
+        // Stop at the start of an interpolated expression,
+        // the rest of the string is read once its matching } is found
+        if (peek() == '$' && peekNext() == '{')
+        {
+            if (scanner.interpolationDepth == MAX_INTERPOLATION_NESTING)
+                return errorToken("Interpolation nested too deeply.");
+
+            // Consume the ${
+            advance();
+            advance();
+            scanner.braces[scanner.interpolationDepth++] = 0;
+            return makeToken(TOKEN_INTERPOLATION);
+        }
+
         // Supports multiline strings
         if (peek() == '\n')
             scanner.line++;
@@ -297,11 +576,42 @@ Token scanToken()
         case ')':
             return makeToken(TOKEN_RIGHT_PAREN);
         case '{':
+        {
+            if (scanner.interpolationDepth > 0)
+                scanner.braces[scanner.interpolationDepth - 1]++;
             return makeToken(TOKEN_LEFT_BRACE);
+        }
+        case '#':
+        {
+            if (!match('{'))
+                break;
+            // Closed by a plain }, so it counts like {
+            if (scanner.interpolationDepth > 0)
+                scanner.braces[scanner.interpolationDepth - 1]++;
+            return makeToken(TOKEN_HASH_LEFT_BRACE);
+        }
         case '}':
+        {
+            if (scanner.interpolationDepth > 0)
+            {
+                // This } closes the interpolated expression, go back to reading the string
+                if (scanner.braces[scanner.interpolationDepth - 1] == 0)
+                {
+                    scanner.interpolationDepth--;
+                    return readString();
+                }
+                scanner.braces[scanner.interpolationDepth - 1]--;
+            }
             return makeToken(TOKEN_RIGHT_BRACE);
+        }
+        case '[':
+            return makeToken(TOKEN_LEFT_BRACKET);
+        case ']':
+            return makeToken(TOKEN_RIGHT_BRACKET);
         case ';':
             return makeToken(TOKEN_SEMICOLON);
+        case ':':
+            return makeToken(TOKEN_COLON);
         case ',':
             return makeToken(TOKEN_COMMA);
         case '.':
@@ -342,3 +652,182 @@ Token scanToken()
 
     return errorToken("Unexpected character.");
 }
+
+void initTokenArray(TokenArray* tokens)
+{
+    tokens->count = 0;
+    tokens->capacity = 0;
+    tokens->types = NULL;
+    tokens->starts = NULL;
+    tokens->lengths = NULL;
+    tokens->lines = NULL;
+    tokens->errorCount = 0;
+    tokens->errorCapacity = 0;
+    tokens->errors = NULL;
+}
+
+void freeTokenArray(TokenArray* tokens)
+{
+    FREE_ARRAY(uint8_t, tokens->types, tokens->capacity, MEM_TOKENS);
+    FREE_ARRAY(size_t, tokens->starts, tokens->capacity, MEM_TOKENS);
+    FREE_ARRAY(uint32_t, tokens->lengths, tokens->capacity, MEM_TOKENS);
+    FREE_ARRAY(int, tokens->lines, tokens->capacity, MEM_TOKENS);
+    FREE_ARRAY(const char*, tokens->errors, tokens->errorCapacity, MEM_TOKENS);
+    initTokenArray(tokens);
+}
+
+// Append a token to the end of the token arrays
+static void writeToken(TokenArray* tokens, const char* source, Token token)
+{
+    if (tokens->capacity < tokens->count + 1)
+    {
+        int oldCapacity = tokens->capacity;
+        tokens->capacity = GROW_CAPACITY(oldCapacity);
+        tokens->types = GROW_ARRAY(tokens->types, uint8_t, oldCapacity, tokens->capacity, MEM_TOKENS);
+        tokens->starts = GROW_ARRAY(tokens->starts, size_t, oldCapacity, tokens->capacity, MEM_TOKENS);
+        tokens->lengths = GROW_ARRAY(tokens->lengths, uint32_t, oldCapacity, tokens->capacity, MEM_TOKENS);
+        tokens->lines = GROW_ARRAY(tokens->lines, int, oldCapacity, tokens->capacity, MEM_TOKENS);
+    }
+
+    size_t start;
+    if (token.type == TOKEN_ERROR)
+    {
+        // Error messages don't live in the source, keep them on the side
+        if (tokens->errorCapacity < tokens->errorCount + 1)
+        {
+            int oldCapacity = tokens->errorCapacity;
+            tokens->errorCapacity = GROW_CAPACITY(oldCapacity);
+            tokens->errors = GROW_ARRAY(tokens->errors, const char*, oldCapacity, tokens->errorCapacity, MEM_TOKENS);
+        }
+        tokens->errors[tokens->errorCount] = token.start;
+        start = (size_t)tokens->errorCount++;
+    }
+    else
+    {
+        start = (size_t)(token.start - source);
+    }
+
+    tokens->types[tokens->count] = (uint8_t)token.type;
+    tokens->starts[tokens->count] = start;
+    tokens->lengths[tokens->count] = (uint32_t)token.length;
+    tokens->lines[tokens->count] = token.line;
+    tokens->count++;
+}
+
+void scanTokens(const char* source, int line, TokenArray* tokens)
+{
+    initScanner(source, line);
+
+    for (;;)
+    {
+        Token token = scanToken();
+        writeToken(tokens, source, token);
+        if (token.type == TOKEN_EOF)
+            break;
+    }
+}
+
+Token getToken(TokenArray* tokens, const char* source, int index)
+{
+    // Keep returning the EOF token when reading past the end
+    if (index >= tokens->count)
+        index = tokens->count - 1;
+
+    Token token;
+    token.type = (TokenType)tokens->types[index];
+    token.length = (int)tokens->lengths[index];
+    token.line = tokens->lines[index];
+    if (token.type == TOKEN_ERROR)
+        token.start = tokens->errors[tokens->starts[index]];
+    else
+        token.start = source + tokens->starts[index];
+    token.number = 0;
+
+    // Values of numbers aren't kept in the arrays (it would take 8 more bytes for every token), the literal is read again
+    // (the scanner is done with the source by then, it's all been scanned into the arrays)
+    if (token.type == TOKEN_NUMBER)
+    {
+        scanner.start = token.start;
+        scanner.current = token.start + 1;
+        token.number = readNumber().number;
+    }
+
+    return token;
+}
+
+void initSourceProgress(SourceProgress* progress)
+{
+    progress->offset = 0;
+    progress->depth = 0;
+    progress->last = TOKEN_EOF;
+    progress->inString = false;
+    progress->interpolationDepth = 0;
+}
+
+// Remember where scanning stopped, the source may be moved before the next call
+static void saveProgress(const char* source, SourceProgress* progress)
+{
+    progress->offset = (size_t)(scanner.current - source);
+    progress->interpolationDepth = scanner.interpolationDepth;
+    memcpy(progress->braces, scanner.braces, sizeof(scanner.braces));
+}
+
+bool isSourceComplete(const char* source, SourceProgress* progress)
+{
+    initScanner(source + progress->offset, 1);
+    scanner.interpolationDepth = progress->interpolationDepth;
+    memcpy(scanner.braces, progress->braces, sizeof(scanner.braces));
+
+    // Carry on with the string the source ended in the middle of
+    if (progress->inString)
+    {
+        Token token = readString();
+        if (token.type == TOKEN_ERROR && isAtEnd())
+        {
+            saveProgress(source, progress);
+            return false;
+        }
+        progress->inString = false;
+        progress->last = token.type;
+        if (token.type == TOKEN_ERROR)
+            return true;
+    }
+
+    for (;;)
+    {
+        Token token = scanToken();
+        switch (token.type)
+        {
+            case TOKEN_LEFT_PAREN:
+            case TOKEN_LEFT_BRACE:
+            case TOKEN_HASH_LEFT_BRACE:
+            case TOKEN_LEFT_BRACKET:
+                progress->depth++;
+                break;
+            case TOKEN_RIGHT_PAREN:
+            case TOKEN_RIGHT_BRACE:
+            case TOKEN_RIGHT_BRACKET:
+                progress->depth--;
+                break;
+            case TOKEN_ERROR:
+                // A string that runs to the end may still be closed by more input,
+                // any other error is reported by the compiler right away
+                if (isAtEnd() && (scanner.start[0] == '"' || scanner.start[0] == '}'))
+                {
+                    progress->inString = true;
+                    saveProgress(source, progress);
+                    return false;
+                }
+                return true;
+            case TOKEN_EOF:
+                // Everything read so far is complete if it ends at the end of a declaration
+                // Declarations always end with a ; (a } only ever closes a map, which the next line can carry on from)
+                saveProgress(source, progress);
+                return progress->depth <= 0 && scanner.interpolationDepth == 0 &&
+                       (progress->last == TOKEN_EOF || progress->last == TOKEN_SEMICOLON);
+            default:
+                break;
+        }
+        progress->last = token.type;
+    }
+}
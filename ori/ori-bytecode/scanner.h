@@ -1,6 +1,11 @@
 #ifndef ori_scanner_h
 #define ori_scanner_h
 
+#include "common.h"
+
+// How many string interpolations can be nested inside of each other
+#define MAX_INTERPOLATION_NESTING 8
+
 typedef enum
 {
     // Single-character tokens
@@ -8,11 +13,14 @@ typedef enum
     TOKEN_RIGHT_PAREN,
     TOKEN_LEFT_BRACE,
     TOKEN_RIGHT_BRACE,
+    TOKEN_LEFT_BRACKET,
+    TOKEN_RIGHT_BRACKET,
     TOKEN_COMMA,
     TOKEN_DOT,
     TOKEN_MINUS,
     TOKEN_PLUS,
     TOKEN_SEMICOLON,
+    TOKEN_COLON,
     TOKEN_SLASH,
     TOKEN_STAR,
 
@@ -25,10 +33,14 @@ typedef enum
     TOKEN_GREATER_EQUAL,
     TOKEN_LESS,
     TOKEN_LESS_EQUAL,
+    // #{ starting a frozen map
+    TOKEN_HASH_LEFT_BRACE,
 
     // Literals
     TOKEN_IDENTIFIER,
     TOKEN_STRING,
+    // A string segment that ends with the ${ of an interpolated expression
+    TOKEN_INTERPOLATION,
     TOKEN_NUMBER,
 
     // Keywords
@@ -64,10 +76,63 @@ typedef struct
     int length;
     // Line at which the token occurs
     int line;
+    // Value of a number literal (worked out while scanning it)
+    double number;
 } Token;
 
-void initScanner(const char* source);
+// All of the tokens of a source, scanned ahead of parsing
+// Stored as one array per field (rather than an array of Token) to keep them compact
+typedef struct
+{
+    int count;
+    int capacity;
+    // TokenType of each token
+    uint8_t* types;
+    // Offset of each lexeme from the start of the source
+    // (or, for error tokens, the index of their message in errors)
+    // Sources can be bigger than 4GB (mapped files), so offsets take a whole size_t
+    size_t* starts;
+    uint32_t* lengths;
+    int* lines;
+    // Messages of the error tokens
+    int errorCount;
+    int errorCapacity;
+    const char** errors;
+} TokenArray;
+
+// Where isSourceComplete got to in a source that's read in a piece at a time,
+// so that each call only scans what was added since the last one
+typedef struct
+{
+    // Offset from the start of the source where the last call stopped
+    size_t offset;
+    // Unclosed (, { and [
+    int depth;
+    // Last token read (TOKEN_EOF before the first one)
+    TokenType last;
+    // Whether the source read so far ends inside of a string
+    bool inString;
+    // Open string interpolations, as the scanner keeps track of them
+    int braces[MAX_INTERPOLATION_NESTING];
+    int interpolationDepth;
+} SourceProgress;
+
+// Starts scanning the given source, whose first line is the given line
+void initScanner(const char* source, int line);
 // Scans one token
 Token scanToken();
+// Start over for a new source
+void initSourceProgress(SourceProgress* progress);
+// Whether or not the given source could be compiled as is,
+// false when it ends in the middle of a declaration (so more input is needed)
+// Only the part of the source after progress->offset is scanned, what comes before it must be unchanged
+bool isSourceComplete(const char* source, SourceProgress* progress);
+
+void initTokenArray(TokenArray* tokens);
+void freeTokenArray(TokenArray* tokens);
+// Scans the entire source into the given token array, ending with a TOKEN_EOF
+void scanTokens(const char* source, int line, TokenArray* tokens);
+// Rebuilds the token at the given index of the array (returns the TOKEN_EOF when past the end)
+Token getToken(TokenArray* tokens, const char* source, int index);
 
 #endif
@@ -1,135 +1,442 @@
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "memory.h"
 #include "object.h"
 #include "table.h"
 #include "value.h"
 
+// Compare 16 control bytes at once with SSE2 (on by default on x86-64), otherwise one at a time
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define TABLE_SIMD
+#endif
+
+// Top 7 bits of the hash, stored in the control byte of the key's slot
+// (the low bits already decide which group the key starts probing at)
+#define HASH_TAG(hash) ((uint8_t)((hash) >> 25))
+
 void initTable(Table* table)
 {
     table->count = 0;
     table->capacity = 0;
+    table->control = NULL;
     table->entries = NULL;
+    table->oldCapacity = 0;
+    table->oldControl = NULL;
+    table->oldEntries = NULL;
+    table->migrated = 0;
+    table->isKeyed = false;
+#ifdef DEBUG_TABLE_STATS
+    memset(&table->stats, 0, sizeof(table->stats));
+#endif
+}
+
+#ifdef DEBUG_TABLE_STATS
+// Count a search for a key that looked at the given number of groups
+static void recordLookup(Table* table, bool found, int probed)
+{
+    table->stats.lookups++;
+    if (found)
+        table->stats.hits++;
+    else
+        table->stats.misses++;
+
+    // Bucket is the highest set bit of probed, so 1 -> 0, 2-3 -> 1, 4-7 -> 2...
+    int bucket = 31 - __builtin_clz((uint32_t)probed);
+    if (bucket >= TABLE_PROBE_BUCKETS)
+        bucket = TABLE_PROBE_BUCKETS - 1;
+    table->stats.probes[bucket]++;
 }
 
+// Seconds from a monotonic clock, for timing resizes
+static double now()
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (double)time.tv_sec + (double)time.tv_nsec * 1e-9;
+}
+#else
+#define recordLookup(table, found, probed) ((void)0)
+#endif
+
+// Size of the single allocation holding a table's entries followed by its control bytes
+#define TABLE_SIZE(capacity) ((sizeof(Entry) + 1) * (size_t)(capacity))
+
 void freeTable(Table* table)
 {
-    FREE_ARRAY(Entry, table->entries, table->capacity);
+    reallocate(table->entries, TABLE_SIZE(table->capacity), 0, MEM_TABLES);
+    reallocate(table->oldEntries, TABLE_SIZE(table->oldCapacity), 0, MEM_TABLES);
     initTable(table);
 }
 
-// Find a "position/bucket" for the given key
-// This can be used both for finding position to place a new entry in
-// Or to find a pre-existing entry by key
-static Entry* findEntry(Entry* entries, int capacity, ObjString* key)
+// Bitmask of the slots of the group (starting at control) whose control byte is equal to byte
+static inline uint32_t matchGroup(const uint8_t* control, uint8_t byte)
+{
+#ifdef TABLE_SIMD
+    __m128i group = _mm_loadu_si128((const __m128i*)control);
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8((char)byte)));
+#else
+    uint32_t mask = 0;
+    for (int i = 0; i < TABLE_GROUP_SIZE; i++)
+        mask |= (uint32_t)(control[i] == byte) << i;
+    return mask;
+#endif
+}
+
+// Bitmask of the slots of the group (starting at control) that are empty or deleted
+static inline uint32_t matchFree(const uint8_t* control)
+{
+#ifdef TABLE_SIMD
+    // Only empty and deleted control bytes have their high bit set
+    return (uint32_t)_mm_movemask_epi8(_mm_loadu_si128((const __m128i*)control));
+#else
+    uint32_t mask = 0;
+    for (int i = 0; i < TABLE_GROUP_SIZE; i++)
+        mask |= (uint32_t)(control[i] >> 7) << i;
+    return mask;
+#endif
+}
+
+// Groups are probed in the order g, g + 1, g + 3, g + 6... (adding 1, 2, 3... each time)
+// Since the number of groups is a power of 2, this visits every one of them
+// Capacities are always powers of 2, so masking is the same as % (without the division)
+#define FIRST_GROUP(hash, capacity) ((hash) & ((capacity) / TABLE_GROUP_SIZE - 1))
+#define NEXT_GROUP(group, step, capacity) (((group) + (step)) & ((capacity) / TABLE_GROUP_SIZE - 1))
+
+// Hash deciding where the key goes in the table
+static inline uint32_t slotHash(Table* table, ObjString* key)
 {
-    // Initial index where first expect the entry to be
-    uint32_t index = key->hash % capacity;
+    // The keyed hash is cached on the key like its own hash, so SipHash only runs once per key rather than per operation
+    return table->isKeyed ? stringKeyedHash(key) : key->hash;
+}
 
-    // Keep track of any tombstones found that could be used
-    Entry* tombstone = NULL;
+// Find the slot holding the given key (placed according to hash)
+// Returns -1 if the key isn't in the table, in which case freeSlot (unless NULL) is set to
+// the first empty or deleted slot where it can be placed and probed (unless NULL) to the number of groups looked at
+static inline int findSlot(uint8_t* control, Entry* entries, int capacity, ObjString* key, uint32_t hash,
+                           int* freeSlot, int* probed)
+{
+    uint8_t tag = HASH_TAG(hash);
+    uint32_t group = FIRST_GROUP(hash, capacity);
+    if (freeSlot != NULL)
+        *freeSlot = -1;
 
-    // Loop until it finds an empty bucket OR it finds one with the same key
-    // This will never be infinite because the entries array grows every time it's "close to being full"
-    for (;;)
+    for (uint32_t step = 1;; step++)
     {
-        Entry* entry = &entries[index];
+        if (probed != NULL)
+            *probed = step;
 
-        if (entry->key == NULL)
+        uint8_t* groupControl = control + group * TABLE_GROUP_SIZE;
+
+        // Only the slots whose control byte matches the hash's tag can hold the key
+        // Keys are always symbols (interned strings), so there's only ever one string object for given characters
+        // NOTE: Non-interned strings have to be compared by hash and then by characters instead (see valuesEqual)
+        for (uint32_t matches = matchGroup(groupControl, tag); matches != 0; matches &= matches - 1)
         {
-            if (IS_NULL(entry->value))
-            {
-                // Empty entry
-                // If found a tombstone on the way there, then might as well replace it
-                // Otherwise, use the newly found empty entry
-                return tombstone != NULL ? tombstone : entry;
-            }
-            else
-            {
-                // Found a tombstone
-                if (tombstone == NULL)
-                    tombstone = entry;
-            }
+            int slot = group * TABLE_GROUP_SIZE + __builtin_ctz(matches);
+            if (entries[slot].key == key)
+                return slot;
         }
-        // TODO: This uses string interning for ALL strings, which means a collection of all strings is kept track of by runtime
-        // This has pros and cons, some languages have a "symbol" type for interning and use "strings" for non-intern
-        // If you didn't use string interning, you'd compare hash codes of the two strings, and if they're the same you'd then compare characters
-        else if (entry->key == key)
+
+        // The key wasn't in this group, but it could be placed there if there is room
+        if (freeSlot != NULL && *freeSlot == -1)
         {
-            // Found the key
-            return entry;
+            uint32_t free = matchFree(groupControl);
+            if (free != 0)
+                *freeSlot = group * TABLE_GROUP_SIZE + __builtin_ctz(free);
         }
 
-        // If that was the wrong key, linearly search for them (next one)
-        index = (index + 1) % capacity;
+        // An empty slot ends the search, the key would have been placed there (or before) if it was in the table
+        // Deleted slots don't, since the key could have been placed after them before they were deleted
+        if (matchGroup(groupControl, CONTROL_EMPTY) != 0)
+            return -1;
+
+        group = NEXT_GROUP(group, step, capacity);
     }
 }
 
+// Find the first empty or deleted slot where a key with the given hash can be placed
+// (for keys that are known not to be in the table already)
+// This will never be infinite because the table grows every time it's "close to being full"
+static int findFreeSlot(uint8_t* control, int capacity, uint32_t hash)
+{
+    uint32_t group = FIRST_GROUP(hash, capacity);
+
+    for (uint32_t step = 1;; step++)
+    {
+        uint32_t free = matchFree(control + group * TABLE_GROUP_SIZE);
+        if (free != 0)
+            return group * TABLE_GROUP_SIZE + __builtin_ctz(free);
+
+        group = NEXT_GROUP(group, step, capacity);
+    }
+}
+
+// Move the entries of count slots of the old arrays (starting at table->migrated) to the new arrays
+// Since the position depends on the hash masked by the capacity and the capacity has changed,
+// each entry has to be placed again
+static void migrateSlots(Table* table, int count)
+{
+    int end = table->migrated + count;
+    if (end > table->oldCapacity)
+        end = table->oldCapacity;
+
+    for (int i = table->migrated; i < end; i++)
+    {
+        uint8_t control = table->oldControl[i];
+        if (control == CONTROL_EMPTY)
+            continue;
+        if (control == CONTROL_DELETED)
+        {
+            // Deleted slots aren't moved, so they no longer count
+            table->count--;
+            continue;
+        }
+
+        // Keys are never in both arrays, so there's no need to look for them before placing them
+        Entry* entry = &table->oldEntries[i];
+        int slot = findFreeSlot(table->control, table->capacity, slotHash(table, entry->key));
+        // A key deleted from the new arrays since they were made can have left a deleted slot there,
+        // which was already counted (and the old slot is counted too)
+        if (table->control[slot] == CONTROL_DELETED)
+            table->count--;
+        table->control[slot] = control;
+        table->entries[slot] = *entry;
+
+        // The old slot is marked deleted (not empty) so lookups in the old arrays still probe past it
+        table->oldControl[i] = CONTROL_DELETED;
+    }
+#ifdef DEBUG_TABLE_STATS
+    table->stats.migratedSlots += end - table->migrated;
+#endif
+    table->migrated = end;
+
+    if (table->migrated == table->oldCapacity)
+    {
+        // Everything has moved over, the old arrays can go
+        reallocate(table->oldEntries, TABLE_SIZE(table->oldCapacity), 0, MEM_TABLES);
+        table->oldCapacity = 0;
+        table->oldControl = NULL;
+        table->oldEntries = NULL;
+        table->migrated = 0;
+    }
+}
+
+// Move a few more slots over if the table is growing incrementally
+static inline void migrateStep(Table* table)
+{
+    if (table->oldEntries != NULL)
+        migrateSlots(table, TABLE_MIGRATE_SLOTS);
+}
+
 bool tableGet(Table* table, ObjString* key, Value* value)
 {
     if (table->count == 0)
         return false;
 
-    Entry* entry = findEntry(table->entries, table->capacity, key);
-    if (entry->key == NULL)
-        return false;
+    migrateStep(table);
 
-    *value = entry->value;
-    return true;
+    uint32_t hash = slotHash(table, key);
+    int probed;
+    int slot = findSlot(table->control, table->entries, table->capacity, key, hash, NULL, &probed);
+    if (slot != -1)
+    {
+        recordLookup(table, true, probed);
+        *value = table->entries[slot].value;
+        return true;
+    }
+
+    if (table->oldEntries != NULL)
+    {
+        int oldProbed;
+        slot = findSlot(table->oldControl, table->oldEntries, table->oldCapacity, key, hash, NULL, &oldProbed);
+        probed += oldProbed;
+        if (slot != -1)
+        {
+            recordLookup(table, true, probed);
+            *value = table->oldEntries[slot].value;
+            return true;
+        }
+    }
+
+    recordLookup(table, false, probed);
+    return false;
 }
 
-static void adjustCapacity(Table* table, int capacity)
+Value* tableFindValue(Table* table, ObjString* key)
 {
-    Entry* entries = ALLOCATE(Entry, capacity);
-    for (int i = 0; i < capacity; i++)
+    if (table->count == 0)
+        return NULL;
+
+    uint32_t hash = slotHash(table, key);
+    int slot = findSlot(table->control, table->entries, table->capacity, key, hash, NULL, NULL);
+    if (slot != -1)
+        return &table->entries[slot].value;
+
+    if (table->oldEntries != NULL)
     {
-        entries[i].key = NULL;
-        entries[i].value = NULL_VAL;
+        slot = findSlot(table->oldControl, table->oldEntries, table->oldCapacity, key, hash, NULL, NULL);
+        if (slot != -1)
+            return &table->oldEntries[slot].value;
     }
+    return NULL;
+}
+
+static void adjustCapacity(Table* table, int capacity)
+{
+#ifdef DEBUG_TABLE_STATS
+    double start = now();
+#endif
+
+    // A table only grows again once it's full again, by then the previous growth has long finished
+    // (each operation moves more slots than an insert fills) but finish it just in case
+    if (table->oldEntries != NULL)
+        migrateSlots(table, table->oldCapacity);
+
+    // Both arrays share one allocation
+    // (made before the table changes, an allocation that fails leaves it as it was)
+    Entry* entries = (Entry*)reallocate(NULL, 0, TABLE_SIZE(capacity), MEM_TABLES);
+
+    // Keep the current arrays around as the old ones and move their entries over to the new ones
+    table->oldCapacity = table->capacity;
+    table->oldControl = table->control;
+    table->oldEntries = table->entries;
+    table->migrated = 0;
 
-    // Since not copying over tombstones, the count might be different
+    table->entries = entries;
+    table->control = (uint8_t*)(table->entries + capacity);
+    table->capacity = capacity;
+    memset(table->control, CONTROL_EMPTY, capacity);
+
+    // Small tables are moved over all at once, it's quick enough
+    if (table->oldCapacity < TABLE_INCREMENTAL_CAPACITY)
+        migrateSlots(table, table->oldCapacity);
+
+#ifdef DEBUG_TABLE_STATS
+    table->stats.resizes++;
+    table->stats.resizeSeconds += now() - start;
+#endif
+}
+
+// Place every key again using the keyed hash (keeping the same capacity)
+static void makeKeyed(Table* table)
+{
+    // Everything has to move anyway, finish moving the old arrays over first so there's only one set to go through
+    if (table->oldEntries != NULL)
+        migrateSlots(table, table->oldCapacity);
+
+    int capacity = table->capacity;
+    uint8_t* control = table->control;
+    Entry* entries = table->entries;
+
+    table->entries = (Entry*)reallocate(NULL, 0, TABLE_SIZE(capacity), MEM_TABLES);
+    table->control = (uint8_t*)(table->entries + capacity);
+    memset(table->control, CONTROL_EMPTY, capacity);
+    table->isKeyed = true;
+#ifdef DEBUG_TABLE_STATS
+    table->stats.keyedRebuilds++;
+#endif
+
+    // Deleted slots are dropped along the way
     table->count = 0;
-    // Since just resized the array, need to re-calculate all of the entries' positions
-    // Because the position depends on hash % capacity and the capacity has just changed
-    for (int i = 0; i < table->capacity; i++)
+    for (int i = 0; i < capacity; i++)
     {
-        Entry* entry = &table->entries[i];
-        if (entry->key == NULL)
+        if (control[i] & CONTROL_EMPTY)
             continue;
 
-        Entry* dest = findEntry(entries, capacity, entry->key);
-        dest->key = entry->key;
-        dest->value = entry->value;
+        uint32_t hash = slotHash(table, entries[i].key);
+        int slot = findFreeSlot(table->control, capacity, hash);
+        table->control[slot] = HASH_TAG(hash);
+        table->entries[slot] = entries[i];
         table->count++;
     }
 
-    // Free the old array, just moved everythong over
-    FREE_ARRAY(Entry, table->entries, table->capacity);
-
-    table->entries = entries;
-    table->capacity = capacity;
+    reallocate(entries, TABLE_SIZE(capacity), 0, MEM_TABLES);
 }
 
 bool tableSet(Table* table, ObjString* key, Value value)
 {
     if (table->count + 1 > table->capacity * TABLE_MAX_LOAD)
     {
-        int capacity = GROW_CAPACITY(table->capacity);
+        // Start with a single group, then double it if more is needed
+        int capacity = table->capacity < TABLE_GROUP_SIZE ? TABLE_GROUP_SIZE : table->capacity * 2;
         adjustCapacity(table, capacity);
     }
+    else
+    {
+        migrateStep(table);
+    }
 
-    Entry* entry = findEntry(table->entries, table->capacity, key);
+    uint32_t hash = slotHash(table, key);
+    int freeSlot;
+    int probed;
+    int slot = findSlot(table->control, table->entries, table->capacity, key, hash, &freeSlot, &probed);
+    if (slot != -1)
+    {
+        recordLookup(table, true, probed);
+        table->entries[slot].value = value;
+        return false;
+    }
 
-    bool isNewKey = entry->key == NULL;
-    // Increase count only if created a new key
-    // (not from a tombstone since tombstones are already counted into count)
-    if (isNewKey && IS_NULL(entry->value))
+    // A key that hasn't been moved over yet is updated where it is
+    if (table->oldEntries != NULL)
+    {
+        int oldProbed;
+        slot = findSlot(table->oldControl, table->oldEntries, table->oldCapacity, key, hash, NULL, &oldProbed);
+        if (slot != -1)
+        {
+            recordLookup(table, true, probed + oldProbed);
+            table->oldEntries[slot].value = value;
+            return false;
+        }
+        recordLookup(table, false, probed + oldProbed);
+    }
+    else
+    {
+        recordLookup(table, false, probed);
+    }
+
+    slot = freeSlot;
+    // Increase count only if used an empty slot
+    // (not a deleted one since those are already counted into count)
+    if (table->control[slot] == CONTROL_EMPTY)
         table->count++;
 
-    entry->key = key;
-    entry->value = value;
-    return isNewKey;
+    table->control[slot] = HASH_TAG(hash);
+    table->entries[slot].key = key;
+    table->entries[slot].value = value;
+
+    // Too many keys share the same groups, switch over to a hash that can't be made to collide
+    // Only the new arrays are checked: the old ones are going away, and new keys are never placed there
+    if (probed > TABLE_MAX_PROBE_GROUPS && !table->isKeyed)
+        makeKeyed(table);
+    return true;
+}
+
+// Remove the entry in the given slot of the given arrays (either the table's current or old ones)
+static void deleteSlot(Table* table, uint8_t* control, Entry* entries, int slot)
+{
+    entries[slot].key = NULL;
+    entries[slot].value = NULL_VAL;
+
+    // Normally the slot is marked as deleted so that it doesn't break the probing sequence of other keys
+    // But if its group still has an empty slot, any search reaching that group stops there anyway,
+    // so it can just be made empty again
+    if (matchGroup(control + (slot - slot % TABLE_GROUP_SIZE), CONTROL_EMPTY) != 0)
+    {
+        control[slot] = CONTROL_EMPTY;
+        table->count--;
+        return;
+    }
+
+    // Deleted slots are still counted, they only stop counting once the table grows
+    control[slot] = CONTROL_DELETED;
+#ifdef DEBUG_TABLE_STATS
+    table->stats.tombstones++;
+#endif
 }
 
 bool tableDelete(Table* table, ObjString* key)
@@ -137,54 +444,330 @@ bool tableDelete(Table* table, ObjString* key)
     if (table->count == 0)
         return false;
 
+    migrateStep(table);
+
     // Find the entry
-    Entry* entry = findEntry(table->entries, table->capacity, key);
-    if (entry->key == NULL)
-        return false;
+    uint32_t hash = slotHash(table, key);
+    int probed;
+    int slot = findSlot(table->control, table->entries, table->capacity, key, hash, NULL, &probed);
+    if (slot != -1)
+    {
+        recordLookup(table, true, probed);
+        deleteSlot(table, table->control, table->entries, slot);
+        return true;
+    }
 
-    // Place a tombstone in the entry
-    // This is done to not break the collision chain
-    entry->key = NULL;
-    entry->value = BOOL_VAL(true);
+    if (table->oldEntries != NULL)
+    {
+        int oldProbed;
+        slot = findSlot(table->oldControl, table->oldEntries, table->oldCapacity, key, hash, NULL, &oldProbed);
+        probed += oldProbed;
+        if (slot != -1)
+        {
+            recordLookup(table, true, probed);
+            deleteSlot(table, table->oldControl, table->oldEntries, slot);
+            return true;
+        }
+    }
 
-    return true;
+    recordLookup(table, false, probed);
+    return false;
 }
 
 void tableAddAll(Table* from, Table* to)
 {
     for (int i = 0; i < from->capacity; i++)
     {
-        Entry* entry = &from->entries[i];
-        if (entry->key != NULL)
+        if (!(from->control[i] & CONTROL_EMPTY))
+        {
+            Entry* entry = &from->entries[i];
+            tableSet(to, entry->key, entry->value);
+        }
+    }
+
+    // Entries that haven't been moved over yet
+    for (int i = from->migrated; i < from->oldCapacity; i++)
+    {
+        if (!(from->oldControl[i] & CONTROL_EMPTY))
         {
+            Entry* entry = &from->oldEntries[i];
             tableSet(to, entry->key, entry->value);
         }
     }
 }
 
+// Find the key with the given characters and hash in the given arrays (placed according to slotHash)
+static ObjString* findString(uint8_t* control, Entry* entries, int capacity, const char* chars, int length,
+                             uint32_t hash, uint32_t slotHash, int* probed)
+{
+    uint8_t tag = HASH_TAG(slotHash);
+    uint32_t group = FIRST_GROUP(slotHash, capacity);
+
+    for (uint32_t step = 1;; step++)
+    {
+        *probed = step;
+        uint8_t* groupControl = control + group * TABLE_GROUP_SIZE;
+
+        for (uint32_t matches = matchGroup(groupControl, tag); matches != 0; matches &= matches - 1)
+        {
+            ObjString* key = entries[group * TABLE_GROUP_SIZE + __builtin_ctz(matches)].key;
+            if (key->length == length && key->hash == hash && memcmp(key->chars, chars, length) == 0)
+            {
+                // Found it
+                return key;
+            }
+        }
+
+        // Stop if we find an empty slot
+        if (matchGroup(groupControl, CONTROL_EMPTY) != 0)
+            return NULL;
+
+        group = NEXT_GROUP(group, step, capacity);
+    }
+}
+
 ObjString* tableFindString(Table* table, const char* chars, int length, uint32_t hash)
 {
     if (table->count == 0)
         return NULL;
 
-    uint32_t index = hash % table->capacity;
+    migrateStep(table);
 
-    for (;;)
+    uint32_t slotHash = table->isKeyed ? hashStringKeyed(chars, length) : hash;
+    int probed;
+    ObjString* key = findString(table->control, table->entries, table->capacity, chars, length, hash, slotHash, &probed);
+    if (key == NULL && table->oldEntries != NULL)
     {
-        Entry* entry = &table->entries[index];
+        int oldProbed;
+        key = findString(table->oldControl, table->oldEntries, table->oldCapacity, chars, length, hash, slotHash,
+                         &oldProbed);
+        probed += oldProbed;
+    }
 
-        if (entry->key == NULL)
-        {
-            // Stop if we find an empty non-tombstone entry
-            if (IS_NULL(entry->value))
-                return NULL;
-        }
-        else if (entry->key->length == length && entry->key->hash == hash && memcmp(entry->key->chars, chars, length) == 0)
+    recordLookup(table, key != NULL, probed);
+    return key;
+}
+
+// Trace the entries of the given arrays (either the table's current or old ones)
+static void traceEntries(uint8_t* control, Entry* entries, int capacity)
+{
+    for (int i = 0; i < capacity; i++)
+    {
+        if (control[i] & CONTROL_EMPTY)
+            continue;
+        // Keys are symbols, which are never moved (see copyLiteral)
+        traceObject((Obj*)entries[i].key);
+        traceValue(&entries[i].value);
+    }
+}
+
+void traceTable(Table* table)
+{
+    traceEntries(table->control, table->entries, table->capacity);
+    traceEntries(table->oldControl, table->oldEntries, table->oldCapacity);
+}
+
+void tableRemoveWhite(Table* table)
+{
+    for (int i = 0; i < table->capacity; i++)
+    {
+        if (!(table->control[i] & CONTROL_EMPTY) && !isMarked((Obj*)table->entries[i].key))
+            deleteSlot(table, table->control, table->entries, i);
+    }
+    for (int i = 0; i < table->oldCapacity; i++)
+    {
+        if (!(table->oldControl[i] & CONTROL_EMPTY) && !isMarked((Obj*)table->oldEntries[i].key))
+            deleteSlot(table, table->oldControl, table->oldEntries, i);
+    }
+}
+
+#define VALUE_TABLE_SIZE(capacity) ((sizeof(ValueEntry) + 1) * (size_t)(capacity))
+
+void initValueTable(ValueTable* table)
+{
+    table->count = 0;
+    table->capacity = 0;
+    table->control = NULL;
+    table->entries = NULL;
+    table->isKeyed = false;
+}
+
+void freeValueTable(ValueTable* table)
+{
+    reallocate(table->entries, VALUE_TABLE_SIZE(table->capacity), 0, MEM_TABLES);
+    initValueTable(table);
+}
+
+static inline bool keysEqual(Value a, Value b)
+{
+    // Numbers are compared right away, they are the keys of maps used as arrays
+    if (IS_NUMBER(a))
+        return IS_NUMBER(b) && AS_NUMBER(a) == AS_NUMBER(b);
+    return valuesEqual(a, b);
+}
+
+// Hash deciding where the key goes in a table that is (or isn't) keyed
+static inline uint32_t valueSlotHash(bool keyed, Value key)
+{
+    if (!keyed)
+        return hashValue(key);
+    if (IS_STRING(key))
+        return stringKeyedHash(AS_STRING(key));
+    if (IS_NUMBER(key))
+    {
+        // Number keys are picked by the script as easily as strings, their bits go through SipHash too
+        // (-0 and 0 are equal, so they need the same hash)
+        double number = AS_NUMBER(key) == 0 ? 0 : AS_NUMBER(key);
+        char bits[sizeof(number)];
+        memcpy(bits, &number, sizeof(bits));
+        return hashStringKeyed(bits, sizeof(bits));
+    }
+    // Maps are hashed by identities the script doesn't choose, and there are only 3 other keys
+    return hashValue(key);
+}
+
+// Find the slot holding the given key (with the given hash), or -1 if it isn't in the table
+// probed (unless NULL) is set to the number of groups looked at
+static inline int findValueSlot(ValueTable* table, Value key, uint32_t hash, int* probed)
+{
+    uint8_t tag = HASH_TAG(hash);
+    uint32_t group = FIRST_GROUP(hash, table->capacity);
+
+    for (uint32_t step = 1;; step++)
+    {
+        if (probed != NULL)
+            *probed = step;
+
+        uint8_t* groupControl = table->control + group * TABLE_GROUP_SIZE;
+
+        for (uint32_t matches = matchGroup(groupControl, tag); matches != 0; matches &= matches - 1)
         {
-            // Found it
-            return entry->key;
+            int slot = group * TABLE_GROUP_SIZE + __builtin_ctz(matches);
+            if (keysEqual(key, table->entries[slot].key))
+                return slot;
         }
 
-        index = (index + 1) % table->capacity;
+        // Nothing is ever deleted, so the first free slot is always empty and ends the search
+        if (matchGroup(groupControl, CONTROL_EMPTY) != 0)
+            return -1;
+
+        group = NEXT_GROUP(group, step, table->capacity);
+    }
+}
+
+bool valueTableGet(ValueTable* table, Value key, Value* value)
+{
+    if (table->count == 0)
+        return false;
+
+    int slot = findValueSlot(table, key, valueSlotHash(table->isKeyed, key), NULL);
+    if (slot == -1)
+        return false;
+
+    *value = table->entries[slot].value;
+    return true;
+}
+
+// Place every entry again in new arrays of the given capacity, using the keyed hash or not
+static void adjustValueCapacity(ValueTable* table, int capacity, bool keyed)
+{
+    ValueEntry* entries = (ValueEntry*)reallocate(NULL, 0, VALUE_TABLE_SIZE(capacity), MEM_TABLES);
+    uint8_t* control = (uint8_t*)(entries + capacity);
+    memset(control, CONTROL_EMPTY, capacity);
+
+    // Every entry has to be placed again since positions depend on the capacity
+    for (int i = 0; i < table->capacity; i++)
+    {
+        if (table->control[i] & CONTROL_EMPTY)
+            continue;
+
+        // The tag is taken from the new hash, which differs from the old one when switching to the keyed hash
+        uint32_t hash = valueSlotHash(keyed, table->entries[i].key);
+        int slot = findFreeSlot(control, capacity, hash);
+        control[slot] = HASH_TAG(hash);
+        entries[slot] = table->entries[i];
+    }
+
+    reallocate(table->entries, VALUE_TABLE_SIZE(table->capacity), 0, MEM_TABLES);
+    table->entries = entries;
+    table->control = control;
+    table->capacity = capacity;
+    table->isKeyed = keyed;
+}
+
+bool valueTableSet(ValueTable* table, Value key, Value value)
+{
+    if (table->count + 1 > table->capacity * TABLE_MAX_LOAD)
+    {
+        int capacity = table->capacity < TABLE_GROUP_SIZE ? TABLE_GROUP_SIZE : table->capacity * 2;
+        adjustValueCapacity(table, capacity, table->isKeyed);
     }
+
+    uint32_t hash = valueSlotHash(table->isKeyed, key);
+    int probed;
+    int slot = findValueSlot(table, key, hash, &probed);
+    if (slot != -1)
+    {
+        table->entries[slot].value = value;
+        return false;
+    }
+
+    slot = findFreeSlot(table->control, table->capacity, hash);
+    table->control[slot] = HASH_TAG(hash);
+    table->entries[slot].key = key;
+    table->entries[slot].value = value;
+    table->count++;
+
+    // Same as Table: once keys pile up in the same groups, the table switches over to the keyed hash for good
+    if (probed > TABLE_MAX_PROBE_GROUPS && !table->isKeyed)
+        adjustValueCapacity(table, table->capacity, true);
+    return true;
+}
+
+void traceValueTable(ValueTable* table)
+{
+    // Keys keep their slots when they move, strings are hashed by their characters and other objects by identity
+    for (int i = 0; i < table->capacity; i++)
+    {
+        if (table->control[i] & CONTROL_EMPTY)
+            continue;
+        traceValue(&table->entries[i].key);
+        traceValue(&table->entries[i].value);
+    }
+}
+
+#ifdef DEBUG_TABLE_STATS
+void printTableStats(const char* name, Table* table)
+{
+    // Deleted slots currently in the table (as opposed to how many were ever made)
+    int deleted = 0;
+    for (int i = 0; i < table->capacity; i++)
+        deleted += table->control[i] == CONTROL_DELETED;
+    for (int i = table->migrated; i < table->oldCapacity; i++)
+        deleted += table->oldControl[i] == CONTROL_DELETED;
+
+    TableStats* stats = &table->stats;
+    fprintf(stderr, "== table %s ==\n", name);
+    fprintf(stderr, "entries %d, deleted %d, capacity %d (load %.3f of max %.3f)%s\n", table->count - deleted,
+            deleted, table->capacity, table->capacity == 0 ? 0.0 : (double)table->count / table->capacity,
+            TABLE_MAX_LOAD, table->isKeyed ? ", keyed" : "");
+    fprintf(stderr, "lookups %ld: hits %ld, misses %ld\n", stats->lookups, stats->hits, stats->misses);
+
+    fprintf(stderr, "groups probed:");
+    for (int i = 0; i < TABLE_PROBE_BUCKETS; i++)
+    {
+        int low = 1 << i;
+        if (i == TABLE_PROBE_BUCKETS - 1)
+            fprintf(stderr, " %d+: %ld", low, stats->probes[i]);
+        else if (low == 1)
+            fprintf(stderr, " 1: %ld", stats->probes[i]);
+        else
+            fprintf(stderr, " %d-%d: %ld", low, 2 * low - 1, stats->probes[i]);
+    }
+    fprintf(stderr, "\n");
+
+    fprintf(stderr, "tombstones made %ld, resizes %ld (%.3f ms), slots migrated %ld, keyed rebuilds %ld\n",
+            stats->tombstones, stats->resizes, stats->resizeSeconds * 1000, stats->migratedSlots,
+            stats->keyedRebuilds);
 }
+#endif
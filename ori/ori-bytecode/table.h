@@ -4,22 +4,87 @@
 #include "common.h"
 #include "value.h"
 
-// Grow whenever the table's array is at least 75% full
-// NOTE: 75% is a totally arbitrary number, in reality needs to be carefully benchmarked and picked
-#define TABLE_MAX_LOAD 0.75
+// Grow whenever at least 7/8 of the table's slots are used (including deleted ones)
+// Probing looks at a whole group of slots at once, so the table can get fuller than with one slot at a time
+#define TABLE_MAX_LOAD 0.875
+
+// Number of slots whose control bytes are looked at together (one SSE2 register)
+// Capacities are always a multiple of this
+#define TABLE_GROUP_SIZE 16
+
+// Tables with at least this many slots grow incrementally: the old arrays are kept alongside the new ones
+// and their entries are moved over a few at a time (TABLE_MIGRATE_SLOTS per operation)
+// rather than all at once, so a single insert never has to re-insert the whole table
+#define TABLE_INCREMENTAL_CAPACITY 1024
+// This has to be more than 1 / TABLE_MAX_LOAD so that growing finishes before the table is full again
+// Higher means a shorter time spent checking both arrays, but more time added to each operation meanwhile
+#define TABLE_MIGRATE_SLOTS 8
+
+// An insert that has to look at more groups than this before finding room means the keys' hashes collide
+// far more than they would by chance (most likely on purpose), the table then switches to a keyed hash
+// Well spread hashes do reach 16 groups now and then near the maximum load (a few times per million inserts),
+// but each group further is about half as likely again, so this many full groups in a row essentially never happens
+#define TABLE_MAX_PROBE_GROUPS 32
+
+// Control bytes, one per slot, telling whether the slot is empty, deleted or full
+// Full slots store the top 7 bits of their key's hash instead (so the high bit is only set for empty and deleted)
+#define CONTROL_EMPTY ((uint8_t)0x80)
+#define CONTROL_DELETED ((uint8_t)0xFE)
 
 typedef struct {
     // Since key is always a string, store it as ObjString pointer rather than converting it
-    // TODO: Maybe want to add support for number keys? (essentially reduce it to a sequence of bits rather than ObjString* specifically)
-    // This would allow for arrays to just be HashTables with number keys
+    // Keys must be symbols (interned strings) since they are compared by pointer
+    // NOTE: Tables with keys of any type are ValueTables (below)
     ObjString* key;
     Value value;
 } Entry;
 
+#ifdef DEBUG_TABLE_STATS
+// Probe lengths (in groups) are counted in buckets of powers of 2: 1, 2-3, 4-7, 8-15, 16-31, 32+
+#define TABLE_PROBE_BUCKETS 6
+
+typedef struct {
+    // Searches for a key (from any operation) and whether they found it
+    long lookups;
+    long hits;
+    long misses;
+    // How many searches looked at each number of groups (see TABLE_PROBE_BUCKETS)
+    long probes[TABLE_PROBE_BUCKETS];
+    // Slots that were marked deleted rather than made empty again
+    long tombstones;
+    long resizes;
+    // Time spent growing (in adjustCapacity), and slots moved from the old arrays to the new ones (all at once or not)
+    double resizeSeconds;
+    long migratedSlots;
+    long keyedRebuilds;
+} TableStats;
+#endif
+
 typedef struct {
+    // Number of full and deleted slots (including those of the old arrays that haven't been moved yet)
     int count;
     int capacity;
+    // Control byte of each slot, kept apart from the entries so a probe can check 16 slots for the key's hash bits
+    // with a single comparison, only touching the entries that match
+    // (both live in one allocation, control right after the entries)
+    // NOTE: A hit loads the entry only once its control byte is in, so on tables too large for the cache
+    // it waits on two misses in a row where probing the entries directly waited on one (see bench/table.c)
+    // Misses only look at control bytes and got faster by more than hits got slower, so this is kept
+    uint8_t* control;
     Entry* entries;
+    // While the table is growing incrementally, the arrays it's growing from (NULL otherwise)
+    // Keys are only ever in one of the two arrays, so lookups check the new arrays and then the old ones
+    int oldCapacity;
+    uint8_t* oldControl;
+    Entry* oldEntries;
+    // Slots of the old arrays before this one have been moved to the new arrays
+    int migrated;
+    // Whether slots are picked with the keyed hash (hashStringKeyed) rather than the string's own hash
+    // Set once probing gets too long, the table stays keyed from then on
+    bool isKeyed;
+#ifdef DEBUG_TABLE_STATS
+    TableStats stats;
+#endif
 } Table;
 
 void initTable(Table* table);
@@ -27,6 +92,10 @@ void freeTable(Table* table);
 // Get the value in the table at the given key and store it in the passed value parameter
 // Returns true if the key exists
 bool tableGet(Table* table, ObjString* key, Value* value);
+// Get where the value of the given key is stored, or NULL if the key isn't in the table
+// Unlike the other operations it never moves entries over while the table grows (for the collector),
+// the pointer is only valid until the table is next changed
+Value* tableFindValue(Table* table, ObjString* key);
 // Adds the given key/value pair to the given hash table
 // Returns true if a new entry was added (instead of replacing an existing one)
 bool tableSet(Table* table, ObjString* key, Value value);
@@ -38,4 +107,47 @@ void tableAddAll(Table* from, Table* to);
 // Find a given table entry with the given c-string key and hash
 ObjString* tableFindString(Table* table, const char* chars, int length, uint32_t hash);
 
+// Trace the keys and values of the table for the collector (see traceValue)
+void traceTable(Table* table);
+// Remove the entries whose keys weren't marked by the collector (for tables that don't keep their keys alive)
+void tableRemoveWhite(Table* table);
+
+#ifdef DEBUG_TABLE_STATS
+// Print the table's counters along with its current load and number of deleted slots
+void printTableStats(const char* name, Table* table);
+#endif
+
+typedef struct {
+    Value key;
+    Value value;
+} ValueEntry;
+
+// A hash table whose keys can be any value (backing maps), laid out and probed like Table
+// Keys are compared by value rather than by pointer: numbers by number, strings by characters, other objects by identity
+// Number keys are hashed from their bits directly, so looking one up never allocates
+// NOTE: Keys are never removed, and the table grows all at once (maps are rarely large enough to need it incrementally)
+typedef struct {
+    // Number of full slots
+    int count;
+    int capacity;
+    // Control byte of each slot (see Table), in the same allocation right after the entries
+    uint8_t* control;
+    ValueEntry* entries;
+    // Whether slots are picked with the keyed hash (SipHash of strings' characters and of numbers' bits)
+    // Set once probing gets too long, like Table's
+    bool isKeyed;
+} ValueTable;
+
+void initValueTable(ValueTable* table);
+void freeValueTable(ValueTable* table);
+// Get the value in the table at the given key and store it in the passed value parameter
+// Returns true if the key exists
+bool valueTableGet(ValueTable* table, Value key, Value* value);
+// Adds the given key/value pair to the table
+// String keys must be flat strings (not ropes), and number keys can't be NaN (it isn't equal to anything)
+// Returns true if a new entry was added (instead of replacing an existing one)
+bool valueTableSet(ValueTable* table, Value key, Value value);
+// Trace the keys and values of the table for the collector (see traceValue)
+void traceValueTable(ValueTable* table);
+
 #endif
@@ -0,0 +1,125 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hamt.h"
+#include "object.h"
+#include "vm.h"
+
+// Random single updates and removals on frozen maps, checked against a plain array
+// Every version is kept until the next one is checked, and the map each update started from must not change
+// Removing has to keep the trie in the shape inserting makes: no node but the root is left with a lone entry,
+// and removing every key gives back the empty map
+
+#define KEYS 3000
+#define OPERATIONS 100000
+
+// Xorshift, so every run does the same operations
+static uint64_t randomState = 88172645463325252ull;
+
+static uint64_t nextRandom()
+{
+    randomState ^= randomState << 13;
+    randomState ^= randomState >> 7;
+    randomState ^= randomState << 17;
+    return randomState;
+}
+
+// Number of entries in the subtrie of node, or -1 if a node below the root has a lone entry and no children
+static int countEntries(HamtNode* node, bool isRoot)
+{
+    if (!isRoot && node->entryCount == 1 && node->childCount == 0)
+        return -1;
+
+    int count = node->entryCount;
+    for (int i = 0; i < node->childCount; i++)
+    {
+        int childCount = countEntries((HamtNode*)AS_OBJ(node->slots[2 * node->entryCount + i]), false);
+        if (childCount == -1)
+            return -1;
+        count += childCount;
+    }
+    return count;
+}
+
+int main()
+{
+    VMOptions options = {false, SIZE_MAX, false, NULL};
+    initVM(options);
+
+    int* expected = (int*)malloc(sizeof(int) * KEYS);
+    bool* present = (bool*)calloc(KEYS, sizeof(bool));
+    int count = 0;
+
+    HamtBuilder builder;
+    initHamtBuilder(&builder, NULL);
+    ObjFrozenMap* map = finishHamtBuilder(&builder);
+    int failures = 0;
+    for (int i = 0; i < OPERATIONS && failures < 10; i++)
+    {
+        int k = nextRandom() % KEYS;
+        ObjFrozenMap* previous = map;
+        Value value;
+        bool hadKey = hamtGet(previous, NUMBER_VAL(k), &value);
+        if (hadKey != present[k] || (hadKey && AS_NUMBER(value) != expected[k]))
+        {
+            printf("key %d is wrong before operation %d\n", k, i);
+            failures++;
+        }
+
+        // Removals are a bit more likely once the map is half full, so it keeps going up and down
+        if (nextRandom() % KEYS < (uint64_t)count * 11 / 10)
+        {
+            map = hamtRemove(previous, NUMBER_VAL(k));
+            if (present[k])
+                count--;
+            present[k] = false;
+        }
+        else
+        {
+            map = hamtSet(previous, NUMBER_VAL(k), NUMBER_VAL(i));
+            if (!present[k])
+                count++;
+            present[k] = true;
+            expected[k] = i;
+        }
+
+        if (hamtGet(previous, NUMBER_VAL(k), &value) != hadKey)
+        {
+            printf("operation %d changed the map it started from\n", i);
+            failures++;
+        }
+        if (map->count != count)
+        {
+            printf("count is %d after operation %d, but should be %d\n", map->count, i, count);
+            failures++;
+        }
+        // Walking the whole trie is only done every so often
+        if (i % 1000 == 0 && (map->root == NULL ? 0 : countEntries(map->root, true)) != count)
+        {
+            printf("the trie doesn't hold %d entries (or has a lone entry) after operation %d\n", count, i);
+            failures++;
+        }
+    }
+
+    for (int k = 0; k < KEYS; k++)
+    {
+        Value value;
+        if (hamtGet(map, NUMBER_VAL(k), &value) != present[k] || (present[k] && AS_NUMBER(value) != expected[k]))
+        {
+            printf("key %d is %s the map\n", k, present[k] ? "wrong or missing in" : "still in");
+            failures++;
+        }
+        map = hamtRemove(map, NUMBER_VAL(k));
+    }
+    if (map->count != 0 || map->root != NULL)
+    {
+        printf("removing every key left %d entries\n", map->count);
+        failures++;
+    }
+
+    free(present);
+    free(expected);
+    freeVM();
+    return failures == 0 ? 0 : 1;
+}
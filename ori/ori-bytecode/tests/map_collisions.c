@@ -0,0 +1,93 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "object.h"
+#include "table.h"
+#include "vm.h"
+
+// Map keys that all start probing in the same group have to switch the map's table over to the keyed hash,
+// and every key has to be found again afterwards: number keys (with -0 finding 0) and string keys
+// looked up through other string objects with the same characters
+
+#define KEYS 2000
+// Keys share this many low bits of their hash, as many as the table ends up using to pick a group
+#define COLLIDING_BITS 8
+
+static bool isColliding(Value key)
+{
+    return (hashValue(key) & ((1 << COLLIDING_BITS) - 1)) == 0;
+}
+
+static int checkTable(const char* name, ValueTable* table, Value* keys)
+{
+    int failures = 0;
+    if (!table->isKeyed)
+    {
+        printf("%s: the table didn't switch to the keyed hash\n", name);
+        failures++;
+    }
+    for (int i = 0; i < KEYS && failures < 10; i++)
+    {
+        Value value;
+        if (!valueTableGet(table, keys[i], &value) || AS_NUMBER(value) != i)
+        {
+            printf("%s: key %d is missing\n", name, i);
+            failures++;
+        }
+    }
+    return failures;
+}
+
+int main()
+{
+    VMOptions options = {false, SIZE_MAX, false, NULL};
+    initVM(options);
+    int failures = 0;
+
+    // Number keys, with 0 first (whatever its hash) so that -0 can look it up
+    Value* keys = (Value*)malloc(sizeof(Value) * KEYS);
+    keys[0] = NUMBER_VAL(0);
+    double number = 1;
+    for (int i = 1; i < KEYS; number++)
+    {
+        if (isColliding(NUMBER_VAL(number)))
+            keys[i++] = NUMBER_VAL(number);
+    }
+    ValueTable numbers;
+    initValueTable(&numbers);
+    for (int i = 0; i < KEYS; i++)
+        valueTableSet(&numbers, keys[i], NUMBER_VAL(i));
+    failures += checkTable("numbers", &numbers, keys);
+    Value value;
+    if (!valueTableGet(&numbers, NUMBER_VAL(-0.0), &value) || AS_NUMBER(value) != 0)
+    {
+        printf("numbers: -0 doesn't find 0\n");
+        failures++;
+    }
+    freeValueTable(&numbers);
+
+    // String keys, nothing is collected while the test runs so they don't need to be reachable
+    char chars[32];
+    for (int i = 0, candidate = 0; i < KEYS; candidate++)
+    {
+        Value key = OBJ_VAL((Obj*)copyString(chars, snprintf(chars, sizeof(chars), "key_%d", candidate)));
+        if (isColliding(key))
+            keys[i++] = key;
+    }
+    ValueTable strings;
+    initValueTable(&strings);
+    for (int i = 0; i < KEYS; i++)
+        valueTableSet(&strings, keys[i], NUMBER_VAL(i));
+    for (int i = 0; i < KEYS; i++)
+    {
+        ObjString* key = AS_STRING(keys[i]);
+        keys[i] = OBJ_VAL((Obj*)copyString(key->chars, key->length));
+    }
+    failures += checkTable("strings", &strings, keys);
+    freeValueTable(&strings);
+
+    free(keys);
+    freeVM();
+    return failures == 0 ? 0 : 1;
+}
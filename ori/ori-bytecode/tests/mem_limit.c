@@ -0,0 +1,77 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "vm.h"
+
+// A heap limit is only reached by what's still alive: globals that keep being given new maps have to fit
+// as long as the maps they held before can be freed, even though a full collection leaves its garbage to be swept
+// lazily (and the tables dead maps own are only freed with them)
+// Statements are interpreted one at a time like ori - runs its input
+// Then a single instruction that needs far more than the limit (flattening a long rope) has to fail before
+// it allocates, rather than at the next safepoint with the memory already taken
+
+#define MEMORY_LIMIT (1024 * 1024)
+#define GLOBALS 80
+#define ENTRIES 120
+#define ROUNDS 5
+// The rope is 16 << DOUBLINGS characters long
+#define DOUBLINGS 19
+
+static char statement[4096];
+
+int main()
+{
+    VMOptions options = {false, MEMORY_LIMIT, false, NULL};
+    initVM(options);
+
+    // What the script prints isn't checked, only that every statement runs
+    fflush(stdout);
+    int devNull = open("/dev/null", O_WRONLY);
+    dup2(devNull, STDOUT_FILENO);
+    close(devNull);
+
+    int line = 1;
+    for (int i = 0; i < GLOBALS; i++)
+    {
+        snprintf(statement, sizeof(statement), "let g%d = {};", i);
+        if (interpret(statement, line++) != INTERPRET_OK)
+            return 1;
+    }
+    for (int round = 0; round < ROUNDS; round++)
+    {
+        for (int i = 0; i < GLOBALS; i++)
+        {
+            int length = snprintf(statement, sizeof(statement), "g%d = {", i);
+            for (int j = 0; j < ENTRIES; j++)
+                length += snprintf(statement + length, sizeof(statement) - length, "\"k%d\": %d, ", j, j + round);
+            snprintf(statement + length - 2, sizeof(statement) - length + 2, "};");
+            if (interpret(statement, line++) != INTERPRET_OK)
+            {
+                fprintf(stderr, "Statement %d ran out of memory (%zu bytes allocated)\n", line - 1,
+                        vm.bytesAllocated);
+                return 1;
+            }
+        }
+    }
+
+    // Sources are kept in the statement buffer, the scanner reads whole aligned blocks past their end
+    snprintf(statement, sizeof(statement), "let s = \"0123456789abcdef\";");
+    interpret(statement, line++);
+    snprintf(statement, sizeof(statement), "s = s + s;");
+    for (int i = 0; i < DOUBLINGS; i++)
+        interpret(statement, line++);
+    snprintf(statement, sizeof(statement), "let c = s[3];");
+    if (interpret(statement, line++) != INTERPRET_RUNTIME_ERROR)
+        return 1;
+    if (vm.memoryStats.peakHeapBytes > MEMORY_LIMIT)
+    {
+        fprintf(stderr, "The heap went up to %zu bytes\n", vm.memoryStats.peakHeapBytes);
+        return 1;
+    }
+
+    freeVM();
+    return 0;
+}
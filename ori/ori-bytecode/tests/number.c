@@ -0,0 +1,119 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "scanner.h"
+
+// Number literals are converted while they're scanned, the values have to be exactly what strtod gives
+// (correctly rounded) for any literal: checked on edge cases and on random literals of every shape
+
+#define RANDOM_LITERALS 2000000
+
+static const char* edgeCases[] = {
+    "0",
+    "0.0",
+    "000123",
+    "0.1",
+    "0.30000000000000004",
+    "9007199254740992",
+    "9007199254740993",
+    "18446744073709551615",
+    "18446744073709551616",
+    "1234567890123456789",
+    "12345678901234567890",
+    "123456789012345678901234567890",
+    "1.7976931348623157",
+    "179769313486231570000000000000000000000000000000000000000000000000000000000000000000000000000000000000000"
+    "000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000"
+    "000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000",
+    "0.000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000001",
+    "0.00000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000"
+    "000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000"
+    "000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000"
+    "0000000000000000000000004940656458412465441765687928682213723651",
+    "2.2250738585072011",
+    "4503599627370496.5",
+    "4503599627370497.5",
+    "1000000000000000000000000",
+    "10000000000000000000000",
+    "3.141592653589793238462643383279502884197",
+};
+
+// Xorshift, so every run checks the same literals
+static uint64_t randomState = 88172645463325252ull;
+
+static uint64_t nextRandom()
+{
+    randomState ^= randomState << 13;
+    randomState ^= randomState >> 7;
+    randomState ^= randomState << 17;
+    return randomState;
+}
+
+// A literal with 1 to 25 integer digits (sometimes with leading zeros) and often a fraction of up to 30 digits
+static void randomLiteral(char* literal)
+{
+    int length = 0;
+    int integerDigits = 1 + nextRandom() % 25;
+    bool leadingZeros = nextRandom() % 4 == 0;
+    for (int i = 0; i < integerDigits; i++)
+        literal[length++] = leadingZeros && i < integerDigits / 2 ? '0' : '0' + nextRandom() % 10;
+
+    if (nextRandom() % 4 != 0)
+    {
+        literal[length++] = '.';
+        int fractionDigits = 1 + nextRandom() % 30;
+        int zeros = nextRandom() % 10;
+        for (int i = 0; i < fractionDigits; i++)
+            literal[length++] = i < zeros && nextRandom() % 2 ? '0' : '0' + nextRandom() % 10;
+    }
+    literal[length] = '\0';
+}
+
+// Scan the literal on its own and compare its value with strtod's
+static bool check(const char* literal)
+{
+    initScanner(literal, 1);
+    Token token = scanToken();
+    double expected = strtod(literal, NULL);
+    if (token.type != TOKEN_NUMBER || token.length != (int)strlen(literal) ||
+        memcmp(&token.number, &expected, sizeof(double)) != 0)
+    {
+        printf("%s: scanned %.17g, expected %.17g\n", literal, token.number, expected);
+        return false;
+    }
+    return true;
+}
+
+int main()
+{
+    int failures = 0;
+    for (size_t i = 0; i < sizeof(edgeCases) / sizeof(edgeCases[0]); i++)
+    {
+        if (!check(edgeCases[i]))
+            failures++;
+    }
+
+    char literal[64];
+    for (int i = 0; i < RANDOM_LITERALS && failures < 10; i++)
+    {
+        randomLiteral(literal);
+        if (!check(literal))
+            failures++;
+    }
+
+    // The literal ends at the first character that can't continue it
+    initScanner("12.5.25 7.x", 1);
+    Token first = scanToken();
+    Token dot = scanToken();
+    Token second = scanToken();
+    Token third = scanToken();
+    if (first.number != 12.5 || first.length != 4 || dot.type != TOKEN_DOT || second.number != 25 ||
+        third.number != 7 || third.length != 1)
+    {
+        printf("Number literals don't end where they should\n");
+        failures++;
+    }
+
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,53 @@
+#!/bin/bash
+
+# Run the tests
+# Each tests/*.c is a program built against the interpreter's sources (everything but main.c), which passes
+# if it exits with 0
+# Each tests/*.ori is a script run by ori, which passes if what it prints (followed by its exit status)
+# matches tests/<name>.out
+# A script gets the arguments in tests/<name>.args if there is one, and is piped in on stdin when they include -
+# CC and CFLAGS are passed on to the builds
+
+# Exit on error
+set -e
+# Globs without any match expand to nothing
+shopt -s nullglob
+
+cd "$(dirname "$0")/.."
+mkdir -p build/tests
+
+SOURCES=$(ls ./*.c | grep -v main.c)
+# NDEBUG leaves out the tracing of common.h
+COMPILE="${CC:-clang} -O2 -g -DNDEBUG -I. $CFLAGS"
+failures=0
+
+for test in tests/*.c; do
+    name=$(basename $test .c)
+    $COMPILE $test $SOURCES -o build/tests/$name -lm
+    if ! ./build/tests/$name; then
+        echo "FAIL $name"
+        failures=$((failures + 1))
+    fi
+done
+
+$COMPILE ./*.c -o build/tests/ori -lm
+for test in tests/*.ori; do
+    name=$(basename $test .ori)
+    args=$(cat tests/$name.args 2>/dev/null || true)
+    if [[ " $args " == *" - "* ]]; then
+        output=$(./build/tests/ori $args < $test 2>&1; echo "exit $?")
+    else
+        output=$(./build/tests/ori $args $test 2>&1; echo "exit $?")
+    fi
+    if [ "$output" != "$(cat tests/$name.out)" ]; then
+        echo "FAIL $name"
+        diff <(echo "$output") tests/$name.out | head -20 || true
+        failures=$((failures + 1))
+    fi
+done
+
+if [ $failures -ne 0 ]; then
+    echo "$failures failed"
+    exit 1
+fi
+echo "All tests passed"
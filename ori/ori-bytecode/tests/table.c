@@ -0,0 +1,123 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "object.h"
+#include "table.h"
+#include "vm.h"
+
+// Random sets, gets and deletes on tables large enough to grow incrementally, checked against a plain array
+// After every operation count has to be the number of full and deleted slots the table really has,
+// which the growing, migrating and deleting all have to keep up to date
+
+#define KEYS 50000
+#define OPERATIONS 2000000
+
+// Xorshift, so every run does the same operations
+static uint64_t randomState = 88172645463325252ull;
+
+static uint64_t nextRandom()
+{
+    randomState ^= randomState << 13;
+    randomState ^= randomState >> 7;
+    randomState ^= randomState << 17;
+    return randomState;
+}
+
+// Slots that aren't empty: all of the new arrays' and those of the old arrays that haven't been moved yet
+static int usedSlots(Table* table)
+{
+    int used = 0;
+    for (int i = 0; i < table->capacity; i++)
+        used += table->control[i] != CONTROL_EMPTY;
+    for (int i = table->migrated; i < table->oldCapacity; i++)
+        used += table->oldControl[i] != CONTROL_EMPTY;
+    return used;
+}
+
+int main()
+{
+    VMOptions options = {false, SIZE_MAX, false, NULL};
+    initVM(options);
+
+    ObjString** keys = (ObjString**)malloc(sizeof(ObjString*) * KEYS);
+    char chars[32];
+    // Only keys whose hashes have their low 2 bits clear, so they all start probing in a quarter of the groups
+    // Those fill up, and deleting from full groups leaves deleted slots, even in the half empty arrays of a growing table
+    for (int i = 0, candidate = 0; i < KEYS; candidate++)
+    {
+        keys[i] = copyString(chars, snprintf(chars, sizeof(chars), "key_%d", candidate));
+        keys[i]->isInterned = true;
+        if ((stringHash(keys[i]) & 3) == 0)
+            i++;
+    }
+    double* expected = (double*)malloc(sizeof(double) * KEYS);
+    bool* present = (bool*)calloc(KEYS, sizeof(bool));
+
+    Table table;
+    initTable(&table);
+    int failures = 0;
+    for (int i = 0; i < OPERATIONS && failures < 10; i++)
+    {
+        // Keys are picked from a range that slowly widens, so the table keeps growing while keys are deleted
+        int range = 16 + (int)((long)i * (KEYS - 16) / OPERATIONS);
+        int k = nextRandom() % range;
+        int operation = nextRandom() % 8;
+        Value value;
+        if (operation < 3)
+        {
+            bool added = tableSet(&table, keys[k], NUMBER_VAL(i));
+            if (added == present[k])
+            {
+                printf("tableSet of key %d returned %d\n", k, added);
+                failures++;
+            }
+            present[k] = true;
+            expected[k] = i;
+        }
+        else if (operation < 5)
+        {
+            bool deleted = tableDelete(&table, keys[k]);
+            if (deleted != present[k])
+            {
+                printf("tableDelete of key %d returned %d\n", k, deleted);
+                failures++;
+            }
+            present[k] = false;
+        }
+        else
+        {
+            bool found = tableGet(&table, keys[k], &value);
+            if (found != present[k] || (found && AS_NUMBER(value) != expected[k]))
+            {
+                printf("tableGet of key %d returned %d\n", k, found);
+                failures++;
+            }
+        }
+
+        // Counting slots goes through the whole table, so it's only checked every so often
+        // (a wrong count stays wrong, the slots it's off by are never found again)
+        if (i % 1000 == 0 && table.count != usedSlots(&table))
+        {
+            printf("count is %d after operation %d, but %d slots are used\n", table.count, i, usedSlots(&table));
+            failures++;
+        }
+    }
+
+    for (int k = 0; k < KEYS; k++)
+    {
+        Value value;
+        if (tableGet(&table, keys[k], &value) != present[k])
+        {
+            printf("key %d is %s the table\n", k, present[k] ? "missing from" : "still in");
+            failures++;
+        }
+    }
+
+    freeTable(&table);
+    free(present);
+    free(expected);
+    free(keys);
+    freeVM();
+    return failures == 0 ? 0 : 1;
+}
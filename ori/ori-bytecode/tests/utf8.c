@@ -0,0 +1,156 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "utf8.h"
+
+// isValidUtf8 uses the SIMD validator when the CPU has it, findInvalidUtf8 is always scalar:
+// both have to agree on every input, checked on edge cases and on random (valid, mutated and truncated) UTF-8
+
+#define RANDOM_INPUTS 5000000
+#define MAX_INPUT 96
+
+static const char* edgeCases[] = {
+    "",
+    "ascii only, long enough to take up more than one block",
+    "\xC2\x80",
+    "\xDF\xBF",
+    "\xC0\x80",         // Overlong
+    "\xC1\xBF",         // Overlong
+    "\xE0\xA0\x80",
+    "\xE0\x9F\xBF",     // Overlong
+    "\xED\x9F\xBF",
+    "\xED\xA0\x80",     // Surrogate
+    "\xEF\xBF\xBF",
+    "\xF0\x90\x80\x80",
+    "\xF0\x8F\xBF\xBF", // Overlong
+    "\xF4\x8F\xBF\xBF",
+    "\xF4\x90\x80\x80", // Past U+10FFFF
+    "\xF5\x80\x80\x80",
+    "\x80",             // Lone continuation
+    "\xE2\x82",         // Truncated
+    "\xF0\x9F\x98",     // Truncated
+    "0123456789abcd\xF0\x9F\x98\x80",   // Crosses a block boundary
+    "0123456789abcde\xF0\x9F\x98\x80",
+    "0123456789abcdef\xF0\x9F\x98",     // Truncated at the end of a block
+    "0123456789abcdefghijklmnopqrstu\xE2\x82\xAC",
+};
+
+// Xorshift, so every run checks the same inputs
+static uint64_t randomState = 88172645463325252ull;
+
+static uint64_t nextRandom()
+{
+    randomState ^= randomState << 13;
+    randomState ^= randomState >> 7;
+    randomState ^= randomState << 17;
+    return randomState;
+}
+
+static int encode(uint32_t codePoint, uint8_t* bytes)
+{
+    if (codePoint < 0x80)
+    {
+        bytes[0] = codePoint;
+        return 1;
+    }
+    if (codePoint < 0x800)
+    {
+        bytes[0] = 0xC0 | codePoint >> 6;
+        bytes[1] = 0x80 | (codePoint & 0x3F);
+        return 2;
+    }
+    if (codePoint < 0x10000)
+    {
+        bytes[0] = 0xE0 | codePoint >> 12;
+        bytes[1] = 0x80 | ((codePoint >> 6) & 0x3F);
+        bytes[2] = 0x80 | (codePoint & 0x3F);
+        return 3;
+    }
+    bytes[0] = 0xF0 | codePoint >> 18;
+    bytes[1] = 0x80 | ((codePoint >> 12) & 0x3F);
+    bytes[2] = 0x80 | ((codePoint >> 6) & 0x3F);
+    bytes[3] = 0x80 | (codePoint & 0x3F);
+    return 4;
+}
+
+// Random bytes, or valid UTF-8 with code points of every size that is then maybe mutated and truncated
+static size_t randomInput(uint8_t* bytes)
+{
+    size_t target = nextRandom() % (MAX_INPUT - 4);
+    int kind = nextRandom() % 4;
+    size_t length = 0;
+    while (length < target)
+    {
+        if (kind == 0)
+        {
+            bytes[length++] = nextRandom();
+            continue;
+        }
+
+        static const uint32_t limits[] = {0x80, 0x800, 0x10000, 0x110000};
+        uint32_t codePoint = nextRandom() % limits[nextRandom() % 4];
+        if (codePoint >= 0xD800 && codePoint < 0xE000)
+            codePoint = 'a';
+        length += encode(codePoint, bytes + length);
+    }
+
+    if (kind >= 2 && length > 0)
+    {
+        // Replace a few bytes, or flip single bits in them
+        int mutations = 1 + nextRandom() % 3;
+        for (int i = 0; i < mutations; i++)
+        {
+            size_t at = nextRandom() % length;
+            bytes[at] = kind == 2 ? (uint8_t)nextRandom() : bytes[at] ^ (1 << nextRandom() % 8);
+        }
+    }
+    if (nextRandom() % 8 == 0 && length > 0)
+        length -= nextRandom() % length;
+    return length;
+}
+
+static bool check(const char* chars, size_t length)
+{
+    bool valid = isValidUtf8(chars, length);
+    bool expected = findInvalidUtf8(chars, length) == -1;
+    if (valid != expected)
+    {
+        printf("isValidUtf8 gives %d, findInvalidUtf8 %d for:", valid, expected);
+        for (size_t i = 0; i < length; i++)
+            printf(" %02x", (uint8_t)chars[i]);
+        printf("\n");
+        return false;
+    }
+    return true;
+}
+
+int main()
+{
+    int failures = 0;
+    for (size_t i = 0; i < sizeof(edgeCases) / sizeof(edgeCases[0]); i++)
+    {
+        if (!check(edgeCases[i], strlen(edgeCases[i])))
+            failures++;
+    }
+
+    uint8_t bytes[MAX_INPUT];
+    int invalid = 0;
+    for (int i = 0; i < RANDOM_INPUTS && failures < 10; i++)
+    {
+        size_t length = randomInput(bytes);
+        if (!check((const char*)bytes, length))
+            failures++;
+        if (findInvalidUtf8((const char*)bytes, length) != -1)
+            invalid++;
+    }
+
+    // Both valid and invalid inputs have to come up often for the comparison to mean anything
+    if (invalid < RANDOM_INPUTS / 10 || invalid > RANDOM_INPUTS - RANDOM_INPUTS / 10)
+    {
+        printf("%d of %d random inputs are invalid\n", invalid, RANDOM_INPUTS);
+        failures++;
+    }
+
+    return failures == 0 ? 0 : 1;
+}
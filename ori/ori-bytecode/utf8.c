@@ -0,0 +1,285 @@
+#include <string.h>
+
+#include "common.h"
+#include "utf8.h"
+
+// Validate 16 bytes at a time with SSSE3 (byte shuffles are used as 16 entry lookup tables)
+// x86-64 only guarantees SSE2, so unless built with -mssse3 the SIMD validator is compiled in
+// for SSSE3 anyway and used when the CPU running it has it, otherwise a scalar validator is used
+#if defined(__SSE2__)
+#include <immintrin.h>
+#define UTF8_BLOCK_SIZE 16
+#if defined(__SSSE3__)
+#define SSSE3_TARGET
+#elif defined(__GNUC__)
+#define SSSE3_TARGET __attribute__((target("ssse3")))
+#else
+#undef UTF8_BLOCK_SIZE
+#endif
+#endif
+
+// Every byte's high bit, to test 8 bytes at once for non-ASCII characters
+#define HIGH_BITS 0x8080808080808080ull
+
+// Read 8 bytes at once, memcpy takes care of alignment and compiles down to a single load
+static inline uint64_t read64(const char* p)
+{
+    uint64_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+bool isAscii(const char* chars, size_t length)
+{
+    // OR all the bytes together 32 at a time, any high bit set in the result means a non-ASCII byte
+    size_t i = 0;
+    for (; i + 32 <= length; i += 32)
+    {
+        uint64_t bits = read64(chars + i) | read64(chars + i + 8) | read64(chars + i + 16) | read64(chars + i + 24);
+        if (bits & HIGH_BITS)
+            return false;
+    }
+
+    uint8_t bits = 0;
+    for (; i < length; i++)
+        bits |= (uint8_t)chars[i];
+    return (bits & 0x80) == 0;
+}
+
+long findInvalidUtf8(const char* chars, size_t length)
+{
+    const uint8_t* bytes = (const uint8_t*)chars;
+    size_t i = 0;
+
+    while (i < length)
+    {
+        // Skip over runs of ASCII 8 bytes at a time
+        if (i + 8 <= length && (read64(chars + i) & HIGH_BITS) == 0)
+        {
+            i += 8;
+            continue;
+        }
+
+        uint8_t lead = bytes[i];
+        if (lead < 0x80)
+        {
+            i++;
+            continue;
+        }
+
+        // The lead byte gives the size of the sequence, and narrows down which second bytes are allowed
+        // (ruling out overlong encodings, surrogates and code points past U+10FFFF)
+        size_t size;
+        uint8_t low = 0x80;
+        uint8_t high = 0xBF;
+        if (lead >= 0xC2 && lead <= 0xDF)
+        {
+            size = 2;
+        }
+        else if (lead >= 0xE0 && lead <= 0xEF)
+        {
+            size = 3;
+            if (lead == 0xE0)
+                low = 0xA0;
+            else if (lead == 0xED)
+                high = 0x9F;
+        }
+        else if (lead >= 0xF0 && lead <= 0xF4)
+        {
+            size = 4;
+            if (lead == 0xF0)
+                low = 0x90;
+            else if (lead == 0xF4)
+                high = 0x8F;
+        }
+        else
+        {
+            return (long)i;
+        }
+
+        if (length - i < size || bytes[i + 1] < low || bytes[i + 1] > high)
+            return (long)i;
+        for (size_t j = 2; j < size; j++)
+        {
+            if ((bytes[i + j] & 0xC0) != 0x80)
+                return (long)i;
+        }
+
+        i += size;
+    }
+
+    return -1;
+}
+
+#ifdef UTF8_BLOCK_SIZE
+// Kinds of errors a pair of consecutive bytes can have, the lookup tables below give the errors
+// that are possible for each half of the first byte and the high half of the second byte,
+// so a pair is invalid when all three agree on an error (this is the validator from simdjson/simdutf)
+#define TOO_SHORT (1 << 0)      // A lead byte not followed by a continuation byte
+#define TOO_LONG (1 << 1)       // ASCII followed by a continuation byte
+#define OVERLONG_3 (1 << 2)     // 3 byte sequence for a code point that fits in 2 bytes
+#define TOO_LARGE (1 << 3)      // Code point past U+10FFFF
+#define SURROGATE (1 << 4)      // Code point between U+D800 and U+DFFF
+#define OVERLONG_2 (1 << 5)     // 2 byte sequence for a code point that fits in 1 byte
+#define TOO_LARGE_1000 (1 << 6) // Code point past U+10FFFF (lead byte F5 and up)
+#define OVERLONG_4 (1 << 6)     // 4 byte sequence for a code point that fits in 3 bytes
+#define TWO_CONTS (-128)        // Two continuation bytes in a row, only valid as the 3rd or 4th byte (1 << 7 as a char)
+#define CARRY (TOO_SHORT | TOO_LONG | TWO_CONTS)
+
+// High 4 bits of each byte
+SSSE3_TARGET static inline __m128i highNibbles(__m128i bytes)
+{
+    return _mm_and_si128(_mm_srli_epi16(bytes, 4), _mm_set1_epi8(0x0F));
+}
+
+// Errors found in each pair of consecutive bytes (prev1 holds the byte before each byte of input)
+SSSE3_TARGET static inline __m128i checkSpecialCases(__m128i input, __m128i prev1)
+{
+    const __m128i byte1HighTable = _mm_setr_epi8(
+        // 0___ ASCII
+        TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+        // 10__ continuation
+        TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS,
+        // 1100 two byte lead (C0 and C1 are always overlong)
+        TOO_SHORT | OVERLONG_2,
+        // 1101 two byte lead
+        TOO_SHORT,
+        // 1110 three byte lead
+        TOO_SHORT | OVERLONG_3 | SURROGATE,
+        // 1111 four byte lead
+        TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4);
+
+    const __m128i byte1LowTable = _mm_setr_epi8(
+        // ____0000
+        CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4,
+        // ____0001
+        CARRY | OVERLONG_2,
+        // ____001_
+        CARRY, CARRY,
+        // ____0100
+        CARRY | TOO_LARGE,
+        // ____0101 to ____1100
+        CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000,
+        // ____1101
+        CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE,
+        // ____111_
+        CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000);
+
+    const __m128i byte2HighTable = _mm_setr_epi8(
+        // 0___ ASCII
+        TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+        // 1000
+        TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000 | OVERLONG_4,
+        // 1001
+        TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE,
+        // 101_
+        TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+        TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+        // 11__ lead
+        TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT);
+
+    __m128i byte1High = _mm_shuffle_epi8(byte1HighTable, highNibbles(prev1));
+    __m128i byte1Low = _mm_shuffle_epi8(byte1LowTable, _mm_and_si128(prev1, _mm_set1_epi8(0x0F)));
+    __m128i byte2High = _mm_shuffle_epi8(byte2HighTable, highNibbles(input));
+    return _mm_and_si128(_mm_and_si128(byte1High, byte1Low), byte2High);
+}
+
+// Check one block given the block before it, adding any error to error
+// prevIncomplete is set to the bytes at the end of the block that start a sequence which doesn't fit in it
+SSSE3_TARGET static inline void checkBlock(__m128i input, __m128i* prevInput, __m128i* prevIncomplete, __m128i* error)
+{
+    if (_mm_movemask_epi8(input) == 0)
+    {
+        // All ASCII, the only possible error is a sequence from the previous block that never got finished
+        *error = _mm_or_si128(*error, *prevIncomplete);
+        *prevIncomplete = _mm_setzero_si128();
+        *prevInput = input;
+        return;
+    }
+
+    // The input shifted by 1, 2 and 3 bytes, continuing from the end of the previous block
+    __m128i prev1 = _mm_alignr_epi8(input, *prevInput, 15);
+    __m128i prev2 = _mm_alignr_epi8(input, *prevInput, 14);
+    __m128i prev3 = _mm_alignr_epi8(input, *prevInput, 13);
+
+    // Pairs of bytes only catch 2 byte errors, the 3rd and 4th bytes of a sequence are two continuations in a row
+    // which is only valid 2 or 3 bytes after a three or four byte lead
+    __m128i specialCases = checkSpecialCases(input, prev1);
+    __m128i isThirdByte = _mm_subs_epu8(prev2, _mm_set1_epi8((char)(0xE0 - 0x80)));
+    __m128i isFourthByte = _mm_subs_epu8(prev3, _mm_set1_epi8((char)(0xF0 - 0x80)));
+    __m128i must23 = _mm_and_si128(_mm_or_si128(isThirdByte, isFourthByte), _mm_set1_epi8((char)0x80));
+    *error = _mm_or_si128(*error, _mm_xor_si128(must23, specialCases));
+
+    // A lead byte is incomplete if it's in the last 1, 2 or 3 bytes and needs more than that
+    const __m128i maxValue = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                                           (char)(0xF0 - 1), (char)(0xE0 - 1), (char)(0xC0 - 1));
+    *prevIncomplete = _mm_subs_epu8(input, maxValue);
+    *prevInput = input;
+}
+
+SSSE3_TARGET static bool isValidUtf8Blocks(const char* chars, size_t length)
+{
+    __m128i error = _mm_setzero_si128();
+    __m128i prevInput = _mm_setzero_si128();
+    __m128i prevIncomplete = _mm_setzero_si128();
+
+    size_t i = 0;
+    for (; i + UTF8_BLOCK_SIZE <= length; i += UTF8_BLOCK_SIZE)
+        checkBlock(_mm_loadu_si128((const __m128i*)(chars + i)), &prevInput, &prevIncomplete, &error);
+
+    // The rest is padded with zeroes (which are ASCII, so a truncated sequence at the end is still caught)
+    if (i < length)
+    {
+        char tail[UTF8_BLOCK_SIZE] = {0};
+        memcpy(tail, chars + i, length - i);
+        checkBlock(_mm_loadu_si128((const __m128i*)tail), &prevInput, &prevIncomplete, &error);
+    }
+
+    error = _mm_or_si128(error, prevIncomplete);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(error, _mm_setzero_si128())) == 0xFFFF;
+}
+
+// Whether the CPU supports SSSE3, checked the first time a string is validated (-1 until then)
+static int hasSsse3 = -1;
+#endif
+
+bool isValidUtf8(const char* chars, size_t length)
+{
+#ifdef UTF8_BLOCK_SIZE
+    if (hasSsse3 < 0)
+    {
+#if defined(__SSSE3__)
+        hasSsse3 = 1;
+#else
+        __builtin_cpu_init();
+        hasSsse3 = __builtin_cpu_supports("ssse3");
+#endif
+    }
+    if (hasSsse3)
+        return isValidUtf8Blocks(chars, length);
+#endif
+    return findInvalidUtf8(chars, length) == -1;
+}
+
+int countCodePoints(const char* chars, int length)
+{
+    // Every byte except continuation bytes (10xxxxxx) starts a code point
+    int count = 0;
+    int i = 0;
+    for (; i + 8 <= length; i += 8)
+    {
+        uint64_t bytes = read64(chars + i);
+        // High bit set in each byte that is a continuation byte
+        uint64_t continuations = bytes & ~(bytes << 1) & HIGH_BITS;
+        count += 8 - __builtin_popcountll(continuations);
+    }
+    for (; i < length; i++)
+    {
+        if (((uint8_t)chars[i] & 0xC0) != 0x80)
+            count++;
+    }
+    return count;
+}
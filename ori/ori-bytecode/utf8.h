@@ -0,0 +1,16 @@
+#ifndef ori_utf8_h
+#define ori_utf8_h
+
+#include "common.h"
+
+// Whether the given characters are all ASCII (no byte has its high bit set)
+bool isAscii(const char* chars, size_t length);
+// Whether the given characters are valid UTF-8
+bool isValidUtf8(const char* chars, size_t length);
+// Offset of the first invalid UTF-8 sequence in the given characters, or -1 if they are all valid
+// Slower than isValidUtf8, this is meant for reporting where the error is
+long findInvalidUtf8(const char* chars, size_t length);
+// Number of code points in the given (valid) UTF-8 characters
+int countCodePoints(const char* chars, int length);
+
+#endif
@@ -19,7 +19,7 @@ void writeValueArray(ValueArray* array, Value value)
     {
         int oldCapacity = array->capacity;
         array->capacity = GROW_CAPACITY(oldCapacity);
-        array->values = GROW_ARRAY(array->values, Value, oldCapacity, array->capacity);
+        array->values = GROW_SCRATCH_ARRAY(array->values, Value, oldCapacity, array->capacity, MEM_CONSTANTS);
     }
 
     // Add the new element
@@ -30,7 +30,7 @@ void writeValueArray(ValueArray* array, Value value)
 void freeValueArray(ValueArray* array)
 {
     // Deallocate all of the memory
-    FREE_ARRAY(ValueArray, array->values, array->capacity);
+    FREE_SCRATCH_ARRAY(Value, array->values, array->capacity, MEM_CONSTANTS);
     // Re-initialize the value array to a blank state
     initValueArray(array);
 }
@@ -68,7 +68,51 @@ bool valuesEqual(Value a, Value b)
         case VAL_NUMBER:
             return AS_NUMBER(a) == AS_NUMBER(b);
         case VAL_OBJ:
-            // Because of string interning, all strings with the same content will have the same value
-            return AS_OBJ(a) == AS_OBJ(b);
+        {
+            if (AS_OBJ(a) == AS_OBJ(b))
+                return true;
+            if (!IS_ANY_STRING(a) || !IS_ANY_STRING(b))
+                return false;
+
+            // Ropes are flattened first so that they can be compared like any other string
+            ObjString* stringA = IS_ROPE(a) ? flattenRope(AS_ROPE(a)) : AS_STRING(a);
+            ObjString* stringB = IS_ROPE(b) ? flattenRope(AS_ROPE(b)) : AS_STRING(b);
+            if (stringA == stringB)
+                return true;
+            // Only one interned string exists for given characters, so two different ones can't be equal
+            if (stringA->isInterned && stringB->isInterned)
+                return false;
+
+            // Otherwise compare the characters, comparing hashes first to rule out most different strings quickly
+            return stringA->length == stringB->length &&
+                   stringHash(stringA) == stringHash(stringB) &&
+                   memcmp(stringA->chars, stringB->chars, stringA->length) == 0;
+        }
+    }
+}
+
+uint32_t hashValue(Value value)
+{
+    switch (value.type)
+    {
+        case VAL_NUMBER:
+        {
+            // -0 and 0 are equal, so they need the same hash
+            double number = AS_NUMBER(value) == 0 ? 0 : AS_NUMBER(value);
+            uint64_t bits;
+            memcpy(&bits, &number, sizeof(bits));
+            return hashBits(bits);
+        }
+        case VAL_BOOL:
+            return hashBits(AS_BOOL(value) ? 2 : 1);
+        case VAL_NULL:
+            return hashBits(0);
+        case VAL_OBJ:
+            // Strings are equal by their characters, maps only to themselves
+            // (hashed by an identity hash rather than their address, which changes when the collector moves them)
+            if (IS_STRING(value))
+                return stringHash(AS_STRING(value));
+            return IS_MAP(value) ? AS_MAP(value)->hash : AS_FROZEN_MAP(value)->hash;
     }
+    return 0; // Unreachable
 }
@@ -62,6 +62,9 @@ typedef struct
 
 // Whether or not two given values are equal
 bool valuesEqual(Value a, Value b);
+// Hash of a value used as a map key, equal values have equal hashes
+// (strings must be flat, ObjString rather than ObjRope)
+uint32_t hashValue(Value value);
 // Initialize a new ValueArray
 void initValueArray(ValueArray* array);
 // Append a value at the end of the given array
@@ -1,10 +1,13 @@
+#include <setjmp.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 
 #include "common.h"
 #include "compiler.h"
 #include "debug.h"
+#include "hamt.h"
 #include "memory.h"
 #include "object.h"
 #include "vm.h"
@@ -38,19 +41,69 @@ static void runtimeError(const char* format, ...)
     resetStack();
 }
 
-void initVM()
+// Fill the VM's hash secrets with random bytes
+static void randomizeHashSecrets()
 {
+    uint64_t secrets[4];
+    FILE* random = fopen("/dev/urandom", "rb");
+    bool isRandom = random != NULL && fread(secrets, sizeof(secrets), 1, random) == 1;
+    if (random != NULL)
+        fclose(random);
+
+    if (!isRandom)
+    {
+        // No system randomness, derive them from the time and addresses (which differ with ASLR) instead
+        // using the SplitMix64 generator
+        uint64_t state = (uint64_t)time(NULL) ^ ((uint64_t)clock() << 32) ^ (uint64_t)(uintptr_t)&vm ^ (uint64_t)(uintptr_t)secrets;
+        for (int i = 0; i < 4; i++)
+        {
+            uint64_t z = (state += 0x9E3779B97F4A7C15ull);
+            z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+            z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+            secrets[i] = z ^ (z >> 31);
+        }
+    }
+
+    vm.hashSeed[0] = secrets[0];
+    vm.hashSeed[1] = secrets[1];
+    vm.sipKey[0] = secrets[2];
+    vm.sipKey[1] = secrets[3];
+}
+
+void initVM(VMOptions options)
+{
+    // Has to come first, nothing can be hashed before the secrets are picked
+    randomizeHashSecrets();
+    vm.options = options;
+    vm.allocationFailure = NULL;
     resetStack();
-    vm.objects = NULL;
+    initHeap();
+    vm.literals = NULL;
     initTable(&vm.globals);
     initTable(&vm.strings);
 }
 
 void freeVM()
 {
+#ifdef DEBUG_TABLE_STATS
+    printTableStats("strings", &vm.strings);
+    printTableStats("globals", &vm.globals);
+#endif
+#ifdef DEBUG_GC_STATS
+    printGcStats();
+#endif
+    if (vm.options.printMemoryStats)
+        printMemoryStats();
+    if (vm.options.allocationProfilePath != NULL)
+    {
+        writeAllocationProfile(vm.options.allocationProfilePath);
+        freeAllocationProfile();
+    }
     freeTable(&vm.globals);
     freeTable(&vm.strings);
     freeObjects();
+    freeLiterals();
+    freeSlabs();
 }
 
 void push(Value value)
@@ -80,19 +133,346 @@ static bool isFalsy(Value value)
     return IS_NULL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
 
-static void concatenate()
+static int stringifyValue(Value value, char* buffer, int size);
+
+// Buffer and size for writing at offset into a buffer of the given size (NULL once it's full, so the rest is only measured)
+#define BUFFER_AT(buffer, size, offset) ((offset) < (size) ? (buffer) + (offset) : NULL), ((offset) < (size) ? (size) - (offset) : 0)
+
+// Writes an entry of a map as text after length characters, returning the length after it
+static int stringifyEntry(Value key, Value value, bool isFirst, char* buffer, int size, int length)
+{
+    length += snprintf(BUFFER_AT(buffer, size, length), isFirst ? "" : ", ");
+    length += stringifyValue(key, BUFFER_AT(buffer, size, length));
+    length += snprintf(BUFFER_AT(buffer, size, length), ": ");
+    length += stringifyValue(value, BUFFER_AT(buffer, size, length));
+    return length;
+}
+
+// Writes a map as text the same way printObject prints it ({key: value, ...})
+static int stringifyMap(ObjMap* map, char* buffer, int size)
+{
+    if (map->isPrinting)
+        return snprintf(buffer, size, "{...}");
+
+    ValueTable* table = &map->table;
+    map->isPrinting = true;
+    int length = snprintf(buffer, size, "{");
+    bool isFirst = true;
+    for (int i = 0; i < table->capacity; i++)
+    {
+        if (table->control[i] & CONTROL_EMPTY)
+            continue;
+        length = stringifyEntry(table->entries[i].key, table->entries[i].value, isFirst, buffer, size, length);
+        isFirst = false;
+    }
+    length += snprintf(BUFFER_AT(buffer, size, length), "}");
+    map->isPrinting = false;
+    return length;
+}
+
+// Writes a frozen map as text the same way printObject prints it (#{key: value, ...})
+static int stringifyFrozenMap(ObjFrozenMap* map, char* buffer, int size)
+{
+    if (map->isPrinting)
+        return snprintf(buffer, size, "#{...}");
+
+    HamtIterator iterator;
+    initHamtIterator(&iterator, map);
+    Value key;
+    Value value;
+    map->isPrinting = true;
+    int length = snprintf(buffer, size, "#{");
+    bool isFirst = true;
+    while (hamtNext(&iterator, &key, &value))
+    {
+        length = stringifyEntry(key, value, isFirst, buffer, size, length);
+        isFirst = false;
+    }
+    length += snprintf(BUFFER_AT(buffer, size, length), "}");
+    map->isPrinting = false;
+    return length;
+}
+
+#undef BUFFER_AT
+
+// Writes the given value as text into the buffer (writing at most size bytes, like snprintf)
+// Returns the length of the full text, so passing a NULL buffer only measures it
+static int stringifyValue(Value value, char* buffer, int size)
+{
+    switch (value.type)
+    {
+        case VAL_BOOL:
+            return snprintf(buffer, size, "%s", AS_BOOL(value) ? "true" : "false");
+        case VAL_NULL:
+            return snprintf(buffer, size, "null");
+        case VAL_NUMBER:
+            return snprintf(buffer, size, "%g", AS_NUMBER(value));
+        case VAL_OBJ:
+            if (IS_MAP(value))
+                return stringifyMap(AS_MAP(value), buffer, size);
+            if (IS_FROZEN_MAP(value))
+                return stringifyFrozenMap(AS_FROZEN_MAP(value), buffer, size);
+            if (IS_ROPE(value))
+                value = OBJ_VAL((Obj*)flattenRope(AS_ROPE(value)));
+            return snprintf(buffer, size, "%.*s", AS_STRING(value)->length, AS_CSTRING(value));
+    }
+    return 0; // Unreachable
+}
+
+// Replace the top count values of the stack with a single string made of all of them
+// The total length is computed up front so the result is only allocated once
+// (rather than once per intermediate string with repeated binary concatenation)
+// Returns false (reporting the error) if the result would be longer than a string can be
+static bool concatenate(int count)
+{
+    Value* parts = vm.stackTop - count;
+
+    // Summed without overflowing, each part is at most STRING_MAX_LENGTH long
+    size_t length = 0;
+    // Numbers, booleans and null are always written in ASCII
+    // Maps may contain strings that aren't, they are assumed not to be (which is only slower if they are)
+    bool isAscii = true;
+    for (int i = 0; i < count; i++)
+    {
+        if (IS_ANY_STRING(parts[i]))
+        {
+            length += anyStringLength(AS_OBJ(parts[i]));
+            isAscii = isAscii && anyStringIsAscii(AS_OBJ(parts[i]));
+        }
+        else
+        {
+            length += stringifyValue(parts[i], NULL, 0);
+            isAscii = isAscii && !IS_MAP(parts[i]) && !IS_FROZEN_MAP(parts[i]);
+        }
+    }
+    if (length > STRING_MAX_LENGTH)
+    {
+        runtimeError("Strings can't be longer than %d bytes.", STRING_MAX_LENGTH);
+        return false;
+    }
+
+    // Long strings are chained together as ropes instead of being copied
+    if (length >= ROPE_MIN_LENGTH)
+    {
+        for (int i = 0; i < count; i++)
+        {
+            if (!IS_ANY_STRING(parts[i]))
+            {
+                int textLength = stringifyValue(parts[i], NULL, 0);
+                ObjString* text = makeString(textLength, !IS_MAP(parts[i]) && !IS_FROZEN_MAP(parts[i]));
+                stringifyValue(parts[i], text->storage, textLength + 1);
+                parts[i] = OBJ_VAL((Obj*)text);
+            }
+        }
+
+        Obj* result = AS_OBJ(parts[0]);
+        for (int i = 1; i < count; i++)
+            result = (Obj*)makeRope(result, AS_OBJ(parts[i]));
+
+        vm.stackTop = parts;
+        push(OBJ_VAL(result));
+        return true;
+    }
+
+    // Build the string right into its final object
+    ObjString* result = makeString((int)length, isAscii);
+    char* chars = result->storage;
+    int offset = 0;
+    for (int i = 0; i < count; i++)
+    {
+        if (IS_ANY_STRING(parts[i]))
+        {
+            copyChars(AS_OBJ(parts[i]), chars + offset);
+            offset += anyStringLength(AS_OBJ(parts[i]));
+        }
+        else
+        {
+            // There is always room for snprintf's null byte since the buffer is length + 1
+            offset += stringifyValue(parts[i], chars + offset, (int)length + 1 - offset);
+        }
+    }
+
+    vm.stackTop = parts;
+    push(OBJ_VAL((Obj*)result));
+    return true;
+}
+
+// Add all the entries of a map or frozen map to the builder
+static void addEntries(HamtBuilder* builder, Value map)
 {
-    ObjString* b = AS_STRING(pop());
-    ObjString* a = AS_STRING(pop());
+    if (IS_FROZEN_MAP(map))
+    {
+        HamtIterator iterator;
+        initHamtIterator(&iterator, AS_FROZEN_MAP(map));
+        Value key;
+        Value value;
+        while (hamtNext(&iterator, &key, &value))
+            hamtBuilderSet(builder, key, value);
+        return;
+    }
 
-    int length = a->length + b->length;
-    char* chars = ALLOCATE(char, length + 1);
-    memcpy(chars, a->chars, a->length);
-    memcpy(chars + a->length, b->chars, b->length);
-    chars[length] = '\0';
+    ValueTable* table = &AS_MAP(map)->table;
+    for (int i = 0; i < table->capacity; i++)
+    {
+        if (!(table->control[i] & CONTROL_EMPTY))
+            hamtBuilderSet(builder, table->entries[i].key, table->entries[i].value);
+    }
+}
+
+// Get the only entry of a map or frozen map
+// Returns false if it doesn't have exactly one
+static bool singleEntry(Value map, Value* key, Value* value)
+{
+    if (IS_FROZEN_MAP(map))
+    {
+        if (AS_FROZEN_MAP(map)->count != 1)
+            return false;
+        HamtIterator iterator;
+        initHamtIterator(&iterator, AS_FROZEN_MAP(map));
+        return hamtNext(&iterator, key, value);
+    }
 
-    ObjString* result = takeString(chars, length);
-    push(OBJ_VAL(result));
+    ValueTable* table = &AS_MAP(map)->table;
+    if (table->count != 1)
+        return false;
+    for (int i = 0; i < table->capacity; i++)
+    {
+        if (!(table->control[i] & CONTROL_EMPTY))
+        {
+            *key = table->entries[i].key;
+            *value = table->entries[i].value;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Report that the operand at index can't be added to the ones before it, in a chain of count values added together
+// (the first operand when it can't be added to anything)
+static void addError(Value* operands, int count, int index)
+{
+    const char* message = IS_FROZEN_MAP(operands[0]) ? "Only maps can be added to a frozen map"
+                                                     : "Operands must be two numbers or two strings";
+    if (count == 2)
+        runtimeError("%s.", message);
+    else
+        runtimeError("%s (operand %d of %d).", message, index + 1, count);
+}
+
+// Add the top count values of the stack together, like a chain of binary + would
+// Returns false (reporting the error) if the values are not all numbers, all strings, or a frozen map followed by maps
+// The error is about the first operand from the left that doesn't fit, where the chain of + would have stopped
+static bool addValues(int count)
+{
+    Value* operands = vm.stackTop - count;
+
+    if (IS_FROZEN_MAP(operands[0]))
+    {
+        for (int i = 1; i < count; i++)
+        {
+            if (!IS_MAP(operands[i]) && !IS_FROZEN_MAP(operands[i]))
+            {
+                addError(operands, count, i);
+                return false;
+            }
+        }
+
+        // The result is a new frozen map with the entries of the others added (replacing those with the same key)
+        // A single entry (f + {k: v}) only copies the path down to it
+        Value key;
+        Value value;
+        if (count == 2 && singleEntry(operands[1], &key, &value))
+        {
+            ObjFrozenMap* result = hamtSet(AS_FROZEN_MAP(operands[0]), key, value);
+            vm.stackTop = operands;
+            push(OBJ_VAL((Obj*)result));
+            return true;
+        }
+
+        // Otherwise one builder adds all of them, so each node on the way is copied once rather than once per entry
+        HamtBuilder builder;
+        initHamtBuilder(&builder, AS_FROZEN_MAP(operands[0]));
+        for (int i = 1; i < count; i++)
+            addEntries(&builder, operands[i]);
+
+        ObjFrozenMap* result = finishHamtBuilder(&builder);
+        vm.stackTop = operands;
+        push(OBJ_VAL((Obj*)result));
+        return true;
+    }
+
+    if (IS_ANY_STRING(operands[0]))
+    {
+        for (int i = 1; i < count; i++)
+        {
+            if (!IS_ANY_STRING(operands[i]))
+            {
+                addError(operands, count, i);
+                return false;
+            }
+        }
+        return concatenate(count);
+    }
+
+    if (IS_NUMBER(operands[0]))
+    {
+        // Sum from left to right so the result is the same as with binary +
+        double sum = AS_NUMBER(operands[0]);
+        for (int i = 1; i < count; i++)
+        {
+            if (!IS_NUMBER(operands[i]))
+            {
+                addError(operands, count, i);
+                return false;
+            }
+            sum += AS_NUMBER(operands[i]);
+        }
+        vm.stackTop = operands;
+        push(NUMBER_VAL(sum));
+        return true;
+    }
+
+    addError(operands, count, 0);
+    return false;
+}
+
+// Get the flat ObjString of a string value (flattening it if it's a rope)
+static ObjString* asFlatString(Value value)
+{
+    return IS_ROPE(value) ? flattenRope(AS_ROPE(value)) : AS_STRING(value);
+}
+
+// Read the given value as a key of a map
+// Returns false if it can't be one (NaN, which isn't equal to anything)
+static bool readKey(Value value, Value* key)
+{
+    if (IS_NUMBER(value) && AS_NUMBER(value) != AS_NUMBER(value))
+        return false;
+
+    // Strings are stored flat so they can be hashed and compared directly
+    *key = IS_ROPE(value) ? OBJ_VAL((Obj*)flattenRope(AS_ROPE(value))) : value;
+    return true;
+}
+
+// Read the given value as a code point index into a string of the given length (null being defaultIndex)
+// Returns false if it's not a whole number between 0 and length (included, since the end of a slice can be there)
+static bool readIndex(Value value, int length, int defaultIndex, int* index)
+{
+    if (IS_NULL(value))
+    {
+        *index = defaultIndex;
+        return true;
+    }
+    if (!IS_NUMBER(value))
+        return false;
+
+    // Written so that NaN fails the range check, before it's converted to int (which is undefined for it)
+    double number = AS_NUMBER(value);
+    if (!(number >= 0 && number <= length) || number != (int)number)
+        return false;
+
+    *index = (int)number;
+    return true;
 }
 
 static InterpretResult run()
@@ -126,6 +506,15 @@ static InterpretResult run()
     // Infinite loop until result
     for (;;)
     {
+        // Safepoint: between instructions everything in use is reachable from the stack, globals or constants,
+        // so this is where collections happen (allocating only requests them)
+        // A script that needs more memory than the limit is stopped here, before it can get much further past it
+        if (vm.collectionRequest != GC_NONE && !collectGarbage())
+        {
+            runtimeError("Out of memory (the heap is limited to %zu bytes).", vm.options.memoryLimit);
+            return INTERPRET_RUNTIME_ERROR;
+        }
+
 #ifdef DEBUG_TRACE_EXECUTION
         // Print all values in the stack
         printf("          ");
@@ -181,6 +570,7 @@ static InterpretResult run()
             case OP_DEFINE_GLOBAL: {
                 ObjString* name = READ_STRING();
                 tableSet(&vm.globals, name, peek(0));
+                globalWriteBarrier(name, peek(0));
                 pop();
                 break;
             }
@@ -194,6 +584,7 @@ static InterpretResult run()
                     runtimeError("Undefined variable '%s'.", name->chars);
                     return INTERPRET_RUNTIME_ERROR;
                 }
+                globalWriteBarrier(name, peek(0));
                 break;
             }
 
@@ -213,9 +604,10 @@ static InterpretResult run()
             // TODO: Maybe add bitwise operators
             case OP_ADD:
             {
-                if (IS_STRING(peek(0)) && IS_STRING(peek(1)))
+                if (IS_ANY_STRING(peek(0)) && IS_ANY_STRING(peek(1)))
                 {
-                    concatenate();
+                    if (!concatenate(2))
+                        return INTERPRET_RUNTIME_ERROR;
                 }
                 else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1)))
                 {
@@ -223,18 +615,34 @@ static InterpretResult run()
                     double a = AS_NUMBER(pop());
                     push(NUMBER_VAL(a + b));
                 }
-                else
+                else if (!addValues(2))
                 {
                     // TODO: Maybe be more lenient when one of the two is a string
-                    runtimeError("Operands must be two numbers or two strings.");
                     return INTERPRET_RUNTIME_ERROR;
                 }
                 break;
             }
-            // TODO: Add string index operation []
+            case OP_ADD_N:
+            {
+                if (!addValues(READ_BYTE()))
+                    return INTERPRET_RUNTIME_ERROR;
+                break;
+            }
             case OP_SUBTRACT:
+            {
+                if (IS_FROZEN_MAP(peek(1)))
+                {
+                    // f - key is a copy of the frozen map without key (NaN is never a key, so nothing is removed)
+                    Value key;
+                    ObjFrozenMap* map = AS_FROZEN_MAP(peek(1));
+                    ObjFrozenMap* result = readKey(peek(0), &key) ? hamtRemove(map, key) : map;
+                    vm.stackTop -= 2;
+                    push(OBJ_VAL((Obj*)result));
+                    break;
+                }
                 BINARY_OP(NUMBER_VAL, -);
                 break;
+            }
             case OP_MULTIPLY:
                 BINARY_OP(NUMBER_VAL, *);
                 break;
@@ -257,6 +665,160 @@ static InterpretResult run()
                 break;
             }
 
+            case OP_CONCAT_N:
+                if (!concatenate(READ_BYTE()))
+                    return INTERPRET_RUNTIME_ERROR;
+                break;
+
+            case OP_GET_INDEX:
+            {
+                if (IS_FROZEN_MAP(peek(1)))
+                {
+                    Value key;
+                    Value value;
+                    if (!readKey(peek(0), &key) || !hamtGet(AS_FROZEN_MAP(peek(1)), key, &value))
+                        value = NULL_VAL;
+                    vm.stackTop -= 2;
+                    push(value);
+                    break;
+                }
+
+                if (IS_MAP(peek(1)))
+                {
+                    // A missing key gives null
+                    Value key;
+                    Value value;
+                    if (!readKey(peek(0), &key) || !valueTableGet(&AS_MAP(peek(1))->table, key, &value))
+                        value = NULL_VAL;
+                    vm.stackTop -= 2;
+                    push(value);
+                    break;
+                }
+
+                if (!IS_ANY_STRING(peek(1)))
+                {
+                    runtimeError("Only strings and maps can be indexed.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+
+                // Indices count code points, which are bytes for ASCII strings
+                ObjString* string = asFlatString(peek(1));
+                int index;
+                if (IS_NULL(peek(0)) || !readIndex(peek(0), stringLength(string) - 1, 0, &index))
+                {
+                    runtimeError("Index must be a whole number within the string.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+
+                ObjString* character = sliceString(string, codePointOffset(string, index), codePointOffset(string, index + 1));
+                vm.stackTop -= 2;
+                push(OBJ_VAL((Obj*)character));
+                break;
+            }
+            case OP_SLICE:
+            {
+                if (!IS_ANY_STRING(peek(2)))
+                {
+                    runtimeError("Only strings can be sliced.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+
+                // The slice references the string's characters, so this takes constant time
+                // (unless the slice is small enough that copying it is just as cheap)
+                ObjString* string = asFlatString(peek(2));
+                int length = stringLength(string);
+                int start;
+                int end;
+                if (!readIndex(peek(1), length, 0, &start) ||
+                    !readIndex(peek(0), length, length, &end) || start > end)
+                {
+                    runtimeError("Slice bounds must be whole numbers within the string, in order.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+
+                ObjString* slice = sliceString(string, codePointOffset(string, start), codePointOffset(string, end));
+                vm.stackTop -= 3;
+                push(OBJ_VAL((Obj*)slice));
+                break;
+            }
+
+            case OP_MAP:
+            {
+                int pairs = READ_BYTE();
+                Value* entries = vm.stackTop - 2 * pairs;
+
+                ObjMap* map = newMap();
+                for (int i = 0; i < pairs; i++)
+                {
+                    Value key;
+                    if (!readKey(entries[2 * i], &key))
+                    {
+                        runtimeError("Map key can't be NaN.");
+                        return INTERPRET_RUNTIME_ERROR;
+                    }
+                    valueTableSet(&map->table, key, entries[2 * i + 1]);
+                }
+
+                vm.stackTop = entries;
+                push(OBJ_VAL((Obj*)map));
+                break;
+            }
+            case OP_SET_INDEX:
+            {
+                if (IS_FROZEN_MAP(peek(2)))
+                {
+                    runtimeError("Frozen maps can't be changed, add to them with + or remove with - to get a copy.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                if (!IS_MAP(peek(2)))
+                {
+                    runtimeError("Only maps can be assigned to by index.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+
+                Value key;
+                if (!readKey(peek(1), &key))
+                {
+                    runtimeError("Map key can't be NaN.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+
+                // The assignment's value stays on the stack as its result
+                Value value = peek(0);
+                ObjMap* map = AS_MAP(peek(2));
+                valueTableSet(&map->table, key, value);
+                writeBarrier((Obj*)map, key);
+                writeBarrier((Obj*)map, value);
+                vm.stackTop -= 3;
+                push(value);
+                break;
+            }
+
+            case OP_FROZEN_MAP:
+            {
+                int pairs = READ_BYTE();
+                Value* entries = vm.stackTop - 2 * pairs;
+
+                // Built in place, since nothing else can see the map yet
+                HamtBuilder builder;
+                initHamtBuilder(&builder, NULL);
+                for (int i = 0; i < pairs; i++)
+                {
+                    Value key;
+                    if (!readKey(entries[2 * i], &key))
+                    {
+                        runtimeError("Map key can't be NaN.");
+                        return INTERPRET_RUNTIME_ERROR;
+                    }
+                    hamtBuilderSet(&builder, key, entries[2 * i + 1]);
+                }
+
+                ObjFrozenMap* map = finishHamtBuilder(&builder);
+                vm.stackTop = entries;
+                push(OBJ_VAL((Obj*)map));
+                break;
+            }
+
             case OP_PRINT: {
                 printValue(pop());
                 printf("\n");
@@ -278,23 +840,46 @@ static InterpretResult run()
 #undef BINARY_OP
 }
 
-InterpretResult interpret(const char* source)
+InterpretResult interpret(const char* source, int line)
 {
     Chunk chunk;
     initChunk(&chunk);
 
+    // The chunk's constants are roots until the call is over
+    vm.chunk = &chunk;
+
     // Fill the chunk with compiled bytecode
-    if (!compile(source, &chunk))
+    if (!compile(source, line, &chunk))
     {
+        releaseCallMemory();
         freeChunk(&chunk);
         return INTERPRET_COMPILE_ERROR;
     }
 
-    vm.chunk = &chunk;
     vm.ip = vm.chunk->code;
 
-    InterpretResult result = run();
+    // An allocation that fails in the middle of an instruction comes back here and stops the script
+    // (allocating is the last thing the VM's structures wait on, so they're still whole)
+    jmp_buf allocationFailure;
+    InterpretResult result;
+    int failure = setjmp(allocationFailure);
+    if (failure == 0)
+    {
+        vm.allocationFailure = &allocationFailure;
+        result = run();
+    }
+    else
+    {
+        if (failure == ALLOCATION_OVER_LIMIT)
+            runtimeError("Out of memory (the heap is limited to %zu bytes).", vm.options.memoryLimit);
+        else
+            runtimeError("Out of memory.");
+        result = INTERPRET_RUNTIME_ERROR;
+    }
+    vm.allocationFailure = NULL;
+    vm.ip = NULL;
 
+    releaseCallMemory();
     freeChunk(&chunk);
     return result;
 }
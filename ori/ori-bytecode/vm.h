@@ -1,18 +1,40 @@
 #ifndef ori_vm_h
 #define ori_vm_h
 
+#include <setjmp.h>
+
 #include "chunk.h"
+#include "memory.h"
+#include "object.h"
+#include "profiler.h"
 #include "table.h"
 #include "value.h"
 
 // TODO: Should there be a dynamic stack (still with a max amount but bigger than this)
 #define STACK_MAX 256
 
+// How the VM is set up (from ori's command line options, see main.c)
+typedef struct
+{
+    // Whether each call to interpret gets its memory from arenas that are emptied when it returns (see memory.h)
+    bool useArenas;
+    // Most bytes the heap may hold (SIZE_MAX for no limit)
+    // A script fails with a runtime error as soon as it would go over it: when an allocation can't fit
+    // (see reallocate), or at a safepoint where a full collection can't bring the heap back under it
+    // Compiling isn't limited, the script's first instruction stops it if that took too much
+    size_t memoryLimit;
+    // Whether to print the memory statistics when the VM is freed
+    bool printMemoryStats;
+    // Where to write the allocation profile when the VM is freed (NULL to not profile allocations)
+    const char* allocationProfilePath;
+} VMOptions;
+
 typedef struct
 {
+    VMOptions options;
     Chunk* chunk;
     // Instruction Pointer
-    // Pointer to the location of the instruction that is currently being executed
+    // Pointer to the location of the instruction that is currently being executed (NULL when no chunk is running)
     uint8_t* ip;
     // Stack of current values (0 is bottom)
     Value stack[STACK_MAX];
@@ -20,10 +42,51 @@ typedef struct
     Value* stackTop;
     // Global variables
     Table globals;
-    // Hash Table of ALL strings for string interning
+    // Hash Table of all symbols (identifiers and literals) for string interning
+    // NOTE: Strings created at runtime are not interned, most of them are never compared or used as keys
     Table strings;
-    // A linked list of all dynamically allocated Objs
-    Obj* objects;
+    // Old objects, in regions by size class, and the large ones
+    SizeClass sizeClasses[SIZE_CLASS_COUNT];
+    ObjArray largeObjects;
+    // Bytes in allocated cells of regions, and in those the last full collection marked
+    size_t cellBytes;
+    size_t markedBytes;
+#ifdef SLAB_ALLOCATOR
+    // Small blocks allocated through reallocate, by size class, and the list of all slabs (see memory.h)
+    SlabClass slabClasses[SIZE_CLASS_COUNT];
+    void* slabs;
+#endif
+    // Where new objects are allocated (see memory.c)
+    Arena nursery;
+    // Where the arrays of the chunk being run are allocated when using arenas
+    Arena scratch;
+    // Bytes allocated through reallocate, and how many of them trigger the next full collection
+    size_t bytesAllocated;
+    size_t nextGC;
+    // Collection to run at the next safepoint
+    CollectionKind collectionRequest;
+    // Where a failed allocation jumps back to while a chunk runs (NULL otherwise, see interpret)
+    jmp_buf* allocationFailure;
+    // Old objects that may point to young ones (see writeBarrier)
+    ObjArray remembered;
+    // Globals that may hold young objects (by name), the only ones minor collections trace (see globalWriteBarrier)
+    ObjArray youngGlobals;
+    // Young objects that own memory outside of the nursery (see trackYoungOwner)
+    ObjArray youngOwners;
+    // Objects the collector has reached but whose references it hasn't traced yet
+    ObjArray grayStack;
+    MemoryStats memoryStats;
+    // Allocations by source line (with the allocationProfilePath option)
+    AllocationProfile allocationProfile;
+#ifdef DEBUG_GC_STATS
+    GcStats gcStats;
+#endif
+    // Literal region holding the characters of all static strings (most recent block first)
+    LiteralBlock* literals;
+    // Random secrets for the string hashes, picked when the VM starts so they're different for every process
+    // (hashSeed for the fast hash of every string, sipKey for the keyed hash of tables under a collision attack)
+    uint64_t hashSeed[2];
+    uint64_t sipKey[2];
 } VM;
 
 typedef enum
@@ -36,10 +99,11 @@ typedef enum
 // Expose the vm externally (object.c uses it)
 extern VM vm;
 
-void initVM();
+void initVM(VMOptions options);
 void freeVM();
 // Interpret the given source code
-InterpretResult interpret(const char* source);
+// (line is the line number of the first line of source, used for error reporting)
+InterpretResult interpret(const char* source, int line);
 // Push the given value to the top of the stack
 void push(Value value);
 // Pop the top value off the stack